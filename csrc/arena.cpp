@@ -0,0 +1,60 @@
+#include "arena.h"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// smallest block is 64 bytes, so that blocks never share a cache line
+static const int MIN_CLASS = 6;
+
+static std::atomic<size_t> total_reserved{0};
+
+ScratchArena::~ScratchArena() {
+    total_reserved -= _reserved;
+    for (auto &blocks: _free)
+        for (auto block: blocks)
+            free(block);
+}
+
+ScratchArena &ScratchArena::local() {
+    static thread_local ScratchArena arena;
+    return arena;
+}
+
+void *ScratchArena::acquire(size_t size) {
+    const int size_class = _sizeClass(size);
+    if (size_class < _free.size() and not _free[size_class].empty()) {
+        void *block = _free[size_class].back();
+        _free[size_class].pop_back();
+        return block;
+    }
+
+    void *block = nullptr;
+    if (posix_memalign(&block, 64, size_t(1) << size_class) != 0)
+        throw std::bad_alloc();
+    _reserved += size_t(1) << size_class;
+    total_reserved += size_t(1) << size_class;
+    return block;
+}
+
+void ScratchArena::release(void *block, size_t size) {
+    // blocks are kept until the thread exits
+    const int size_class = _sizeClass(size);
+    if (size_class >= _free.size())
+        _free.resize(size_class + 1);
+    _free[size_class].push_back(block);
+}
+
+size_t ScratchArena::reserved() const {
+    return _reserved;
+}
+
+size_t ScratchArena::totalReserved() {
+    return total_reserved;
+}
+
+int ScratchArena::_sizeClass(size_t size) {
+    int size_class = MIN_CLASS;
+    while ((size_t(1) << size_class) < size)
+        size_class++;
+    return size_class;
+}
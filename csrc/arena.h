@@ -0,0 +1,57 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class ScratchArena {
+public:
+    // Scratch memory of one thread. Blocks are kept in free lists by power of two
+    // size classes and reused, an arena stops allocating once it has grown to the
+    // high water mark of its thread.
+    ScratchArena() = default;
+    ScratchArena(const ScratchArena &) = delete;
+    ScratchArena &operator=(const ScratchArena &) = delete;
+    ~ScratchArena();
+
+    // arena of the calling thread, pool workers and openmp threads keep theirs across calls
+    static ScratchArena &local();
+
+    void *acquire(size_t size);
+    void release(void *block, size_t size);
+
+    // bytes held by the arena, in use or free
+    size_t reserved() const;
+
+    // bytes held by the arenas of all threads alive
+    static size_t totalReserved();
+
+private:
+    std::vector<std::vector<void *>> _free;
+    size_t _reserved = 0;
+
+    static int _sizeClass(size_t size);
+};
+
+template<typename T>
+class ScratchBuffer {
+public:
+    // n items of trivial type T from the arena of the calling thread, not initialized
+    explicit ScratchBuffer(size_t n)
+    : _size(n), _data(static_cast<T *>(ScratchArena::local().acquire(n * sizeof(T)))) {}
+    ScratchBuffer(const ScratchBuffer &) = delete;
+    ScratchBuffer &operator=(const ScratchBuffer &) = delete;
+    ~ScratchBuffer() { ScratchArena::local().release(_data, _size * sizeof(T)); }
+
+    T *data() { return _data; }
+    size_t size() const { return _size; }
+    T &operator[](size_t i) { return _data[i]; }
+    const T &operator[](size_t i) const { return _data[i]; }
+
+private:
+    size_t _size;
+    T *_data;
+};
+
+#endif //ARENA_H
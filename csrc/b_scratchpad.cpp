@@ -1,7 +1,22 @@
 #include "b_scratchpad.h"
 #include "util.h"
 #include <fmt/format.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
 #include <functional>
+#include <map>
+#include <set>
+#include <thread>
+
+#ifdef __linux__
+
+#include <sched.h>
+
+#endif
 
 #ifdef USE_OPENMP
 
@@ -11,59 +26,264 @@
 
 extern int omp_max_threads;
 
-BatchedScratchPad::BatchedScratchPad(int pad_num)
-: _pool(pad_num), _pads(pad_num) {}
+static int physical_core_num() {
+    // number of distinct (physical id, core id) pairs among the cpus this process may run on,
+    // limited by the cgroup cpu quota, the allowed logical cpus if unknown
+    int logical = std::max(std::thread::hardware_concurrency(), 1u);
+    std::vector<bool> allowed;
+#ifdef __linux__
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    if (sched_getaffinity(0, sizeof(cpu_set), &cpu_set) == 0) {
+        logical = std::max(CPU_COUNT(&cpu_set), 1);
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            allowed.push_back(CPU_ISSET(cpu, &cpu_set));
+    }
+#endif
+
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::set<std::pair<int, int>> cores;
+    std::string line;
+    int processor = -1, physical_id = 0;
+    while (std::getline(cpuinfo, line)) {
+        auto colon = line.find(':');
+        if (colon == std::string::npos)
+            continue;
+        if (line.compare(0, 9, "processor") == 0)
+            processor = std::atoi(line.c_str() + colon + 1);
+        else if (line.compare(0, 11, "physical id") == 0)
+            physical_id = std::atoi(line.c_str() + colon + 1);
+        else if (line.compare(0, 7, "core id") == 0 and
+                 (allowed.empty() or (processor >= 0 and processor < allowed.size() and allowed[processor])))
+            cores.emplace(physical_id, std::atoi(line.c_str() + colon + 1));
+    }
+    int core_num = cores.empty() ? logical : std::min((int) cores.size(), logical);
+
+    // cgroup v2 quota and period in microseconds, the quota is "max" when unlimited
+    std::ifstream cpu_max("/sys/fs/cgroup/cpu.max");
+    std::string quota;
+    long period = 0;
+    if (cpu_max >> quota >> period and quota != "max" and period > 0)
+        core_num = std::min<long>(core_num, std::max((std::atol(quota.c_str()) + period - 1) / period, 1l));
+    return core_num;
+}
+
+static int check_pad_config(int pad_num, int thread_num) {
+    // checked before the pads and workers are created
+    if (pad_num <= 0)
+        throw std::invalid_argument("Pad num must be a number larger than 0!");
+    if (thread_num < 0)
+        throw std::invalid_argument("Thread num must be 0 (number of physical cores) or larger!");
+    return pad_num;
+}
+
+static void init_worker(size_t) {
+    // pads are already run in parallel by the workers, openmp loops inside them
+    // run on the worker alone so that the pool keeps to its thread budget
+    omp_set_num_threads(1);
+}
+
+template<typename Counter, typename F>
+static void post_counted(Strand<ThreadPoolConcurrent<>> &strand, Counter &latch, F &&f) {
+    // f runs on the strand, the latch keeps its error and is counted down once it is done
+    try {
+        strand.post([&latch, f]() {
+            try {
+                f();
+            }
+            catch (...) {
+                latch.setError(std::current_exception());
+            }
+            latch.countDown();
+        });
+    }
+    catch (...) {
+        latch.setError(std::current_exception());
+        latch.countDown();
+    }
+}
+
+BatchedScratchPad::BatchedScratchPad(int pad_num, int thread_num)
+: _pads(check_pad_config(pad_num, thread_num)),
+  _pool(thread_num > 0 ? thread_num : physical_core_num(), WAIT_PARK, init_worker) {
+    // any number of pads are multiplexed on a fixed number of workers
+    for (int i = 0; i < pad_num; i++)
+        _strands.emplace_back(new Strand<ThreadPoolConcurrent<>>(_pool));
+}
+
+BatchedScratchPad::~BatchedScratchPad() {
+    // async work still running must not outlive the pads and strands, the GIL is
+    // released meanwhile as the last task of an awaited handle takes it
+    std::vector<int> pad;
+    for (int i = 0; i < _pads.size(); i++)
+        pad.push_back(i);
+    if (PyGILState_Check()) {
+        py::gil_scoped_release release;
+        _fence(pad);
+    }
+    else
+        _fence(pad);
+    // a drain touches its strand once more after its last task
+    for (auto &strand: _strands)
+        while (strand->pending() > 0)
+            std::this_thread::yield();
+}
 
 
 void BatchedScratchPad::loadBrush(const std::string &brush_string) {
-    std::vector<std::future<void>> results;
-    for(auto &pad: _pads)
-        results.emplace_back(_pool.enqueue(&ScratchPad::loadBrush, &pad, brush_string));
-    for(auto &fut: results)
-        fut.get();
+    Latch latch(_pads.size());
+    for(size_t i=0; i<_pads.size(); i++) {
+        auto pad_ptr = &_pads[i];
+        post_counted(*_strands[i], latch, [pad_ptr, &brush_string] { pad_ptr->loadBrush(brush_string); });
+    }
+    latch.wait();
     _brush_num++;
 }
 
 void BatchedScratchPad::resetAllPads(int width, int height, int layers) {
-    std::vector<std::future<void>> results;
-    for(auto &pad: _pads)
-        results.emplace_back(_pool.enqueue(&ScratchPad::resetPad, &pad, width, height, layers));
-    for(auto &fut: results)
-        fut.get();
+    Latch latch(_pads.size());
+    for(size_t i=0; i<_pads.size(); i++) {
+        auto pad_ptr = &_pads[i];
+        post_counted(*_strands[i], latch, [pad_ptr, width, height, layers] {
+            pad_ptr->resetPad(width, height, layers);
+        });
+    }
+    latch.wait();
 }
 
 void BatchedScratchPad::resetPad(int pad, int width, int height, int layers) {
     if (pad >= _pads.size() or pad < 0)
         throw py::index_error();
     auto pad_ptr = &_pads[pad];
-    _pool.enqueue(&ScratchPad::resetPad, pad_ptr, width, height, layers).get();
+    Latch latch(1);
+    post_counted(*_strands[pad], latch, [pad_ptr, width, height, layers] { pad_ptr->resetPad(width, height, layers); });
+    latch.wait();
 }
 
 void BatchedScratchPad::addLayer(int pad) {
     if (pad >= _pads.size() or pad < 0)
         throw py::index_error();
     auto pad_ptr = &_pads[pad];
-    _pool.enqueue(&ScratchPad::addLayer, pad_ptr).get();
+    Latch latch(1);
+    post_counted(*_strands[pad], latch, [pad_ptr] { pad_ptr->addLayer(); });
+    latch.wait();
 }
 
 void BatchedScratchPad::setOpacity(int pad, int layer, float opacity) {
     if (pad >= _pads.size() or pad < 0)
         throw py::index_error();
     auto pad_ptr = &_pads[pad];
-    _pool.enqueue(&ScratchPad::setOpacity, pad_ptr, layer, opacity).get();
+    Latch latch(1);
+    post_counted(*_strands[pad], latch, [pad_ptr, layer, opacity] { pad_ptr->setOpacity(layer, opacity); });
+    latch.wait();
 }
 
 void BatchedScratchPad::popLayer(int pad, int layer) {
     if (pad >= _pads.size() or pad < 0)
         throw py::index_error();
     auto pad_ptr = &_pads[pad];
-    _pool.enqueue(&ScratchPad::popLayer, pad_ptr, layer).get();
+    Latch latch(1);
+    post_counted(*_strands[pad], latch, [pad_ptr, layer] { pad_ptr->popLayer(layer); });
+    latch.wait();
+}
+
+void BatchedScratchPad::setLayer(const std::vector<int> &pad, const std::vector<int> &layer,
+                                 const std::vector<py::object> &image) {
+    if (pad.size() != layer.size() or pad.size() != image.size())
+        throw std::invalid_argument("Size of pad ids, layer ids and images doesn't match!");
+    for (auto i: pad) {
+        if (i >= _pads.size() or i < 0)
+            throw py::index_error();
+    }
+    std::vector<py::array> buffers(image.size());
+    std::vector<LayerImage> views;
+    for (size_t i = 0; i < image.size(); i++)
+        views.push_back(ScratchPad::_checkImage(image[i], buffers[i]));
+    {
+        py::gil_scoped_release release;
+        Latch latch(pad.size());
+        for (size_t i = 0; i < pad.size(); i++) {
+            auto pad_ptr = &_pads[pad[i]];
+            auto layer_idx = layer[i];
+            auto view = &views[i];
+            post_counted(*_strands[pad[i]], latch, [pad_ptr, layer_idx, view] { pad_ptr->setLayer(layer_idx, *view); });
+        }
+        // tasks read the images, all of them must finish before an error is rethrown
+        latch.wait();
+    }
+}
+
+void BatchedScratchPad::setTemplate(int pad, const std::vector<int> &layers) {
+    // the template is made from layers of one pad, and shared by all pads
+    if (pad >= _pads.size() or pad < 0)
+        throw py::index_error();
+    auto pad_ptr = &_pads[pad];
+    std::shared_ptr<const PadTemplate> pad_template;
+    {
+        Latch latch(1);
+        post_counted(*_strands[pad], latch, [pad_ptr, &layers, &pad_template] {
+            pad_template = pad_ptr->_makeTemplate(layers);
+        });
+        latch.wait();
+    }
+    Latch latch(_pads.size());
+    for (size_t i = 0; i < _pads.size(); i++) {
+        auto target_ptr = &_pads[i];
+        post_counted(*_strands[i], latch, [target_ptr, &pad_template] { target_ptr->_setTemplate(pad_template); });
+    }
+    latch.wait();
+}
+
+void BatchedScratchPad::resetFromTemplate(const std::vector<int> &pad) {
+    // all pads if none is given
+    std::vector<int> pad_ids = pad;
+    if (pad_ids.empty()) {
+        for (int i = 0; i < _pads.size(); i++)
+            pad_ids.push_back(i);
+    }
+    for (auto i: pad_ids) {
+        if (i >= _pads.size() or i < 0)
+            throw py::index_error();
+    }
+    Latch latch(pad_ids.size());
+    for (auto i: pad_ids) {
+        auto pad_ptr = &_pads[i];
+        post_counted(*_strands[i], latch, [pad_ptr] { pad_ptr->resetFromTemplate(); });
+    }
+    latch.wait();
 }
 
 int BatchedScratchPad::getPadNum() {
     return _pads.size();
 }
 
+int BatchedScratchPad::getThreadNum() {
+    return _pool.size();
+}
+
+void BatchedScratchPad::setWaitPolicy(const std::string &policy) {
+    if (policy == "spin")
+        _pool.setWaitPolicy(WAIT_SPIN);
+    else if (policy == "spin_yield")
+        _pool.setWaitPolicy(WAIT_SPIN_YIELD);
+    else if (policy == "park")
+        _pool.setWaitPolicy(WAIT_PARK);
+    else
+        throw std::invalid_argument(fmt::format("Invalid wait policy {}, must be one of spin, spin_yield, park!",
+                                                policy));
+}
+
+std::string BatchedScratchPad::getWaitPolicy() {
+    switch (_pool.getWaitPolicy()) {
+        case WAIT_SPIN:
+            return "spin";
+        case WAIT_SPIN_YIELD:
+            return "spin_yield";
+        default:
+            return "park";
+    }
+}
+
 int BatchedScratchPad::getBrushNum() {
     return _brush_num;
 }
@@ -72,14 +292,22 @@ int BatchedScratchPad::getLayerNum(int pad) {
     if (pad >= _pads.size() or pad < 0)
         throw py::index_error();
     auto pad_ptr = &_pads[pad];
-    return _pool.enqueue(&ScratchPad::getLayerNum, pad_ptr).get();
+    int layer_num = 0;
+    Latch latch(1);
+    post_counted(*_strands[pad], latch, [pad_ptr, &layer_num] { layer_num = pad_ptr->getLayerNum(); });
+    latch.wait();
+    return layer_num;
 }
 
 std::tuple<int, int> BatchedScratchPad::getPadSize(int pad) {
     if (pad >= _pads.size() or pad < 0)
         throw py::index_error();
     auto pad_ptr = &_pads[pad];
-    return _pool.enqueue(&ScratchPad::getPadSize, pad_ptr).get();
+    std::tuple<int, int> pad_size;
+    Latch latch(1);
+    post_counted(*_strands[pad], latch, [pad_ptr, &pad_size] { pad_size = pad_ptr->getPadSize(); });
+    latch.wait();
+    return pad_size;
 }
 
 void BatchedScratchPad::draw(const std::vector<int> &pad,
@@ -93,107 +321,773 @@ void BatchedScratchPad::draw(const std::vector<int> &pad,
         pad.size() != points.size())
         throw std::invalid_argument("Size of pad ids, layer ids, brush ids, settings and points "
                                     "doesn't match!");
-    std::vector<std::future<void>> results;
-    for(size_t i=0; i<pad.size(); i++) {
-        int pad_idx = pad[i];
-        if (pad_idx >= _pads.size() or pad_idx < 0)
-            throw py::index_error();
-        results.emplace_back(
-                _pool.enqueue(&ScratchPad::draw,
-                              &_pads[pad_idx], layer[i], brush[i], setting[i], points[i]));
+    std::vector<Stroke> strokes;
+    for (size_t i = 0; i < pad.size(); i++)
+        strokes.push_back(Stroke{layer[i], brush[i], setting[i], ScratchPad::_pointView(points[i])});
+    _draw(pad, strokes);
+}
+
+void BatchedScratchPad::drawArray(const std::vector<int> &pad,
+                                  const std::vector<int> &layer,
+                                  const std::vector<int> &brush,
+                                  const py::object &setting,
+                                  const py::object &points,
+                                  const py::object &offsets) {
+    if (pad.size() != layer.size())
+        throw std::invalid_argument("Size of pad ids and layer ids doesn't match!");
+    std::vector<py::array> buffers;
+    auto strokes = ScratchPad::_checkStrokes(layer, brush, setting, points, offsets, buffers);
+    {
+        py::gil_scoped_release release;
+        _draw(pad, strokes);
+    }
+}
+
+void BatchedScratchPad::drawStrokes(
+        const std::vector<int> &pad,
+        const std::vector<std::vector<std::tuple<int, int, Setting, std::vector<Point>>>> &strokes) {
+    if (pad.size() != strokes.size())
+        throw std::invalid_argument("Size of pad ids and stroke lists doesn't match!");
+    std::vector<int> stroke_pad;
+    std::vector<Stroke> views;
+    for (size_t i = 0; i < pad.size(); i++) {
+        for (auto &stroke: strokes[i]) {
+            stroke_pad.push_back(pad[i]);
+            views.push_back(Stroke{std::get<0>(stroke), std::get<1>(stroke), std::get<2>(stroke),
+                                   ScratchPad::_pointView(std::get<3>(stroke))});
+        }
     }
-    for(auto &fut: results)
-        fut.get();
+    _draw(stroke_pad, views);
+}
+
+AsyncHandle BatchedScratchPad::drawAsync(const std::vector<int> &pad,
+                                         const std::vector<int> &layer,
+                                         const std::vector<int> &brush,
+                                         const std::vector<Setting> &setting,
+                                         const std::vector<std::vector<Point>> &points) {
+    if (pad.size() != layer.size() or
+        pad.size() != brush.size() or
+        pad.size() != setting.size() or
+        pad.size() != points.size())
+        throw std::invalid_argument("Size of pad ids, layer ids, brush ids, settings and points "
+                                    "doesn't match!");
+    // points are kept by the handle until the strokes are drawn
+    auto owned = std::make_shared<std::vector<std::vector<Point>>>(points);
+    std::vector<Stroke> strokes;
+    for (size_t i = 0; i < pad.size(); i++)
+        strokes.push_back(Stroke{layer[i], brush[i], setting[i], ScratchPad::_pointView((*owned)[i])});
+    AsyncHandle handle(py::none(), owned);
+    handle._start(_drawTasks(pad, strokes));
+    return handle;
+}
+
+AsyncHandle BatchedScratchPad::drawArrayAsync(const std::vector<int> &pad,
+                                              const std::vector<int> &layer,
+                                              const std::vector<int> &brush,
+                                              const py::object &setting,
+                                              const py::object &points,
+                                              const py::object &offsets) {
+    if (pad.size() != layer.size())
+        throw std::invalid_argument("Size of pad ids and layer ids doesn't match!");
+    std::vector<py::array> buffers;
+    auto strokes = ScratchPad::_checkStrokes(layer, brush, setting, points, offsets, buffers);
+    AsyncHandle handle(py::none(), nullptr, std::move(buffers));
+    handle._start(_drawTasks(pad, strokes));
+    return handle;
 }
 
 std::vector<py::array> BatchedScratchPad::renderLayer(const std::vector<int> &pad,
                                                       const std::vector<int> &layer,
-                                                      const py::object &dt) {
-    auto dtype = py::dtype::from_args(dt);
-    if (dtype.has_fields())
-        throw std::invalid_argument("Only support rendering as a flat floating array or integral array!");
+                                                      const py::object &dt,
+                                                      const py::object &out_size,
+                                                      const std::string &filter,
+                                                      const std::string &layout,
+                                                      const std::string &channels,
+                                                      const py::object &background,
+                                                      const py::object &mean,
+                                                      const py::object &stddev,
+                                                      const std::string &encoding) {
+    auto results = _allocOutputs(pad, dt, out_size, filter, layout, channels, background, mean, stddev, encoding);
+    renderLayerInto(pad, layer, results, out_size, filter, layout, channels, background, mean, stddev, encoding);
+    return results;
+}
+
+void BatchedScratchPad::renderLayerInto(const std::vector<int> &pad,
+                                        const std::vector<int> &layer,
+                                        const std::vector<py::array> &out,
+                                        const py::object &out_size,
+                                        const std::string &filter,
+                                        const std::string &layout,
+                                        const std::string &channels,
+                                        const py::object &background,
+                                        const py::object &mean,
+                                        const py::object &stddev,
+                                        const std::string &encoding) {
+    if (pad.size() != layer.size() or pad.size() != out.size())
+        throw std::invalid_argument("Size of pad ids, layer ids and output arrays doesn't match!");
+    _renderTargets(pad, layer, out, out_size, filter, layout, channels, background, mean, stddev, encoding);
+}
+
+py::array BatchedScratchPad::renderLayerBatch(const std::vector<int> &pad,
+                                              const std::vector<int> &layer,
+                                              const py::object &dt,
+                                              const py::object &out_size,
+                                              const std::string &filter,
+                                              const std::string &layout,
+                                              const std::string &channels,
+                                              const py::object &background,
+                                              const py::object &mean,
+                                              const py::object &stddev,
+                                              const std::string &encoding) {
+    auto out = _allocBatchOutput(pad, dt, out_size, filter, layout, channels, background, mean, stddev, encoding);
+    renderLayerBatchInto(pad, layer, out, out_size, filter, layout, channels, background, mean, stddev, encoding);
+    return out;
+}
+
+void BatchedScratchPad::renderLayerBatchInto(const std::vector<int> &pad,
+                                             const std::vector<int> &layer,
+                                             py::array &out,
+                                             const py::object &out_size,
+                                             const std::string &filter,
+                                             const std::string &layout,
+                                             const std::string &channels,
+                                             const py::object &background,
+                                             const py::object &mean,
+                                             const py::object &stddev,
+                                             const std::string &encoding) {
     if (pad.size() != layer.size())
         throw std::invalid_argument("Size of pad ids and layer ids doesn't match!");
+    _renderBatchTargets(pad, layer, out, out_size, filter, layout, channels, background, mean, stddev, encoding);
+}
+
+std::vector<py::array> BatchedScratchPad::render(const std::vector<int> &pad,
+                                                 const py::object &dt,
+                                                 const py::object &out_size,
+                                                 const std::string &filter,
+                                                 const std::string &layout,
+                                                 const std::string &channels,
+                                                 const py::object &background,
+                                                 const py::object &mean,
+                                                 const py::object &stddev,
+                                                 const std::string &encoding) {
+    auto results = _allocOutputs(pad, dt, out_size, filter, layout, channels, background, mean, stddev, encoding);
+    renderInto(pad, results, out_size, filter, layout, channels, background, mean, stddev, encoding);
+    return results;
+}
 
-    std::vector<std::future<void*>> futures;
-    std::vector<void*> arrays;
-    std::vector<py::array> ret_results;
+void BatchedScratchPad::renderInto(const std::vector<int> &pad,
+                                   const std::vector<py::array> &out,
+                                   const py::object &out_size,
+                                   const std::string &filter,
+                                   const std::string &layout,
+                                   const std::string &channels,
+                                   const py::object &background,
+                                   const py::object &mean,
+                                   const py::object &stddev,
+                                   const std::string &encoding) {
+    if (pad.size() != out.size())
+        throw std::invalid_argument("Size of pad ids and output arrays doesn't match!");
+    _renderTargets(pad, {}, out, out_size, filter, layout, channels, background, mean, stddev, encoding);
+}
+
+py::array BatchedScratchPad::renderBatch(const std::vector<int> &pad,
+                                         const py::object &dt,
+                                         const py::object &out_size,
+                                         const std::string &filter,
+                                         const std::string &layout,
+                                         const std::string &channels,
+                                         const py::object &background,
+                                         const py::object &mean,
+                                         const py::object &stddev,
+                                         const std::string &encoding) {
+    auto out = _allocBatchOutput(pad, dt, out_size, filter, layout, channels, background, mean, stddev, encoding);
+    renderBatchInto(pad, out, out_size, filter, layout, channels, background, mean, stddev, encoding);
+    return out;
+}
+
+void BatchedScratchPad::renderBatchInto(const std::vector<int> &pad,
+                                        py::array &out,
+                                        const py::object &out_size,
+                                        const std::string &filter,
+                                        const std::string &layout,
+                                        const std::string &channels,
+                                        const py::object &background,
+                                        const py::object &mean,
+                                        const py::object &stddev,
+                                        const std::string &encoding) {
+    _renderBatchTargets(pad, {}, out, out_size, filter, layout, channels, background, mean, stddev, encoding);
+}
+
+py::array BatchedScratchPad::layerView(int pad, int layer) {
+    // work already submitted to the pad is finished first, later work writes through the view
+    if (pad >= _pads.size() or pad < 0)
+        throw py::index_error();
     {
         py::gil_scoped_release release;
-        for (int idx=0; idx < pad.size(); idx++) {
-            int pad_idx = pad[idx];
-            int layer_idx = layer[idx];
-            if (pad_idx >= _pads.size() or pad_idx < 0)
-                throw std::out_of_range(fmt::format("Invalid pad index {}", pad_idx));
-            futures.emplace_back(
-                    _pool.enqueue(
-                            [](ScratchPad *pad, int layer, char kind, int item_size, int thread_num) {
-                                omp_set_num_threads(thread_num);
-                                return pad->renderLayer(layer, kind, item_size);
-                            },
-                            &_pads[pad_idx], layer_idx, dtype.kind(), dtype.itemsize(), omp_max_threads)
-            );
-        }
-        for (auto &fut: futures) {
-            arrays.push_back(fut.get());
-        }
+        _holdPads({pad});
+    }
+    try {
+        auto view = _pads[pad].layerView(layer);
+        _releasePads({pad});
+        return view;
     }
-    for(int idx = 0; idx<pad.size(); idx++) {
-        int width = std::get<0>(_pads[pad[idx]].getPadSize());
-        int height = std::get<1>(_pads[pad[idx]].getPadSize());
-        int real_width = ALIGN(width, MYPAINT_TILE_SIZE);
-        auto capsule = py::capsule(arrays[idx], [](void *v) { free(v); });
-        ret_results.emplace_back(py::array(dtype,
-                                           {height, width, 4},
-                                           {real_width * 4 * dtype.itemsize(),
-                                            4 * dtype.itemsize(),
-                                            dtype.itemsize()},
-                                           arrays[idx], capsule));
+    catch (...) {
+        _releasePads({pad});
+        throw;
     }
+}
 
-    return std::move(ret_results);
+AsyncHandle BatchedScratchPad::renderAsync(const std::vector<int> &pad,
+                                           const py::object &dt,
+                                           const py::object &out_size,
+                                           const std::string &filter,
+                                           const std::string &layout,
+                                           const std::string &channels,
+                                           const py::object &background,
+                                           const py::object &mean,
+                                           const py::object &stddev,
+                                           const std::string &encoding) {
+    auto results = _allocOutputs(pad, dt, out_size, filter, layout, channels, background, mean, stddev, encoding);
+    AsyncHandle handle(py::cast(results));
+    _renderTargets(pad, {}, results, out_size, filter, layout, channels, background, mean, stddev, encoding,
+                   &handle);
+    return handle;
 }
 
-std::vector<py::array> BatchedScratchPad::render(const std::vector<int> &pad,
-                                                 const py::object &dt) {
+AsyncHandle BatchedScratchPad::renderBatchAsync(const std::vector<int> &pad,
+                                                const py::object &dt,
+                                                const py::object &out_size,
+                                                const std::string &filter,
+                                                const std::string &layout,
+                                                const std::string &channels,
+                                                const py::object &background,
+                                                const py::object &mean,
+                                                const py::object &stddev,
+                                                const std::string &encoding) {
+    auto out = _allocBatchOutput(pad, dt, out_size, filter, layout, channels, background, mean, stddev, encoding);
+    AsyncHandle handle(out);
+    _renderBatchTargets(pad, {}, out, out_size, filter, layout, channels, background, mean, stddev, encoding,
+                        &handle);
+    return handle;
+}
+
+py::array BatchedScratchPad::step(const std::vector<int> &pad,
+                                  const std::vector<int> &layer,
+                                  const std::vector<int> &brush,
+                                  const py::object &setting,
+                                  const py::object &points,
+                                  const py::object &offsets,
+                                  const py::object &dt,
+                                  const py::object &out,
+                                  const py::object &out_size,
+                                  const std::string &filter,
+                                  const std::string &layout,
+                                  const std::string &channels,
+                                  const py::object &background,
+                                  const py::object &mean,
+                                  const py::object &stddev,
+                                  const std::string &encoding) {
+    // Draws the strokes, then renders every pad they were drawn on to out[k], the k-th
+    // distinct pad in the order of pad ids. A single task draws and renders each pad,
+    // while its tiles are still in the cache of the worker.
+    if (pad.size() != layer.size())
+        throw std::invalid_argument("Size of pad ids and layer ids doesn't match!");
+    std::vector<py::array> buffers;
+    auto strokes = ScratchPad::_checkStrokes(layer, brush, setting, points, offsets, buffers);
+    std::vector<int> task_pad;
+    auto task_strokes = _groupStrokes(pad, strokes, task_pad);
+
+    py::array result;
+    if (out.is_none())
+        result = _allocBatchOutput(task_pad, dt, out_size, filter, layout, channels,
+                                   background, mean, stddev, encoding);
+    else
+        result = py::cast<py::array>(out);
+    auto targets = _batchTargets(task_pad, result, out_size, filter, layout, channels,
+                                 background, mean, stddev, encoding);
+    const char kind = result.dtype().kind();
+    const int item_size = result.itemsize();
+    {
+        py::gil_scoped_release release;
+        Latch latch(task_pad.size());
+        for (size_t i = 0; i < task_pad.size(); i++) {
+            auto pad_ptr = &_pads[task_pad[i]];
+            auto pad_strokes = &(*task_strokes)[i];
+            auto target = &targets[i];
+            post_counted(*_strands[task_pad[i]], latch, [pad_ptr, pad_strokes, target, kind, item_size] {
+                pad_ptr->draw(*pad_strokes);
+                pad_ptr->render(kind, item_size, *target);
+            });
+        }
+        latch.wait();
+    }
+    return result;
+}
+
+ScratchPad &BatchedScratchPad::_checkPad(int pad) {
+    if (pad >= _pads.size() or pad < 0)
+        throw std::out_of_range(fmt::format("Invalid pad index {}", pad));
+    return _pads[pad];
+}
 
+std::vector<py::array> BatchedScratchPad::_allocOutputs(const std::vector<int> &pad,
+                                                        const py::object &dt,
+                                                        const py::object &out_size,
+                                                        const std::string &filter,
+                                                        const std::string &layout,
+                                                        const std::string &channels,
+                                                        const py::object &background,
+                                                        const py::object &mean,
+                                                        const py::object &stddev,
+                                                        const std::string &encoding) {
     auto dtype = py::dtype::from_args(dt);
     if (dtype.has_fields())
         throw std::invalid_argument("Only support rendering as a flat floating array or integral array!");
 
-    std::vector<std::future<void*>> futures;
-    std::vector<void*> arrays;
-    std::vector<py::array> ret_results;
-    {
-        py::gil_scoped_release release;
-        for (auto pad_idx: pad) {
-            if (pad_idx >= _pads.size() or pad_idx < 0)
-                throw std::out_of_range(fmt::format("Invalid pad index {}", pad_idx));
-            futures.emplace_back(
-                    _pool.enqueue(
-                            [](ScratchPad *pad, char kind, int item_size, int thread_num) {
-                                omp_set_num_threads(thread_num);
-                                return pad->render(kind, item_size);
-                            },
-                            &_pads[pad_idx], dtype.kind(), dtype.itemsize(), omp_max_threads)
-                    );
+    std::vector<py::array> results;
+    for (auto pad_idx: pad) {
+        auto &pad_ref = _checkPad(pad_idx);
+        auto format = ScratchPad::_parseFormat(out_size, filter, layout, channels,
+                                               background, mean, stddev, encoding,
+                                               pad_ref._width, pad_ref._height);
+        results.emplace_back(py::array(dtype, ScratchPad::_outputShape(format)));
+    }
+    return results;
+}
+
+py::array BatchedScratchPad::_allocBatchOutput(const std::vector<int> &pad,
+                                               const py::object &dt,
+                                               const py::object &out_size,
+                                               const std::string &filter,
+                                               const std::string &layout,
+                                               const std::string &channels,
+                                               const py::object &background,
+                                               const py::object &mean,
+                                               const py::object &stddev,
+                                               const std::string &encoding) {
+    auto dtype = py::dtype::from_args(dt);
+    if (dtype.has_fields())
+        throw std::invalid_argument("Only support rendering as a flat floating array or integral array!");
+    auto pad_size = _checkBatchSize(pad);
+    auto format = ScratchPad::_parseFormat(out_size, filter, layout, channels,
+                                           background, mean, stddev, encoding,
+                                           std::get<0>(pad_size), std::get<1>(pad_size));
+    py::array out(dtype, ScratchPad::_outputShape(format, pad.size()));
+    return out;
+}
+
+std::tuple<int, int> BatchedScratchPad::_checkBatchSize(const std::vector<int> &pad) {
+    if (pad.empty())
+        throw std::invalid_argument("Pad ids are empty!");
+    auto size = _checkPad(pad[0]).getPadSize();
+    for (auto pad_idx: pad) {
+        if (_checkPad(pad_idx).getPadSize() != size)
+            throw std::invalid_argument(
+                    fmt::format("All pads must have the same size to be rendered as a batch, "
+                                "pad {} is {}x{} while pad {} is {}x{}!",
+                                pad[0], std::get<0>(size), std::get<1>(size),
+                                pad_idx, _pads[pad_idx]._width, _pads[pad_idx]._height));
+    }
+    return size;
+}
+
+void BatchedScratchPad::_draw(const std::vector<int> &pad, const std::vector<Stroke> &strokes) {
+    auto work = _drawTasks(pad, strokes);
+    // tasks read the points, all of them must finish before an error is rethrown
+    work->wait();
+}
+
+std::unique_ptr<AsyncWork> BatchedScratchPad::_drawTasks(const std::vector<int> &pad,
+                                                         const std::vector<Stroke> &strokes) {
+    // all strokes of a pad are drawn by a single task, in the given order
+    std::vector<int> task_pad;
+    auto task_strokes = _groupStrokes(pad, strokes, task_pad);
+
+    std::unique_ptr<AsyncWork> work(new AsyncWork(task_pad.size()));
+    for(size_t i=0; i<task_pad.size(); i++) {
+        auto pad_ptr = &_pads[task_pad[i]];
+        post_counted(*_strands[task_pad[i]], *work, [pad_ptr, task_strokes, i] { pad_ptr->draw((*task_strokes)[i]); });
+    }
+    return work;
+}
+
+std::shared_ptr<std::vector<std::vector<Stroke>>>
+BatchedScratchPad::_groupStrokes(const std::vector<int> &pad, const std::vector<Stroke> &strokes,
+                                 std::vector<int> &task_pad) {
+    // stroke i is drawn on pad[i], strokes are grouped by pad, in the order
+    // each pad first appears in
+    auto task_strokes = std::make_shared<std::vector<std::vector<Stroke>>>();
+    std::map<int, size_t> task_of_pad;
+    task_pad.clear();
+    for (size_t i = 0; i < pad.size(); i++) {
+        if (pad[i] >= _pads.size() or pad[i] < 0)
+            throw py::index_error();
+        auto it = task_of_pad.find(pad[i]);
+        if (it == task_of_pad.end()) {
+            it = task_of_pad.emplace(pad[i], task_pad.size()).first;
+            task_pad.push_back(pad[i]);
+            task_strokes->emplace_back();
+        }
+        (*task_strokes)[it->second].push_back(strokes[i]);
+    }
+    return task_strokes;
+}
+
+void BatchedScratchPad::_fence(const std::vector<int> &pad) {
+    // waits for the work already submitted to the pads, errors are left to their handles
+    std::vector<int> busy;
+    for (auto pad_idx: pad)
+        if (_strands[pad_idx]->pending() > 0)
+            busy.push_back(pad_idx);
+    Latch latch(busy.size());
+    for (auto pad_idx: busy)
+        post_counted(*_strands[pad_idx], latch, [] {});
+    latch.wait();
+}
+
+std::vector<int> BatchedScratchPad::_holdPads(const std::vector<int> &pad) {
+    // Waits for the work already submitted to the pads and keeps later work from running,
+    // until the pads are released. Pads are held in ascending order, so that callers
+    // holding some of the same pads can't wait for each other.
+    std::set<int> distinct(pad.begin(), pad.end());
+    std::vector<int> held;
+    try {
+        for (auto pad_idx: distinct) {
+            _strands[pad_idx]->hold();
+            held.push_back(pad_idx);
+        }
+    }
+    catch (...) {
+        _releasePads(held);
+        throw;
+    }
+    return held;
+}
+
+void BatchedScratchPad::_releasePads(const std::vector<int> &held) {
+    for (auto pad_idx: held)
+        _strands[pad_idx]->release();
+}
+
+void BatchedScratchPad::_renderTargets(const std::vector<int> &pad,
+                                       const std::vector<int> &layer,
+                                       const std::vector<py::array> &out,
+                                       const py::object &out_size,
+                                       const std::string &filter,
+                                       const std::string &layout,
+                                       const std::string &channels,
+                                       const py::object &background,
+                                       const py::object &mean,
+                                       const py::object &stddev,
+                                       const std::string &encoding,
+                                       AsyncHandle *handle) {
+    std::vector<char> kind;
+    std::vector<int> item_size;
+    std::vector<RenderTarget> targets;
+    for (int idx=0; idx < pad.size(); idx++) {
+        py::array arr = out[idx];
+        auto &pad_ref = _checkPad(pad[idx]);
+        auto format = ScratchPad::_parseFormat(out_size, filter, layout, channels,
+                                               background, mean, stddev, encoding,
+                                               pad_ref._width, pad_ref._height);
+        targets.push_back(ScratchPad::_checkTarget(arr, format));
+        kind.push_back(arr.dtype().kind());
+        item_size.push_back(arr.itemsize());
+    }
+    if (handle != nullptr) {
+        // the tasks read their targets until they are done
+        auto owned = std::make_shared<std::vector<RenderTarget>>(std::move(targets));
+        handle->_start(_renderTasks(pad, layer, kind, item_size, *owned), owned);
+    }
+    else
+        _renderTargets(pad, layer, kind, item_size, targets);
+}
+
+void BatchedScratchPad::_renderBatchTargets(const std::vector<int> &pad,
+                                            const std::vector<int> &layer,
+                                            py::array &out,
+                                            const py::object &out_size,
+                                            const std::string &filter,
+                                            const std::string &layout,
+                                            const std::string &channels,
+                                            const py::object &background,
+                                            const py::object &mean,
+                                            const py::object &stddev,
+                                            const std::string &encoding,
+                                            AsyncHandle *handle) {
+    auto targets = _batchTargets(pad, out, out_size, filter, layout, channels, background, mean, stddev, encoding);
+    std::vector<char> kind(pad.size(), out.dtype().kind());
+    std::vector<int> item_size(pad.size(), out.itemsize());
+    if (handle != nullptr) {
+        auto owned = std::make_shared<std::vector<RenderTarget>>(std::move(targets));
+        handle->_start(_renderTasks(pad, layer, kind, item_size, *owned), owned);
+    }
+    else
+        _renderTargets(pad, layer, kind, item_size, targets);
+}
+
+std::vector<RenderTarget> BatchedScratchPad::_batchTargets(const std::vector<int> &pad,
+                                                          py::array &out,
+                                                          const py::object &out_size,
+                                                          const std::string &filter,
+                                                          const std::string &layout,
+                                                          const std::string &channels,
+                                                          const py::object &background,
+                                                          const py::object &mean,
+                                                          const py::object &stddev,
+                                                          const std::string &encoding) {
+    // pad i is rendered to out[i]
+    auto pad_size = _checkBatchSize(pad);
+    auto format = ScratchPad::_parseFormat(out_size, filter, layout, channels,
+                                           background, mean, stddev, encoding,
+                                           std::get<0>(pad_size), std::get<1>(pad_size));
+    auto target = ScratchPad::_checkTarget(out, format, pad.size());
+
+    std::vector<RenderTarget> targets;
+    for (int idx=0; idx < pad.size(); idx++) {
+        targets.push_back(target);
+        target.data = static_cast<char *>(target.data) + out.strides(0);
+    }
+    return targets;
+}
+
+void BatchedScratchPad::_renderTargets(const std::vector<int> &pad,
+                                       const std::vector<int> &layer,
+                                       const std::vector<char> &kind,
+                                       const std::vector<int> &item_size,
+                                       const std::vector<RenderTarget> &target) {
+    // Renders all layers of each pad if layer ids are empty. A pad rendered more than
+    // once is rendered in rounds, passes of one round render distinct pads.
+    std::vector<std::vector<size_t>> rounds;
+    std::map<int, size_t> round_of_pad;
+    for (size_t idx = 0; idx < pad.size(); idx++) {
+        size_t round = round_of_pad[pad[idx]]++;
+        if (round == rounds.size())
+            rounds.emplace_back();
+        rounds[round].push_back(idx);
+    }
+
+    // passes run on the pool while the pads are held, async work of the pads waits for them
+    py::gil_scoped_release release;
+    auto held = _holdPads(pad);
+    try {
+        for (auto &round: rounds) {
+            std::vector<RenderPass> passes(round.size());
+            size_t begun = 0;
+            try {
+                for (; begun < round.size(); begun++) {
+                    size_t idx = round[begun];
+                    _pads[pad[idx]]._beginPass(passes[begun], layer.empty() ? -1 : layer[idx],
+                                               kind[idx], item_size[idx], target[idx]);
+                }
+            }
+            catch (...) {
+                for (size_t i = 0; i < begun; i++)
+                    _pads[pad[round[i]]]._endPass(passes[i], false);
+                throw;
+            }
+
+            std::vector<bool> rendered(round.size(), true);
+            std::exception_ptr error = _renderPasses(pad, round, passes, rendered);
+            for (size_t i = 0; i < round.size(); i++)
+                _pads[pad[round[i]]]._endPass(passes[i], rendered[i]);
+            if (error)
+                std::rethrow_exception(error);
+        }
+    }
+    catch (...) {
+        _releasePads(held);
+        throw;
+    }
+    _releasePads(held);
+}
+
+std::unique_ptr<AsyncWork> BatchedScratchPad::_renderTasks(const std::vector<int> &pad,
+                                                           const std::vector<int> &layer,
+                                                           const std::vector<char> &kind,
+                                                           const std::vector<int> &item_size,
+                                                           const std::vector<RenderTarget> &target) {
+    // Async renders run after the work submitted before them to the same pad, each
+    // pad by a single worker, while other pads or the caller keep working.
+    // Targets are read by the tasks and must be kept until they are done.
+    std::unique_ptr<AsyncWork> work(new AsyncWork(pad.size()));
+    for (size_t idx = 0; idx < pad.size(); idx++) {
+        auto pad_ptr = &_pads[pad[idx]];
+        auto target_ptr = &target[idx];
+        int layer_idx = layer.empty() ? -1 : layer[idx];
+        char kind_idx = kind[idx];
+        int item_size_idx = item_size[idx];
+        post_counted(*_strands[pad[idx]], *work, [pad_ptr, target_ptr, layer_idx, kind_idx, item_size_idx] {
+            if (layer_idx < 0)
+                pad_ptr->render(kind_idx, item_size_idx, *target_ptr);
+            else
+                pad_ptr->renderLayer(layer_idx, kind_idx, item_size_idx, *target_ptr);
+        });
+    }
+    return work;
+}
+
+std::exception_ptr BatchedScratchPad::_renderPasses(const std::vector<int> &pad,
+                                                    const std::vector<size_t> &round,
+                                                    std::vector<RenderPass> &passes,
+                                                    std::vector<bool> &rendered) {
+    // All passes are split to ranges of tiles, so that workers finish together
+    // however the sizes of pads differ. Every worker takes the next range until
+    // none is left, tiles are only rendered by the workers without nested threads.
+    struct Range {
+        size_t pass, begin, end;
+    };
+    const size_t workers = _pool.size();
+    size_t tile_num = 0;
+    for (auto &pass: passes)
+        tile_num += pass.tiles.size();
+    const size_t grain = std::max<size_t>(1, std::min<size_t>(16, tile_num / (workers * 4)));
+
+    std::vector<Range> ranges;
+    for (size_t i = 0; i < passes.size(); i++) {
+        const size_t size = passes[i].tiles.size();
+        // resampled passes are split to whole tile rows, the bands of their output rows
+        const size_t row = passes[i].tile_cols;
+        const size_t step = passes[i].resample ? row * std::max<size_t>(1, grain / row) : grain;
+        for (size_t begin = 0; begin < size; begin += step)
+            ranges.push_back({i, begin, std::min(begin + step, size)});
+    }
+
+    std::atomic<size_t> next(0);
+    std::vector<std::exception_ptr> errors(ranges.size());
+    const size_t task_num = std::min(workers, ranges.size());
+    Latch latch(task_num);
+    _pool.enqueueBulk(task_num, [&](size_t) {
+        for (size_t r = next++; r < ranges.size(); r = next++) {
+            auto &range = ranges[r];
+            try {
+                _pads[pad[round[range.pass]]]._renderPass(passes[range.pass], range.begin, range.end);
+            }
+            catch (...) {
+                errors[r] = std::current_exception();
+            }
         }
-        for (auto &fut: futures) {
-            arrays.push_back(fut.get());
+    }, latch);
+    latch.wait();
+
+    std::exception_ptr error;
+    for (size_t r = 0; r < ranges.size(); r++) {
+        if (errors[r]) {
+            rendered[ranges[r].pass] = false;
+            if (not error)
+                error = errors[r];
         }
     }
-    for(int idx = 0; idx<pad.size(); idx++) {
-        int width = std::get<0>(_pads[pad[idx]].getPadSize());
-        int height = std::get<1>(_pads[pad[idx]].getPadSize());
-        int real_width = ALIGN(width, MYPAINT_TILE_SIZE);
-        auto capsule = py::capsule(arrays[idx], [](void *v) { free(v); });
-        ret_results.emplace_back(py::array(dtype,
-                                           {height, width, 4},
-                                           {real_width * 4 * dtype.itemsize(),
-                                            4 * dtype.itemsize(),
-                                            dtype.itemsize()},
-                                           arrays[idx], capsule));
+    return error;
+}
+
+AsyncWork::AsyncWork(size_t count)
+: _latch(count), _remaining(count), _finished(count == 0) {}
+
+void AsyncWork::countDown() {
+    if (_remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        py::object loop, future;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _finished = true;
+            loop = std::move(_loop);
+            future = std::move(_future);
+        }
+        if (loop) {
+            // Note: blocking calls release the GIL, so that a worker may take it here
+            py::gil_scoped_acquire gil;
+            py::object wake_loop = std::move(loop), wake_future = std::move(future);
+            try {
+                wake_loop.attr("call_soon_threadsafe")(py::cpp_function([](py::object fut) {
+                    if (not fut.attr("done")().cast<bool>())
+                        fut.attr("set_result")(py::none());
+                }), wake_future);
+            }
+            catch (py::error_already_set &) {
+                // the loop is closed, nothing awaits the work anymore
+            }
+        }
     }
+    _latch.countDown();
+}
+
+void AsyncWork::setError(std::exception_ptr error) {
+    _latch.setError(error);
+}
+
+void AsyncWork::wait() {
+    _latch.wait();
+}
+
+bool AsyncWork::ready() {
+    return _latch.ready();
+}
+
+bool AsyncWork::wakeOnDone(py::object loop, py::object future) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_finished)
+        return false;
+    _loop = std::move(loop);
+    _future = std::move(future);
+    return true;
+}
+
+AsyncHandle::AsyncHandle(py::object result, std::shared_ptr<void> data, std::vector<py::array> buffers)
+: _result(std::move(result)), _data(std::move(data)), _buffers(std::move(buffers)) {}
+
+AsyncHandle::~AsyncHandle() {
+    // the work reads and writes buffers owned by the handle, dropping it waits
+    _finish();
+}
 
-    return std::move(ret_results);
+bool AsyncHandle::done() {
+    return _work == nullptr or _work->ready();
+}
+
+py::object AsyncHandle::wait() {
+    _finish();
+    if (_error)
+        std::rethrow_exception(_error);
+    return _result;
+}
+
+py::object AsyncHandle::next() {
+    // The first step yields a future of the running event loop, which is resolved by
+    // the last task through that same loop, so that it sleeps meanwhile. The next step
+    // returns the result.
+    if (not _awaited and not done()) {
+        _awaited = true;
+        auto loop = py::module::import("asyncio").attr("get_running_loop")();
+        auto future = loop.attr("create_future")();
+        if (_work->wakeOnDone(loop, future)) {
+            future.attr("_asyncio_future_blocking") = true;
+            return future;
+        }
+    }
+    auto result = wait();
+    PyErr_SetObject(PyExc_StopIteration, py::make_tuple(result).ptr());
+    throw py::error_already_set();
+}
+
+void AsyncHandle::_start(std::unique_ptr<AsyncWork> work, std::shared_ptr<void> data) {
+    _work = std::move(work);
+    if (data)
+        _data = std::move(data);
+}
+
+void AsyncHandle::_finish() {
+    if (_work != nullptr) {
+        {
+            py::gil_scoped_release release;
+            try {
+                _work->wait();
+            }
+            catch (...) {
+                _error = std::current_exception();
+            }
+        }
+        _work.reset();
+    }
+    _data.reset();
+    _buffers.clear();
 }
@@ -2,12 +2,69 @@
 #define B_SCRATCHPAD_H
 
 #include <thread_pool/thread_pool.h>
+#include <thread_pool/strand.h>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <mutex>
 #include "scratchpad.h"
 
+class AsyncWork {
+public:
+    // Tasks submitted by an async method, the last one to finish resolves the
+    // future of the event loop awaiting them, if any, before it counts down.
+    explicit AsyncWork(size_t count);
+    AsyncWork(const AsyncWork &) = delete;
+    AsyncWork &operator=(const AsyncWork &) = delete;
+
+    void countDown();
+    void setError(std::exception_ptr error);
+    void wait();
+    bool ready();
+    // returns false if the tasks are finished already and future won't be resolved
+    bool wakeOnDone(py::object loop, py::object future);
+
+private:
+    Latch _latch;
+    std::atomic<size_t> _remaining;
+    std::mutex _mutex;
+    bool _finished;
+    py::object _loop, _future;
+};
+
+class AsyncHandle {
+public:
+    // Work submitted by an async method of BatchedScratchPad, owns the inputs the
+    // work reads and the outputs it writes until the work is finished.
+    explicit AsyncHandle(py::object result, std::shared_ptr<void> data = nullptr,
+                         std::vector<py::array> buffers = {});
+    AsyncHandle(AsyncHandle &&) = default;
+    ~AsyncHandle();
+
+    bool done();
+    py::object wait();
+    py::object next();
+
+private:
+    friend class BatchedScratchPad;
+
+    // counted down by each task, nullptr once the work has been waited for
+    std::unique_ptr<AsyncWork> _work;
+    bool _awaited = false;
+    std::exception_ptr _error;
+    py::object _result;
+    std::shared_ptr<void> _data;
+    std::vector<py::array> _buffers;
+
+    void _start(std::unique_ptr<AsyncWork> work, std::shared_ptr<void> data = nullptr);
+    void _finish();
+};
+
 class BatchedScratchPad {
 public:
     BatchedScratchPad() = delete;
-    explicit BatchedScratchPad(int pad_num);
+    explicit BatchedScratchPad(int pad_num, int thread_num = 0);
+    ~BatchedScratchPad();
 
     void loadBrush(const std::string &brush_string);
     void resetAllPads(int width, int height, int layers=1);
@@ -15,8 +72,14 @@ public:
     void addLayer(int pad);
     void popLayer(int pad, int layer);
     void setOpacity(int pad, int layer, float opacity);
+    void setLayer(const std::vector<int> &pad, const std::vector<int> &layer, const std::vector<py::object> &image);
+    void setTemplate(int pad, const std::vector<int> &layers = {});
+    void resetFromTemplate(const std::vector<int> &pad = {});
 
     int getPadNum();
+    int getThreadNum();
+    void setWaitPolicy(const std::string &policy);
+    std::string getWaitPolicy();
     int getBrushNum();
     int getLayerNum(int pad);
     std::tuple<int, int> getPadSize(int pad);
@@ -27,12 +90,161 @@ public:
               const std::vector<Setting> &setting,
               const std::vector<std::vector<Point>> &points);
 
+    void drawArray(const std::vector<int> &pad,
+                   const std::vector<int> &layer,
+                   const std::vector<int> &brush,
+                   const py::object &setting,
+                   const py::object &points,
+                   const py::object &offsets);
+
+    void drawStrokes(const std::vector<int> &pad,
+                     const std::vector<std::vector<std::tuple<int, int, Setting, std::vector<Point>>>> &strokes);
+
+    AsyncHandle drawAsync(const std::vector<int> &pad,
+                          const std::vector<int> &layer,
+                          const std::vector<int> &brush,
+                          const std::vector<Setting> &setting,
+                          const std::vector<std::vector<Point>> &points);
+
+    AsyncHandle drawArrayAsync(const std::vector<int> &pad,
+                               const std::vector<int> &layer,
+                               const std::vector<int> &brush,
+                               const py::object &setting,
+                               const py::object &points,
+                               const py::object &offsets);
+
     std::vector<py::array> renderLayer(const std::vector<int> &pad,
                                        const std::vector<int> &layer,
-                                       const py::object& dtype);
+                                       const py::object& dtype,
+                                       const py::object &out_size = py::none(),
+                                       const std::string &filter = "box",
+                                       const std::string &layout = "HWC",
+                                       const std::string &channels = "RGBA",
+                                       const py::object &background = py::none(),
+                                       const py::object &mean = py::none(),
+                                       const py::object &stddev = py::none(),
+                                       const std::string &encoding = "default");
+
+    void renderLayerInto(const std::vector<int> &pad,
+                         const std::vector<int> &layer,
+                         const std::vector<py::array> &out,
+                         const py::object &out_size = py::none(),
+                         const std::string &filter = "box",
+                         const std::string &layout = "HWC",
+                         const std::string &channels = "RGBA",
+                         const py::object &background = py::none(),
+                         const py::object &mean = py::none(),
+                         const py::object &stddev = py::none(),
+                         const std::string &encoding = "default");
+
+    py::array renderLayerBatch(const std::vector<int> &pad,
+                               const std::vector<int> &layer,
+                               const py::object& dtype,
+                               const py::object &out_size = py::none(),
+                               const std::string &filter = "box",
+                               const std::string &layout = "HWC",
+                               const std::string &channels = "RGBA",
+                               const py::object &background = py::none(),
+                               const py::object &mean = py::none(),
+                               const py::object &stddev = py::none(),
+                               const std::string &encoding = "default");
+
+    void renderLayerBatchInto(const std::vector<int> &pad,
+                              const std::vector<int> &layer,
+                              py::array &out,
+                              const py::object &out_size = py::none(),
+                              const std::string &filter = "box",
+                              const std::string &layout = "HWC",
+                              const std::string &channels = "RGBA",
+                              const py::object &background = py::none(),
+                              const py::object &mean = py::none(),
+                              const py::object &stddev = py::none(),
+                              const std::string &encoding = "default");
 
     std::vector<py::array> render(const std::vector<int> &pad,
-                                  const py::object& dtype);
+                                  const py::object& dtype,
+                                  const py::object &out_size = py::none(),
+                                  const std::string &filter = "box",
+                                  const std::string &layout = "HWC",
+                                  const std::string &channels = "RGBA",
+                                  const py::object &background = py::none(),
+                                  const py::object &mean = py::none(),
+                                  const py::object &stddev = py::none(),
+                                  const std::string &encoding = "default");
+
+    void renderInto(const std::vector<int> &pad,
+                    const std::vector<py::array> &out,
+                    const py::object &out_size = py::none(),
+                    const std::string &filter = "box",
+                    const std::string &layout = "HWC",
+                    const std::string &channels = "RGBA",
+                    const py::object &background = py::none(),
+                    const py::object &mean = py::none(),
+                    const py::object &stddev = py::none(),
+                    const std::string &encoding = "default");
+
+    py::array renderBatch(const std::vector<int> &pad,
+                          const py::object& dtype,
+                          const py::object &out_size = py::none(),
+                          const std::string &filter = "box",
+                          const std::string &layout = "HWC",
+                          const std::string &channels = "RGBA",
+                          const py::object &background = py::none(),
+                          const py::object &mean = py::none(),
+                          const py::object &stddev = py::none(),
+                          const std::string &encoding = "default");
+
+    void renderBatchInto(const std::vector<int> &pad,
+                         py::array &out,
+                         const py::object &out_size = py::none(),
+                         const std::string &filter = "box",
+                         const std::string &layout = "HWC",
+                         const std::string &channels = "RGBA",
+                         const py::object &background = py::none(),
+                         const py::object &mean = py::none(),
+                         const py::object &stddev = py::none(),
+                         const std::string &encoding = "default");
+
+    py::array layerView(int pad, int layer);
+
+    AsyncHandle renderAsync(const std::vector<int> &pad,
+                            const py::object& dtype,
+                            const py::object &out_size = py::none(),
+                            const std::string &filter = "box",
+                            const std::string &layout = "HWC",
+                            const std::string &channels = "RGBA",
+                            const py::object &background = py::none(),
+                            const py::object &mean = py::none(),
+                            const py::object &stddev = py::none(),
+                            const std::string &encoding = "default");
+
+    py::array step(const std::vector<int> &pad,
+                   const std::vector<int> &layer,
+                   const std::vector<int> &brush,
+                   const py::object &setting,
+                   const py::object &points,
+                   const py::object &offsets,
+                   const py::object &dtype,
+                   const py::object &out = py::none(),
+                   const py::object &out_size = py::none(),
+                   const std::string &filter = "box",
+                   const std::string &layout = "HWC",
+                   const std::string &channels = "RGBA",
+                   const py::object &background = py::none(),
+                   const py::object &mean = py::none(),
+                   const py::object &stddev = py::none(),
+                   const std::string &encoding = "default");
+
+    AsyncHandle renderBatchAsync(const std::vector<int> &pad,
+                                 const py::object& dtype,
+                                 const py::object &out_size = py::none(),
+                                 const std::string &filter = "box",
+                                 const std::string &layout = "HWC",
+                                 const std::string &channels = "RGBA",
+                                 const py::object &background = py::none(),
+                                 const py::object &mean = py::none(),
+                                 const py::object &stddev = py::none(),
+                                 const std::string &encoding = "default");
 
 
 private:
@@ -40,6 +252,87 @@ private:
     std::mutex _py_mutex;
     std::vector<ScratchPad> _pads;
     ThreadPoolConcurrent<> _pool;
+    // work of each pad runs in submission order, pads run in parallel
+    std::vector<std::unique_ptr<Strand<ThreadPoolConcurrent<>>>> _strands;
+
+    ScratchPad &_checkPad(int pad);
+    std::tuple<int, int> _checkBatchSize(const std::vector<int> &pad);
+    void _draw(const std::vector<int> &pad, const std::vector<Stroke> &strokes);
+    std::unique_ptr<AsyncWork> _drawTasks(const std::vector<int> &pad, const std::vector<Stroke> &strokes);
+    std::shared_ptr<std::vector<std::vector<Stroke>>> _groupStrokes(const std::vector<int> &pad,
+                                                                    const std::vector<Stroke> &strokes,
+                                                                    std::vector<int> &task_pad);
+    void _fence(const std::vector<int> &pad);
+    std::vector<int> _holdPads(const std::vector<int> &pad);
+    void _releasePads(const std::vector<int> &held);
+    std::vector<py::array> _allocOutputs(const std::vector<int> &pad,
+                                         const py::object &dtype,
+                                         const py::object &out_size,
+                                         const std::string &filter,
+                                         const std::string &layout,
+                                         const std::string &channels,
+                                         const py::object &background,
+                                         const py::object &mean,
+                                         const py::object &stddev,
+                                         const std::string &encoding);
+    py::array _allocBatchOutput(const std::vector<int> &pad,
+                                const py::object &dtype,
+                                const py::object &out_size,
+                                const std::string &filter,
+                                const std::string &layout,
+                                const std::string &channels,
+                                const py::object &background,
+                                const py::object &mean,
+                                const py::object &stddev,
+                                const std::string &encoding);
+    void _renderTargets(const std::vector<int> &pad,
+                        const std::vector<int> &layer,
+                        const std::vector<py::array> &out,
+                        const py::object &out_size,
+                        const std::string &filter,
+                        const std::string &layout,
+                        const std::string &channels,
+                        const py::object &background,
+                        const py::object &mean,
+                        const py::object &stddev,
+                        const std::string &encoding,
+                        AsyncHandle *handle = nullptr);
+    void _renderBatchTargets(const std::vector<int> &pad,
+                             const std::vector<int> &layer,
+                             py::array &out,
+                             const py::object &out_size,
+                             const std::string &filter,
+                             const std::string &layout,
+                             const std::string &channels,
+                             const py::object &background,
+                             const py::object &mean,
+                             const py::object &stddev,
+                             const std::string &encoding,
+                             AsyncHandle *handle = nullptr);
+    std::vector<RenderTarget> _batchTargets(const std::vector<int> &pad,
+                                            py::array &out,
+                                            const py::object &out_size,
+                                            const std::string &filter,
+                                            const std::string &layout,
+                                            const std::string &channels,
+                                            const py::object &background,
+                                            const py::object &mean,
+                                            const py::object &stddev,
+                                            const std::string &encoding);
+    void _renderTargets(const std::vector<int> &pad,
+                        const std::vector<int> &layer,
+                        const std::vector<char> &kind,
+                        const std::vector<int> &item_size,
+                        const std::vector<RenderTarget> &target);
+    std::unique_ptr<AsyncWork> _renderTasks(const std::vector<int> &pad,
+                                            const std::vector<int> &layer,
+                                            const std::vector<char> &kind,
+                                            const std::vector<int> &item_size,
+                                            const std::vector<RenderTarget> &target);
+    std::exception_ptr _renderPasses(const std::vector<int> &pad,
+                                     const std::vector<size_t> &round,
+                                     std::vector<RenderPass> &passes,
+                                     std::vector<bool> &rendered);
 };
 
 #endif //B_SCRATCHPAD_H
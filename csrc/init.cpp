@@ -1,5 +1,7 @@
 #include "scratchpad.h"
 #include "b_scratchpad.h"
+#include "simd.h"
+#include "arena.h"
 #include <fmt/format.h>
 
 #ifdef USE_OPENMP
@@ -41,6 +43,14 @@ PYBIND11_MODULE(internal, m) {
     signal(SIGSEGV, handler);
 #endif
     m.def("set_omp_max_threads", &set_omp_max_threads);
+    m.def("get_simd_isas", &get_simd_isas,
+          "Instruction sets supported by this cpu, ordered from the most preferred.");
+    m.def("get_simd_isa", &get_simd_isa,
+          "Instruction set used by blending and conversion kernels.");
+    m.def("set_simd_isa", &set_simd_isa, py::arg("isa"),
+          "Select the instruction set used by blending and conversion kernels.");
+    m.def("get_scratch_reserved", &ScratchArena::totalReserved,
+          "Bytes of scratch memory held for reuse by the threads which rendered.");
     py::class_<Setting>(m,
                         "Setting",
                         R"(Settings of the used brush.)")
@@ -122,39 +132,222 @@ PYBIND11_MODULE(internal, m) {
                                         p.x, p.y, p.xtilt, p.ytilt, p.pressure, p.dtime);
                  });
 
+    py::class_<PadSnapshot, std::shared_ptr<PadSnapshot>>(m, "Snapshot",
+                                                         R"(State of a ScratchPad, it shares tiles with the pad
+                                                            until a draw writes over them.)");
+
     py::class_<ScratchPad>(m, "ScratchPad")
             .def(py::init<>())
+            .def("__copy__", [](const ScratchPad &pad) { return ScratchPad(pad); })
             .def("load_brush", &ScratchPad::loadBrush)
             .def("reset_pad", &ScratchPad::resetPad)
             .def("add_layer", &ScratchPad::addLayer)
             .def("pop_layer", &ScratchPad::popLayer)
             .def("set_opacity", &ScratchPad::setOpacity)
+            .def("set_layer", py::overload_cast<int, const py::object &>(&ScratchPad::setLayer),
+                 py::arg("layer"), py::arg("image"),
+                 R"(Replace a layer by an (H, W, 3) or (H, W, 4) image of the pad size, with straight colors of
+                    uint8, uint16 or floats in range [0, 1], RGB images are opaque.)")
+            .def("snapshot", &ScratchPad::snapshot,
+                 R"(Snapshot layers and brush states, tiles are only copied when a later draw touches them.)")
+            .def("restore", &ScratchPad::restore, py::call_guard<py::gil_scoped_release>(),
+                 py::arg("snapshot"),
+                 R"(Restore a snapshot of this pad, only tiles drawn since the snapshot are written.)")
+            .def("fork", &ScratchPad::fork, py::call_guard<py::gil_scoped_release>(),
+                 py::arg("n"),
+                 R"(Return n independent copies of the pad, which share all tiles with it copy-on-write,
+                    each pad copies a tile the first time it draws on it.)")
+            .def("set_template", &ScratchPad::setTemplate, py::call_guard<py::gil_scoped_release>(),
+                 py::arg("layers") = std::vector<int>(),
+                 R"(Keep a copy of the given layers, all layers if empty, as the canvas reset_from_template
+                    resets the pad to.)")
+            .def("reset_from_template", &ScratchPad::resetFromTemplate, py::call_guard<py::gil_scoped_release>(),
+                 R"(Reset the pad to the template, layers which hold it only get back the tiles drawn since
+                    the last reset.)")
             .def("get_brush_num", &ScratchPad::getBrushNum)
             .def("get_layer_num", &ScratchPad::getLayerNum)
             .def("get_pad_size", &ScratchPad::getPadSize)
-            .def("draw", &ScratchPad::draw, py::call_guard<py::gil_scoped_release>())
-            .def("render_layer", py::overload_cast<int, const py::object &>(&ScratchPad::renderLayer))
-            .def("render", py::overload_cast<const py::object &>(&ScratchPad::render));
+            .def("draw", py::overload_cast<int, int, const Setting &, const std::vector<Point> &>(&ScratchPad::draw),
+                 py::call_guard<py::gil_scoped_release>())
+            .def("draw", &ScratchPad::drawArray,
+                 py::arg("layer"), py::arg("brush"), py::arg("setting"), py::arg("points"),
+                 R"(Draw a stroke of an (N, 6) float32 array of points, with fields in the order of
+                    x, y, xtilt, ytilt, pressure, dtime, or of a dict of N sized arrays keyed by
+                    field names, where only x and y are required.)")
+            .def("draw_strokes", &ScratchPad::drawStrokes, py::call_guard<py::gil_scoped_release>(),
+                 py::arg("strokes"),
+                 R"(Draw a list of (layer, brush, setting, points) strokes in order, consecutive
+                    strokes on the same layer are drawn in one atomic section.)")
+            .def("draw_strokes", &ScratchPad::drawStrokesArray,
+                 py::arg("layer"), py::arg("brush"), py::arg("setting"), py::arg("points"), py::arg("offsets"),
+                 R"(Draw M strokes in order, settings are an (M, 6) float32 array, points of all strokes
+                    are a flat (N, 6) float32 array, or a dict of arrays, stroke i is made of points
+                    [offsets[i], offsets[i + 1]).)")
+            .def("render_layer", py::overload_cast<int, const py::object &, const py::object &, const std::string &,
+                                                   const std::string &, const std::string &, const py::object &,
+                                                   const py::object &, const py::object &,
+                                                   const std::string &>(&ScratchPad::renderLayer),
+                 py::arg("layer"), py::arg("dtype"), py::arg("out_size") = py::none(), py::arg("filter") = "box",
+                 py::arg("layout") = "HWC", py::arg("channels") = "RGBA",
+                 py::arg("background") = py::none(), py::arg("mean") = py::none(), py::arg("std") = py::none(),
+                 py::arg("encoding") = "default")
+            .def("render_layer_into", &ScratchPad::renderLayerInto,
+                 py::arg("layer"), py::arg("out"), py::arg("out_size") = py::none(), py::arg("filter") = "box",
+                 py::arg("layout") = "HWC", py::arg("channels") = "RGBA",
+                 py::arg("background") = py::none(), py::arg("mean") = py::none(), py::arg("std") = py::none(),
+                 py::arg("encoding") = "default")
+            .def("render", py::overload_cast<const py::object &, const py::object &, const std::string &,
+                                             const std::string &, const std::string &, const py::object &,
+                                             const py::object &, const py::object &,
+                                             const std::string &>(&ScratchPad::render),
+                 py::arg("dtype"), py::arg("out_size") = py::none(), py::arg("filter") = "box",
+                 py::arg("layout") = "HWC", py::arg("channels") = "RGBA",
+                 py::arg("background") = py::none(), py::arg("mean") = py::none(), py::arg("std") = py::none(),
+                 py::arg("encoding") = "default")
+            .def("render_into", &ScratchPad::renderInto,
+                 py::arg("out"), py::arg("out_size") = py::none(), py::arg("filter") = "box",
+                 py::arg("layout") = "HWC", py::arg("channels") = "RGBA",
+                 py::arg("background") = py::none(), py::arg("mean") = py::none(), py::arg("std") = py::none(),
+                 py::arg("encoding") = "default")
+            .def("layer_view", &ScratchPad::layerView, py::arg("layer"),
+                 R"(Read only uint16 view of the premultiplied fix15 pixels of a layer in place, shaped
+                    (tile rows, tile cols, 64, 64, 4), where 2^15 is 1.0. It follows later draws until the pad
+                    is forked and keeps the memory of the layer alive, pixels out of the pad are not meaningful.)")
+            .def("tile_state", &ScratchPad::tileState, py::arg("layer"),
+                 R"(uint8 state of each tile of a layer shaped (tile rows, tile cols), as last checked by a render:
+                    0 if drawn since, 1 if empty, 2 if filled.)");
+
+    py::class_<AsyncHandle>(m, "AsyncHandle",
+                            R"(Work submitted by an async method of BatchedScratchPad, waited for when dropped.)")
+            .def("done", &AsyncHandle::done)
+            .def("wait", &AsyncHandle::wait,
+                 R"(Wait with the GIL released, return the result or raise the error of the work.)")
+            .def("__await__", [](py::object self) { return self; },
+                 R"(Awaiting sleeps on a future of the running event loop, which the work resolves.)")
+            .def("__next__", &AsyncHandle::next);
 
     py::class_<BatchedScratchPad>(m, "BatchedScratchPad")
-            .def(py::init<int>(),
-                 py::arg("pad_num"))
-            .def("load_brush", &BatchedScratchPad::loadBrush)
-            .def("reset_all_pads", &BatchedScratchPad::resetAllPads)
-            .def("reset_pad", &BatchedScratchPad::resetPad)
-            .def("add_layer", &BatchedScratchPad::addLayer)
-            .def("pop_layer", &BatchedScratchPad::popLayer)
-            .def("set_opacity", &BatchedScratchPad::setOpacity)
+            .def(py::init<int, int>(),
+                 py::arg("pad_num"), py::arg("thread_num") = 0,
+                 R"(Pads are multiplexed on thread_num workers, 0 for the number of physical cores.)")
+            .def("load_brush", &BatchedScratchPad::loadBrush, py::call_guard<py::gil_scoped_release>())
+            .def("reset_all_pads", &BatchedScratchPad::resetAllPads, py::call_guard<py::gil_scoped_release>())
+            .def("reset_pad", &BatchedScratchPad::resetPad, py::call_guard<py::gil_scoped_release>())
+            .def("add_layer", &BatchedScratchPad::addLayer, py::call_guard<py::gil_scoped_release>())
+            .def("pop_layer", &BatchedScratchPad::popLayer, py::call_guard<py::gil_scoped_release>())
+            .def("set_opacity", &BatchedScratchPad::setOpacity, py::call_guard<py::gil_scoped_release>())
+            .def("set_layer", &BatchedScratchPad::setLayer,
+                 py::arg("pads"), py::arg("layers"), py::arg("images"),
+                 R"(Replace layers[i] of pads[i] by images[i] in parallel, images are as in ScratchPad.set_layer.)")
+            .def("set_template", &BatchedScratchPad::setTemplate, py::call_guard<py::gil_scoped_release>(),
+                 py::arg("pad"), py::arg("layers") = std::vector<int>(),
+                 R"(Set the given layers of a pad, all layers if empty, as the template of all pads.)")
+            .def("reset_from_template", &BatchedScratchPad::resetFromTemplate,
+                 py::call_guard<py::gil_scoped_release>(), py::arg("pads") = std::vector<int>(),
+                 R"(Reset the given pads, all pads if empty, to the template in parallel.)")
             .def("get_pad_num", &BatchedScratchPad::getPadNum)
+            .def("get_thread_num", &BatchedScratchPad::getThreadNum)
+            .def("set_wait_policy", &BatchedScratchPad::setWaitPolicy, py::arg("policy"),
+                 R"(How idle workers wait for work: "spin" for the lowest latency, "spin_yield" to
+                    spin shortly then yield the core, or "park" to sleep until woken, the default.)")
+            .def("get_wait_policy", &BatchedScratchPad::getWaitPolicy)
             .def("get_brush_num", &BatchedScratchPad::getBrushNum)
-            .def("get_layer_num", &BatchedScratchPad::getLayerNum)
-            .def("get_pad_size", &BatchedScratchPad::getPadSize)
+            .def("get_layer_num", &BatchedScratchPad::getLayerNum, py::call_guard<py::gil_scoped_release>())
+            .def("get_pad_size", &BatchedScratchPad::getPadSize, py::call_guard<py::gil_scoped_release>())
             .def("draw", &BatchedScratchPad::draw, py::call_guard<py::gil_scoped_release>())
-            .def("render_layer", py::overload_cast<const std::vector<int> &,
-                                                   const std::vector<int> &,
-                                                   const py::object &>(&BatchedScratchPad::renderLayer))
-            .def("render", py::overload_cast<const std::vector<int> &,
-                                             const py::object &>(&BatchedScratchPad::render));
+            .def("draw", &BatchedScratchPad::drawArray,
+                 py::arg("pad"), py::arg("layer"), py::arg("brush"), py::arg("setting"),
+                 py::arg("points"), py::arg("offsets"),
+                 R"(Draw M strokes, settings are an (M, 6) float32 array, points of all strokes are
+                    a flat (N, 6) float32 array, or a dict of arrays, stroke i is made of points
+                    [offsets[i], offsets[i + 1]). Strokes of the same pad are drawn in order by a
+                    single task.)")
+            .def("draw_strokes", &BatchedScratchPad::drawStrokes, py::call_guard<py::gil_scoped_release>(),
+                 py::arg("pad"), py::arg("strokes"),
+                 R"(Draw a list of (layer, brush, setting, points) strokes on each pad, strokes of
+                    a pad are drawn in order by a single task.)")
+            .def("draw_async", &BatchedScratchPad::drawAsync,
+                 py::arg("pad"), py::arg("layer"), py::arg("brush"), py::arg("setting"), py::arg("points"),
+                 R"(Like draw, but returns an AsyncHandle at once. Work on the same pad, async or
+                    not, runs in submission order.)")
+            .def("draw_async", &BatchedScratchPad::drawArrayAsync,
+                 py::arg("pad"), py::arg("layer"), py::arg("brush"), py::arg("setting"),
+                 py::arg("points"), py::arg("offsets"))
+            .def("render_layer", &BatchedScratchPad::renderLayer,
+                 py::arg("pad"), py::arg("layer"), py::arg("dtype"),
+                 py::arg("out_size") = py::none(), py::arg("filter") = "box",
+                 py::arg("layout") = "HWC", py::arg("channels") = "RGBA",
+                 py::arg("background") = py::none(), py::arg("mean") = py::none(), py::arg("std") = py::none(),
+                 py::arg("encoding") = "default")
+            .def("render_layer_into", &BatchedScratchPad::renderLayerBatchInto,
+                 py::arg("pad"), py::arg("layer"), py::arg("out"),
+                 py::arg("out_size") = py::none(), py::arg("filter") = "box",
+                 py::arg("layout") = "HWC", py::arg("channels") = "RGBA",
+                 py::arg("background") = py::none(), py::arg("mean") = py::none(), py::arg("std") = py::none(),
+                 py::arg("encoding") = "default")
+            .def("render_layer_into", &BatchedScratchPad::renderLayerInto,
+                 py::arg("pad"), py::arg("layer"), py::arg("out"),
+                 py::arg("out_size") = py::none(), py::arg("filter") = "box",
+                 py::arg("layout") = "HWC", py::arg("channels") = "RGBA",
+                 py::arg("background") = py::none(), py::arg("mean") = py::none(), py::arg("std") = py::none(),
+                 py::arg("encoding") = "default")
+            .def("render_layer_batch", &BatchedScratchPad::renderLayerBatch,
+                 py::arg("pad"), py::arg("layer"), py::arg("dtype"),
+                 py::arg("out_size") = py::none(), py::arg("filter") = "box",
+                 py::arg("layout") = "HWC", py::arg("channels") = "RGBA",
+                 py::arg("background") = py::none(), py::arg("mean") = py::none(), py::arg("std") = py::none(),
+                 py::arg("encoding") = "default")
+            .def("render", &BatchedScratchPad::render,
+                 py::arg("pad"), py::arg("dtype"),
+                 py::arg("out_size") = py::none(), py::arg("filter") = "box",
+                 py::arg("layout") = "HWC", py::arg("channels") = "RGBA",
+                 py::arg("background") = py::none(), py::arg("mean") = py::none(), py::arg("std") = py::none(),
+                 py::arg("encoding") = "default")
+            .def("render_into", &BatchedScratchPad::renderBatchInto,
+                 py::arg("pad"), py::arg("out"),
+                 py::arg("out_size") = py::none(), py::arg("filter") = "box",
+                 py::arg("layout") = "HWC", py::arg("channels") = "RGBA",
+                 py::arg("background") = py::none(), py::arg("mean") = py::none(), py::arg("std") = py::none(),
+                 py::arg("encoding") = "default")
+            .def("render_into", &BatchedScratchPad::renderInto,
+                 py::arg("pad"), py::arg("out"),
+                 py::arg("out_size") = py::none(), py::arg("filter") = "box",
+                 py::arg("layout") = "HWC", py::arg("channels") = "RGBA",
+                 py::arg("background") = py::none(), py::arg("mean") = py::none(), py::arg("std") = py::none(),
+                 py::arg("encoding") = "default")
+            .def("render_batch", &BatchedScratchPad::renderBatch,
+                 py::arg("pad"), py::arg("dtype"),
+                 py::arg("out_size") = py::none(), py::arg("filter") = "box",
+                 py::arg("layout") = "HWC", py::arg("channels") = "RGBA",
+                 py::arg("background") = py::none(), py::arg("mean") = py::none(), py::arg("std") = py::none(),
+                 py::arg("encoding") = "default")
+            .def("step", &BatchedScratchPad::step,
+                 py::arg("pad"), py::arg("layer"), py::arg("brush"), py::arg("setting"),
+                 py::arg("points"), py::arg("offsets"), py::arg("dtype"), py::arg("out") = py::none(),
+                 py::arg("out_size") = py::none(), py::arg("filter") = "box",
+                 py::arg("layout") = "HWC", py::arg("channels") = "RGBA",
+                 py::arg("background") = py::none(), py::arg("mean") = py::none(), py::arg("std") = py::none(),
+                 py::arg("encoding") = "default",
+                 R"(Draw strokes given like the array form of draw, then render every pad drawn on
+                    to the k-th item of a batch, k is the order the pad first appears in. Each pad is
+                    drawn and rendered by a single task, the batch is rendered into out if given,
+                    otherwise into a new array of dtype.)")
+            .def("layer_view", &BatchedScratchPad::layerView, py::arg("pad"), py::arg("layer"),
+                 R"(Like ScratchPad.layer_view, after the work submitted to the pad is finished.)")
+            .def("render_async", &BatchedScratchPad::renderAsync,
+                 py::arg("pad"), py::arg("dtype"),
+                 py::arg("out_size") = py::none(), py::arg("filter") = "box",
+                 py::arg("layout") = "HWC", py::arg("channels") = "RGBA",
+                 py::arg("background") = py::none(), py::arg("mean") = py::none(), py::arg("std") = py::none(),
+                 py::arg("encoding") = "default",
+                 R"(Like render, but returns an AsyncHandle at once, its result is the list of arrays.
+                    Each pad is rendered after the work submitted to it before.)")
+            .def("render_batch_async", &BatchedScratchPad::renderBatchAsync,
+                 py::arg("pad"), py::arg("dtype"),
+                 py::arg("out_size") = py::none(), py::arg("filter") = "box",
+                 py::arg("layout") = "HWC", py::arg("channels") = "RGBA",
+                 py::arg("background") = py::none(), py::arg("mean") = py::none(), py::arg("std") = py::none(),
+                 py::arg("encoding") = "default");
 
 #ifdef VERSION_INFO
     m.attr("__version__") = VERSION_INFO;
@@ -1,60 +1,258 @@
 #include "scratchpad.h"
-#include "fix15.h"
+#include "arena.h"
+#include "simd.h"
 #include "util.h"
 #include <fmt/format.h>
+#include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <cstdlib>
+#include <cstring>
+#include <limits>
 #include <stdexcept>
+#include <type_traits>
 
 
-#define CONVERT_AND_RETURN_F(type) \
-    auto tmp = new type[r_w * r_h * 4];\
-    void* result =  malloc(sizeof(type) * r_w * r_h * 4);\
-    if (result == NULL)\
-        throw std::bad_alloc();\
-    _convertFix15ToFloat<type>(in_layer, tmp, r_w * r_h);\
-    _reformat<type>(tmp, static_cast<type*>(result), r_w, r_h, MYPAINT_TILE_SIZE);\
-    delete [] tmp;\
-    return result
+// a transparent tile, used as the bottom when the bottom layer is empty
+alignas(64) static const uint16_t empty_tile[MYPAINT_TILE_SIZE * MYPAINT_TILE_SIZE * 4] = {};
 
 
-#define CONVERT_AND_RETURN_I(type) \
-    auto tmp = new type[r_w * r_h * 4];\
-    void* result =  malloc(sizeof(type) * r_w * r_h * 4);\
-    if (result == NULL)\
-        throw std::bad_alloc();\
-    _convertFix15ToInt<type>(in_layer, tmp, r_w * r_h);\
-    _reformat<type>(tmp, static_cast<type*>(result), r_w, r_h, MYPAINT_TILE_SIZE);\
-    delete [] tmp;\
-    return result
+struct ResampleAxis {
+    // destination pixel i is the sum of source pixels [begin[i], begin[i] + size[i])
+    // weighted by weights[i * support + k], weights of a pixel sum up to 1
+    int support;
+    std::vector<int> begin;
+    std::vector<int> size;
+    std::vector<float> weights;
+};
 
+static std::atomic<uint64_t> next_layer_id(0);
+
+static const std::shared_ptr<const Fix15Tile> &empty_snapshot_tile() {
+    // shared by all snapshots for tiles which were empty when they were saved
+    static const std::shared_ptr<const Fix15Tile> tile = std::make_shared<const Fix15Tile>(Fix15Tile{});
+    return tile;
+}
+
+static void save_snapshot_tile(SnapshotRegistry &registry, uint64_t layer_id, int t_id, const uint16_t *tile,
+                               std::shared_ptr<const Fix15Tile> copy = nullptr) {
+    // the tile is copied once for all snapshots which still share it, unless a copy
+    // is given, empty_tile is never copied
+    for (auto &item: registry.snapshots) {
+        auto snapshot = item.lock();
+        if (not snapshot)
+            continue;
+        for (auto &layer: snapshot->layers) {
+            if (layer.layer_id != layer_id or layer.tiles[t_id])
+                continue;
+            if (not copy) {
+                if (tile == empty_tile) {
+                    copy = empty_snapshot_tile();
+                } else {
+                    auto tile_copy = std::make_shared<Fix15Tile>();
+                    std::memcpy(tile_copy->data(), tile, sizeof(Fix15Tile));
+                    copy = std::move(tile_copy);
+                }
+            }
+            layer.tiles[t_id] = copy;
+        }
+    }
+}
+
+static void layer_tile_request_start(MyPaintTiledSurface *surface, MyPaintTileRequest *request) {
+    auto draw_surface = reinterpret_cast<LayerSurface *>(surface);
+    auto layer = (MyPaintTiledSurface *) draw_surface->layer;
+    layer->tile_request_start(layer, request);
+    // tiles out of the pad are the null tile of the surface
+    if (request->tx < 0 or request->tx >= draw_surface->tile_cols or
+        request->ty < 0 or request->ty >= draw_surface->tile_rows)
+        return;
+    // requests of different tiles may run in parallel, each one only changes its own tile
+    const int t_id = request->ty * draw_surface->tile_cols + request->tx;
+    std::shared_ptr<const Fix15Tile> shared;
+    if (draw_surface->shared->num.load(std::memory_order_relaxed) > 0) {
+        shared = std::move(draw_surface->shared->tiles[t_id]);
+        if (shared) {
+            std::memcpy(request->buffer, shared->data(), sizeof(Fix15Tile));
+            draw_surface->shared->num--;
+        }
+    }
+    if (not request->readonly and not draw_surface->registry->snapshots.empty())
+        save_snapshot_tile(*draw_surface->registry, draw_surface->layer_id, t_id, request->buffer, std::move(shared));
+}
+
+static void layer_tile_request_end(MyPaintTiledSurface *surface, MyPaintTileRequest *request) {
+    auto layer = (MyPaintTiledSurface *) reinterpret_cast<LayerSurface *>(surface)->layer;
+    layer->tile_request_end(layer, request);
+}
+
+static uint16_t *surface_buffer(MyPaintFixedTiledSurface *layer) {
+    // tiles of a fixed tiled surface are stored row by row in one buffer, starting at tile (0, 0)
+    MyPaintTileRequest request;
+    mypaint_tile_request_init(&request, 0, 0, 0, TRUE);
+    mypaint_tiled_surface_tile_request_start((MyPaintTiledSurface *) layer, &request);
+    mypaint_tiled_surface_tile_request_end((MyPaintTiledSurface *) layer, &request);
+    return request.buffer;
+}
+
+static ResampleAxis resample_axis(int src_size, int dst_size, ResampleFilter filter) {
+    const double scale = double(src_size) / dst_size;
+    // half width of the footprint of a destination pixel, in source pixels
+    const double radius = filter == FILTER_BOX ? scale / 2 : std::max(scale, 1.0);
+
+    ResampleAxis axis;
+    axis.support = (int) std::ceil(radius * 2) + 2;
+    axis.begin.resize(dst_size);
+    axis.size.resize(dst_size);
+    axis.weights.assign((size_t) dst_size * axis.support, 0.0f);
+
+    std::vector<double> weights(axis.support);
+    for (int i = 0; i < dst_size; i++) {
+        const double center = (i + 0.5) * scale;
+        int begin = std::max((int) std::floor(center - radius), 0);
+        int end = std::min((int) std::ceil(center + radius), src_size);
+        double total = 0;
+        for (int x = begin; x < end; x++) {
+            double weight;
+            if (filter == FILTER_BOX)
+                // overlap of the pixel and the footprint
+                weight = std::min(x + 1.0, center + radius) - std::max(double(x), center - radius);
+            else
+                // triangle at the center of the footprint, sampled at the pixel center
+                weight = 1.0 - std::abs(x + 0.5 - center) / radius;
+            weights[x - begin] = std::max(weight, 0.0);
+            total += weights[x - begin];
+        }
+        for (int x = begin; x < end; x++)
+            axis.weights[(size_t) i * axis.support + x - begin] = (float) (weights[x - begin] / total);
+        axis.begin[i] = begin;
+        axis.size[i] = end - begin;
+    }
+    return axis;
+}
+
+
+template<typename T, typename Enable = void>
+struct Fix15Output {
+    // integers in range [0, 255], with rounding, alpha needs to be divided by 2
+    static T color(uint32_t c) { return (c * 255 + (1u << 14u)) / (1u << 15u); }
+    static T alpha(uint32_t a) { return (a * 255 + (1u << 14u)) / (1u << 16u); }
+    static T store(T value) { return value; }
+};
+
+template<typename T>
+struct Fix15Output<T, std::enable_if_t<std::is_floating_point<T>::value>> {
+    // floats in range [0, 1], alpha needs to be divided by 2
+    static T color(uint32_t c) { return c / T(1u << 15u); }
+    static T alpha(uint32_t a) { return a / T(1u << 16u); }
+    static T store(T value) { return value; }
+};
+
+template<>
+struct Fix15Output<Float16> : Fix15Output<float> {
+    static Float16 store(float value) { return Float16{float_to_float16(value)}; }
+};
+
+template<>
+struct Fix15Output<BFloat16> : Fix15Output<float> {
+    static BFloat16 store(float value) { return BFloat16{float_to_bfloat16(value)}; }
+};
+
+template<typename I>
+struct Fix15Output<FullRange<I>> {
+    // integers in range [0, max], with rounding, alpha is scaled like colors so that opaque is max
+    // max is split to max_h * 2^15 + max_l so that no product overflows 64 bits
+    static constexpr uint64_t max = std::numeric_limits<I>::max();
+    static I color(uint32_t c) {
+        return c * (max >> 15u) + ((c * (max & 0x7FFFu) + (1u << 14u)) >> 15u);
+    }
+    static I alpha(uint32_t a) { return color(a); }
+    static FullRange<I> store(I value) { return FullRange<I>{value}; }
+};
+
+bool operator==(const Setting &a, const Setting &b) {
+    return a.opacity == b.opacity and a.radius == b.radius and a.hardness == b.hardness
+           and a.color_h == b.color_h and a.color_s == b.color_s and a.color_v == b.color_v;
+}
+
+bool operator==(const PixelTransform &a, const PixelTransform &b) {
+    if (a.background != b.background or a.normalize != b.normalize)
+        return false;
+    if (a.background and not std::equal(a.background_color, a.background_color + 3, b.background_color))
+        return false;
+    if (a.normalize and (not std::equal(a.scale, a.scale + 4, b.scale) or
+                         not std::equal(a.offset, a.offset + 4, b.offset)))
+        return false;
+    return true;
+}
 
 ScratchPad::ScratchPad(const ScratchPad &pad)
-: _width(pad._width), _height(pad._width),
-  _brushes(pad._brushes), _layers(pad._layers),
-  _layer_opacity(pad._layer_opacity) {
-    std::cout << "Copy called!" << std::endl;
-    for (auto brush: _brushes)
-        mypaint_brush_ref(brush);
-    for (auto layer: _layers)
-        mypaint_surface_ref(mypaint_fixed_tiled_surface_interface(layer));
+: _width(pad._width), _height(pad._height),
+  _brush_strings(pad._brush_strings),
+  _layer_opacity(pad._layer_opacity), _template(pad._template),
+  _revision(pad._revision), _tile_revision(pad._tile_revision),
+  _tile_state(pad._tile_state) {
+    // brushes are duplicated, layers have no surface and share all their tiles, the tiles
+    // the pad shares are shared as well, the filled tiles it holds are copied
+    for (size_t b = 0; b < pad._brushes.size(); b++)
+        _brushes.push_back(_cloneBrush(pad._brushes[b], pad._brush_strings[b]));
+    const int tile_stride = MYPAINT_TILE_SIZE * MYPAINT_TILE_SIZE * 4;
+    for (size_t l = 0; l < pad._layers.size(); l++) {
+        _layers.push_back(nullptr);
+        _layer_id.push_back(next_layer_id++);
+        _shared_tiles.push_back(std::make_unique<SharedTiles>());
+        auto &shared = *_shared_tiles[l];
+        const uint16_t *buffer = pad._layers[l] ? surface_buffer(pad._layers[l]) : nullptr;
+        for (int t_id = 0; t_id < _tileNum(); t_id++) {
+            auto &tile = pad._shared_tiles[l]->tiles[t_id];
+            if (tile) {
+                shared.tiles.push_back(tile);
+            } else if (_tile_state[l][t_id] == TILE_EMPTY) {
+                shared.tiles.push_back(empty_snapshot_tile());
+            } else {
+                auto tile_copy = std::make_shared<Fix15Tile>();
+                std::memcpy(tile_copy->data(), buffer + (size_t) t_id * tile_stride, sizeof(Fix15Tile));
+                shared.tiles.push_back(std::move(tile_copy));
+            }
+        }
+        shared.num = _tileNum();
+    }
 }
 
 ScratchPad::ScratchPad(ScratchPad &&pad) noexcept {
-    std::cout << "Move called!" << std::endl;
     _width = pad._width;
     _height = pad._height;
     _brushes.swap(pad._brushes);
+    _brush_strings.swap(pad._brush_strings);
     _layers.swap(pad._layers);
+    _shared_tiles.swap(pad._shared_tiles);
     _layer_opacity.swap(pad._layer_opacity);
+    _layer_id.swap(pad._layer_id);
+    _snapshots.swap(pad._snapshots);
+    std::swap(_draw_surface, pad._draw_surface);
+    _spare_layers.swap(pad._spare_layers);
+    _template.swap(pad._template);
+    _template_revision = pad._template_revision;
+    _template_layer_id.swap(pad._template_layer_id);
+    _revision = pad._revision;
+    _tile_revision.swap(pad._tile_revision);
+    _tile_state.swap(pad._tile_state);
+    _render_cache.swap(pad._render_cache);
 }
 
 ScratchPad::~ScratchPad() {
     // will destroy instances completely if ref count > 1
     for (auto brush: _brushes)
         mypaint_brush_unref(brush);
-    for (auto layer: _layers)
-        mypaint_surface_unref(mypaint_fixed_tiled_surface_interface(layer));
+    // snapshots can't be restored without the pad, they are not given the tiles
+    _snapshots->snapshots.clear();
+    for (int i = 0; i < _layers.size(); i++)
+        _releaseSurface(i);
+    _releaseSpares();
+    if (_draw_surface) {
+        mypaint_tiled_surface_destroy(&_draw_surface->parent);
+        delete _draw_surface;
+    }
 }
 
 void ScratchPad::loadBrush(const std::string &brush_string) {
@@ -64,6 +262,7 @@ void ScratchPad::loadBrush(const std::string &brush_string) {
     if (mypaint_brush_from_string(brush, brush_string.c_str()) == FALSE)
         throw std::invalid_argument("Failed to create brush from string");
     _brushes.push_back(brush);
+    _brush_strings.push_back(brush_string);
 }
 
 void ScratchPad::resetPad(int width, int height, int layers) {
@@ -72,31 +271,64 @@ void ScratchPad::resetPad(int width, int height, int layers) {
                 "Invalid pad configuration, requirements are: width > 0, "
                 "height > 0, layers > 0."
         );
+    if (width == _width and height == _height) {
+        // layers are cleared in place, only tiles which may have been drawn are written,
+        // the render cache is kept for tiles which stay the same
+        while (_layers.size() > layers)
+            popLayer(_layers.size() - 1);
+        for (int i = 0; i < _layers.size(); i++) {
+            _detachSurface(i);
+            _clearLayer(i);
+            _layer_id[i] = next_layer_id++;
+            if (_layer_opacity[i] != 1.0)
+                _invalidateCache();
+            _layer_opacity[i] = 1.0;
+        }
+        while (_layers.size() < layers)
+            addLayer();
+        return;
+    }
+
+    // destroy existing layers
+    for (int i = 0; i < _layers.size(); i++)
+        _releaseSurface(i);
+    _releaseSpares();
     _width = width;
     _height = height;
-    // destroy existing layers
-    for (auto layer: _layers)
-        mypaint_surface_unref(mypaint_fixed_tiled_surface_interface(layer));
     _layers.clear();
+    _shared_tiles.clear();
+    _layer_opacity.clear();
+    _layer_id.clear();
+    _tile_revision.clear();
+    _tile_state.clear();
+    _render_cache.clear();
     for (int i = 0; i < layers; i++)
         addLayer();
 }
 
 void ScratchPad::addLayer() {
-    MyPaintFixedTiledSurface *layer = mypaint_fixed_tiled_surface_new(_width, _height);
-    if (layer == NULL)
-        throw std::bad_alloc();
-    _layers.push_back(layer);
+    MyPaintFixedTiledSurface *spare = _takeSpare();
+    _layers.push_back(spare ? spare : _newSurface());
+    _shared_tiles.push_back(std::make_unique<SharedTiles>());
+    _shared_tiles.back()->tiles.resize(_tileNum());
     _layer_opacity.push_back(1.0);
+    _layer_id.push_back(next_layer_id++);
+    _tile_revision.emplace_back(_tileNum(), 0);
+    _tile_state.emplace_back(_tileNum(), spare ? TILE_EMPTY : TILE_UNKNOWN);
+    _invalidateCache();
 }
 
 void ScratchPad::popLayer(int layer) {
     if (layer >= _layers.size() or layer < 0)
         throw std::out_of_range(fmt::format("Invalid layer index {}", layer));
-    MyPaintFixedTiledSurface *layer_ptr = _layers[layer];
-    mypaint_surface_unref(mypaint_fixed_tiled_surface_interface(layer_ptr));
+    _recycleSurface(layer);
     _layers.erase(_layers.begin() + layer);
+    _shared_tiles.erase(_shared_tiles.begin() + layer);
     _layer_opacity.erase(_layer_opacity.begin() + layer);
+    _layer_id.erase(_layer_id.begin() + layer);
+    _tile_revision.erase(_tile_revision.begin() + layer);
+    _tile_state.erase(_tile_state.begin() + layer);
+    _invalidateCache();
 }
 
 void ScratchPad::setOpacity(int layer, float opacity) {
@@ -104,9 +336,238 @@ void ScratchPad::setOpacity(int layer, float opacity) {
         throw std::out_of_range(fmt::format("Invalid layer index {}", layer));
     if (opacity < 0 || opacity > 1)
         throw std::invalid_argument("Opacity must be within range [0, 1]!");
+    if (_layer_opacity[layer] != opacity)
+        _invalidateCache();
     _layer_opacity[layer] = opacity;
 }
 
+void ScratchPad::setLayer(int layer, const py::object &image) {
+    py::array buffer;
+    auto view = _checkImage(image, buffer);
+    {
+        py::gil_scoped_release release;
+        setLayer(layer, view);
+    }
+}
+
+void ScratchPad::setLayer(int layer, const LayerImage &image) {
+    if (layer >= _layers.size() or layer < 0)
+        throw std::out_of_range(fmt::format("Invalid layer index {}", layer));
+    if (image.width != _width or image.height != _height)
+        throw std::invalid_argument(fmt::format("Image size {}x{} doesn't match the pad size {}x{}!",
+                                                image.width, image.height, _width, _height));
+
+    const int tile_size = MYPAINT_TILE_SIZE;
+    const int tile_cols = CEIL(_width, tile_size);
+    const int tile_num = _tileNum();
+    const int tile_stride = tile_size * tile_size * 4;
+    _ownSurface(layer);
+    uint16_t *buffer = surface_buffer(_layers[layer]);
+    auto &revision = _tile_revision[layer];
+    auto &state = _tile_state[layer];
+
+    // snapshots which still share tiles of the layer take them before they are written over,
+    // shared tiles are written over without being copied into the surface
+    for (int t_id = 0; t_id < tile_num; t_id++)
+        _saveTile(layer, t_id, buffer);
+    auto &shared = *_shared_tiles[layer];
+    std::fill(shared.tiles.begin(), shared.tiles.end(), nullptr);
+    shared.num = 0;
+
+    // each tile is converted row by row from its rect of the image, pixels out of the pad are cleared
+    const size_t pixel_size = (size_t) image.channels * image.item_size;
+    _revision++;
+    #pragma omp parallel for schedule(dynamic)
+    for (int t_id = 0; t_id < tile_num; t_id++) {
+        uint16_t *tile = buffer + (size_t) t_id * tile_stride;
+        int g_row = (t_id / tile_cols) * tile_size;
+        int g_col = (t_id % tile_cols) * tile_size;
+        int rows = std::min(tile_size, _height - g_row);
+        int cols = std::min(tile_size, _width - g_col);
+
+        for (int t_row = 0; t_row < rows; t_row++) {
+            const char *in = static_cast<const char *>(image.data)
+                             + ((size_t) (g_row + t_row) * _width + g_col) * pixel_size;
+            uint16_t *out = tile + t_row * tile_size * 4;
+            if (image.kind == 'f')
+                _convertToFix15(reinterpret_cast<const float *>(in), image.channels, out, cols);
+            else if (image.item_size == 2)
+                _convertToFix15(reinterpret_cast<const uint16_t *>(in), image.channels, out, cols);
+            else
+                _convertToFix15(reinterpret_cast<const uint8_t *>(in), image.channels, out, cols);
+            std::memset(out + cols * 4, 0, (tile_size - cols) * 4 * sizeof(uint16_t));
+        }
+        std::memset(tile + rows * tile_size * 4, 0, (tile_size - rows) * tile_size * 4 * sizeof(uint16_t));
+        revision[t_id] = _revision;
+        state[t_id] = _isEmptyTile(tile) ? TILE_EMPTY : TILE_FILLED;
+    }
+}
+
+std::shared_ptr<PadSnapshot> ScratchPad::snapshot() {
+    // no tile is copied here, draws copy the tiles they touch into the snapshot first
+    auto snapshot = std::make_shared<PadSnapshot>();
+    snapshot->registry = _snapshots;
+    snapshot->width = _width;
+    snapshot->height = _height;
+    for (int l = 0; l < _layers.size(); l++)
+        snapshot->layers.push_back(LayerSnapshot{_layer_id[l], _layer_opacity[l],
+                                                 std::vector<std::shared_ptr<const Fix15Tile>>(_tileNum()),
+                                                 _tile_state[l]});
+    for (auto brush: _brushes) {
+        std::vector<float> states(MYPAINT_BRUSH_STATES_COUNT);
+        for (int i = 0; i < MYPAINT_BRUSH_STATES_COUNT; i++)
+            states[i] = mypaint_brush_get_state(brush, (MyPaintBrushState) i);
+        snapshot->brush_states.push_back(std::move(states));
+    }
+
+    _pruneSnapshots();
+    _snapshots->snapshots.push_back(snapshot);
+    return snapshot;
+}
+
+void ScratchPad::restore(PadSnapshot &snapshot) {
+    if (snapshot.registry != _snapshots)
+        throw std::invalid_argument("Snapshot was taken from another pad!");
+
+    // layers removed since the snapshot are created again, layers added since are removed
+    std::vector<int> live(snapshot.layers.size(), -1);
+    std::vector<bool> kept(_layers.size(), false);
+    for (size_t l = 0; l < snapshot.layers.size(); l++) {
+        for (int i = 0; i < _layers.size(); i++) {
+            if (_layer_id[i] == snapshot.layers[l].layer_id) {
+                live[l] = i;
+                kept[i] = true;
+            }
+        }
+    }
+    const bool resized = snapshot.width != _width or snapshot.height != _height;
+    for (int i = 0; i < _layers.size(); i++) {
+        if (kept[i])
+            continue;
+        if (resized)
+            _releaseSurface(i);
+        else
+            _recycleSurface(i);
+    }
+    if (resized) {
+        _releaseSpares();
+        _render_cache.clear();
+    }
+    _width = snapshot.width;
+    _height = snapshot.height;
+
+    std::vector<MyPaintFixedTiledSurface *> layers;
+    std::vector<std::unique_ptr<SharedTiles>> shared_tiles;
+    std::vector<float> layer_opacity;
+    std::vector<std::vector<uint64_t>> tile_revision;
+    std::vector<std::vector<uint8_t>> tile_state;
+    bool changed = snapshot.layers.size() != _layers.size();
+    _revision++;
+    for (size_t l = 0; l < snapshot.layers.size(); l++) {
+        auto &saved = snapshot.layers[l];
+        const int i = live[l];
+        changed = changed or i != (int) l or _layer_opacity[i] != saved.opacity;
+        if (i >= 0) {
+            layers.push_back(_layers[i]);
+            shared_tiles.push_back(std::move(_shared_tiles[i]));
+            tile_revision.push_back(std::move(_tile_revision[i]));
+            tile_state.push_back(std::move(_tile_state[i]));
+        } else {
+            // every tile of a removed layer has been saved, the layer shares them until it is drawn
+            layers.push_back(nullptr);
+            shared_tiles.push_back(std::make_unique<SharedTiles>());
+            shared_tiles.back()->tiles = saved.tiles;
+            shared_tiles.back()->num = _tileNum();
+            std::fill(saved.tiles.begin(), saved.tiles.end(), nullptr);
+            tile_revision.emplace_back(_tileNum(), _revision);
+            tile_state.push_back(saved.tile_state);
+        }
+        layer_opacity.push_back(saved.opacity);
+    }
+    _layers.swap(layers);
+    _shared_tiles.swap(shared_tiles);
+    _layer_opacity.swap(layer_opacity);
+    _tile_revision.swap(tile_revision);
+    _tile_state.swap(tile_state);
+    _layer_id.clear();
+    for (auto &saved: snapshot.layers)
+        _layer_id.push_back(saved.layer_id);
+
+    for (int l = 0; l < _layers.size(); l++) {
+        auto &saved = snapshot.layers[l];
+        uint16_t *buffer = _layers[l] ? surface_buffer(_layers[l]) : nullptr;
+        for (int t_id = 0; t_id < _tileNum(); t_id++) {
+            if (not saved.tiles[t_id])
+                continue;
+            // other snapshots may still share the tile being restored
+            _saveTile(l, t_id, buffer);
+            _setTile(l, t_id, buffer, saved.tiles[t_id]);
+            _tile_revision[l][t_id] = _revision;
+            _tile_state[l][t_id] = saved.tile_state[t_id];
+            // the layer holds the tile again
+            saved.tiles[t_id] = nullptr;
+        }
+    }
+    if (changed)
+        _invalidateCache();
+
+    // brushes loaded since the snapshot keep their states
+    for (size_t b = 0; b < std::min(_brushes.size(), snapshot.brush_states.size()); b++) {
+        for (int i = 0; i < MYPAINT_BRUSH_STATES_COUNT; i++)
+            mypaint_brush_set_state(_brushes[b], (MyPaintBrushState) i, snapshot.brush_states[b][i]);
+    }
+}
+
+std::vector<ScratchPad> ScratchPad::fork(int n) {
+    if (n < 0)
+        throw std::invalid_argument("Fork number must be >= 0!");
+    // the layers are frozen, so that the forks share all their tiles with the pad
+    // and each pad copies only the tiles it draws
+    std::vector<ScratchPad> pads;
+    if (n == 0)
+        return pads;
+    _freezeLayers();
+    pads.reserve(n);
+    for (int i = 0; i < n; i++)
+        pads.emplace_back(*this);
+    return pads;
+}
+
+void ScratchPad::setTemplate(const std::vector<int> &layers) {
+    _setTemplate(_makeTemplate(layers));
+}
+
+void ScratchPad::resetFromTemplate() {
+    if (not _template)
+        throw std::invalid_argument("No template has been set!");
+    const PadTemplate &pad_template = *_template;
+    // layers which still hold the template only get back the tiles drawn since the last reset,
+    // other layers are cleared and get the filled tiles of the template
+    const bool drawn_only = not _template_layer_id.empty() and _layer_id == _template_layer_id;
+    if (not drawn_only)
+        resetPad(pad_template.width, pad_template.height, pad_template.tiles.size());
+
+    _revision++;
+    for (int l = 0; l < _layers.size(); l++) {
+        uint16_t *buffer = _layers[l] ? surface_buffer(_layers[l]) : nullptr;
+        auto &revision = _tile_revision[l];
+        auto &state = _tile_state[l];
+        for (int t_id = 0; t_id < _tileNum(); t_id++) {
+            auto &tile = pad_template.tiles[l][t_id];
+            if (drawn_only ? revision[t_id] <= _template_revision : not tile)
+                continue;
+            // snapshots may still share the tile
+            _saveTile(l, t_id, buffer);
+            _setTile(l, t_id, buffer, tile);
+            revision[t_id] = _revision;
+            state[t_id] = tile ? TILE_FILLED : TILE_EMPTY;
+        }
+        setOpacity(l, pad_template.opacity[l]);
+    }
+    _template_revision = _revision;
+    _template_layer_id = _layer_id;
+}
+
 int ScratchPad::getBrushNum() {
     return _brushes.size();
 }
@@ -121,226 +582,1155 @@ std::tuple<int, int> ScratchPad::getPadSize() {
 
 void ScratchPad::draw(int layer, int brush, const Setting &setting,
                       const std::vector<Point> &points) {
-    if (layer >= _layers.size() or layer < 0)
-        throw std::out_of_range(fmt::format("Invalid layer index {}", layer));
-    if (brush >= _brushes.size() or brush < 0)
-        throw std::out_of_range(fmt::format("Invalid brush index {}", brush));
-
-    auto layer_ptr = (MyPaintSurface*)_layers[layer];
-    auto brush_ptr = _brushes[brush];
-
-    // apply brush settings
-    if (IN_RANGE(setting.opacity, 0, 1)
-        and IN_RANGE(setting.radius, 0, 1)
-        and IN_RANGE(setting.hardness, 0, 1)
-        and IN_RANGE(setting.color_h, 0, 1)
-        and IN_RANGE(setting.color_s, 0, 1)
-        and IN_RANGE(setting.color_v, 0, 1)) {
-        // opacity is in [0, 2.0]
-        mypaint_brush_set_base_value(brush_ptr, MYPAINT_BRUSH_SETTING_OPAQUE, setting.opacity * 2.0);
-        // radius is in [-2.0, 6.0]
-        mypaint_brush_set_base_value(brush_ptr, MYPAINT_BRUSH_SETTING_RADIUS_LOGARITHMIC, setting.radius * 8.0 - 2.0);
-        // hardness is in [0.0, 1.0]
-        mypaint_brush_set_base_value(brush_ptr, MYPAINT_BRUSH_SETTING_HARDNESS, setting.hardness);
-        // hue is in [0.0, 1.0]
-        mypaint_brush_set_base_value(brush_ptr, MYPAINT_BRUSH_SETTING_COLOR_H, setting.color_h);
-        // saturation is in [-0.5, 1.5]
-        mypaint_brush_set_base_value(brush_ptr, MYPAINT_BRUSH_SETTING_COLOR_S, setting.color_s * 2.0 - 0.5);
-        // value is in [-0.5, 1.5]
-        mypaint_brush_set_base_value(brush_ptr, MYPAINT_BRUSH_SETTING_COLOR_V, setting.color_v * 2.0 - 0.5);
-    }
-    else
-        throw std::invalid_argument("Invalid setting value, all point values must be in range of 0.0 to 1.0!");
+    draw(layer, brush, setting, _pointView(points));
+}
 
-    // draw
-    mypaint_surface_begin_atomic(layer_ptr);
-    for (auto &point: points) {
-        // check data validity
-        if (IN_RANGE(point.x, 0, 1)
-            and IN_RANGE(point.y, 0, 1)
-            and IN_RANGE(point.xtilt, 0, 1)
-            and IN_RANGE(point.ytilt, 0, 1)
-            and IN_RANGE(point.pressure, 0, 1)
-            and IN_RANGE(point.dtime, 0, 1)) {
-            mypaint_brush_stroke_to(brush_ptr, layer_ptr,
-                                    point.x * _width,
-                                    point.y * _height,
-                                    point.pressure,
-                                    point.xtilt * 2 - 1,
-                                    point.ytilt * 2 - 1,
-                                    point.dtime * 0.1);
-        } else
-            throw std::invalid_argument("Invalid point value, all point values must be in range of 0.0 to 1.0!");
-    }
-    MyPaintRectangle roi;
-    mypaint_surface_end_atomic(layer_ptr, &roi);
-}
-
-py::array ScratchPad::renderLayer(int layer, const py::object &dt) {
-    auto dtype = py::dtype::from_args(dt);
-    if (dtype.has_fields())
-        throw std::invalid_argument("Only support rendering as a flat floating array or integral array!");
-    auto kind = dtype.kind();
-    auto item_size = dtype.itemsize();
-    void *array;
+void ScratchPad::drawArray(int layer, int brush, const Setting &setting,
+                           const py::object &points) {
+    std::vector<py::array> buffers;
+    auto view = _checkPoints(points, buffers);
     {
         py::gil_scoped_release release;
-        array = renderLayer(layer, kind, item_size);
+        draw(layer, brush, setting, view);
     }
-    auto capsule = py::capsule(array, [](void *v) { free(v); });
-
-    int real_width = ALIGN(_width, MYPAINT_TILE_SIZE);
+}
 
-    return std::move(py::array(dtype,
-                               {_height, _width, 4},
-                               {real_width * 4 * item_size, 4 * item_size, item_size},
-                               array, capsule));
+void ScratchPad::draw(int layer, int brush, const Setting &setting,
+                      const PointArray &points) {
+    draw(std::vector<Stroke>{Stroke{layer, brush, setting, points}});
 }
 
-void* ScratchPad::renderLayer(int layer, char kind, int item_size) {
-    if (layer >= _layers.size() or layer < 0)
-        throw std::out_of_range(fmt::format("Invalid layer index {}", layer));
+void ScratchPad::drawStrokes(const std::vector<std::tuple<int, int, Setting, std::vector<Point>>> &strokes) {
+    std::vector<Stroke> views;
+    for (auto &stroke: strokes)
+        views.push_back(Stroke{std::get<0>(stroke), std::get<1>(stroke), std::get<2>(stroke),
+                               _pointView(std::get<3>(stroke))});
+    draw(views);
+}
 
-    // Start a new operation request
-    MyPaintTileRequest request;
+void ScratchPad::drawStrokesArray(const std::vector<int> &layer,
+                                  const std::vector<int> &brush,
+                                  const py::object &setting,
+                                  const py::object &points,
+                                  const py::object &offsets) {
+    std::vector<py::array> buffers;
+    auto strokes = _checkStrokes(layer, brush, setting, points, offsets, buffers);
+    {
+        py::gil_scoped_release release;
+        draw(strokes);
+    }
+}
 
-    // Note: we are not initializing the request for each tile in the surface
-    // because in a fixed tiled surface
-    // there is only one chunk of linear memory, with:
-    // width aligned to CEIL_DIV(width, TILE_WIDTH) * TILE_WIDTH
-    // height aligned to CEIL_DIV(height, TILE_HEIGHT) * TILE_HEIGHT
-    // we just need this request to get the pointer to internal linear memory
+void ScratchPad::draw(const std::vector<Stroke> &strokes) {
+    // all strokes are checked before drawing, so that an invalid stroke leaves the pad untouched
+    for (auto &stroke: strokes)
+        _checkStroke(stroke);
+    _pruneSnapshots();
 
-    // Note: the linear memory is tile by tile, and not row by row! Therefore we need reformat
-    // to change the memory layout.
+    // consecutive strokes on the same layer are drawn in one atomic section,
+    // brush settings are only applied when they change
+    size_t begin = 0;
+    while (begin < strokes.size()) {
+        const int layer = strokes[begin].layer;
+        size_t end = begin;
+        while (end < strokes.size() and strokes[end].layer == layer)
+            end++;
 
-    int real_width = ALIGN(_width, MYPAINT_TILE_SIZE);
-    int real_height = ALIGN(_height, MYPAINT_TILE_SIZE);
+        _ownSurface(layer);
+        auto layer_ptr = _drawSurface(layer);
+        mypaint_surface_begin_atomic(layer_ptr);
+        for (size_t s = begin; s < end; s++) {
+            auto &stroke = strokes[s];
+            auto brush_ptr = _brushes[stroke.brush];
+            if (s == 0 or stroke.brush != strokes[s - 1].brush or not (stroke.setting == strokes[s - 1].setting))
+                _applySetting(brush_ptr, stroke.setting);
 
-    auto layer_ptr = (MyPaintTiledSurface*)_layers[layer];
-    // request to operate on mipmap_level=0, tile with x=0, ty=0
-    mypaint_tile_request_init(&request, 0, 0, 0, TRUE);
-    mypaint_tiled_surface_tile_request_start(layer_ptr, &request);
-    auto array = _convertFix15(request.buffer, kind, item_size, real_width, real_height);
-    mypaint_tiled_surface_tile_request_end(layer_ptr, &request);
-    return array;
+            const float *x = stroke.points.data[0], *y = stroke.points.data[1];
+            const float *xtilt = stroke.points.data[2], *ytilt = stroke.points.data[3];
+            const float *pressure = stroke.points.data[4], *dtime = stroke.points.data[5];
+            const ptrdiff_t *stride = stroke.points.stride;
+            for (size_t i = 0; i < stroke.points.size; i++) {
+                mypaint_brush_stroke_to(brush_ptr, layer_ptr,
+                                        x[i * stride[0]] * _width,
+                                        y[i * stride[1]] * _height,
+                                        pressure[i * stride[4]],
+                                        xtilt[i * stride[2]] * 2 - 1,
+                                        ytilt[i * stride[3]] * 2 - 1,
+                                        dtime[i * stride[5]] * 0.1);
+            }
+        }
+        MyPaintRectangle roi;
+        mypaint_surface_end_atomic(layer_ptr, &roi);
+        _markDirty(layer, roi);
+        begin = end;
+    }
 }
 
-py::array ScratchPad::render(const py::object &dt) {
+py::array ScratchPad::renderLayer(int layer, const py::object &dt,
+                                  const py::object &out_size, const std::string &filter,
+                                  const std::string &layout, const std::string &channels,
+                                  const py::object &background, const py::object &mean,
+                                  const py::object &stddev, const std::string &encoding) {
     auto dtype = py::dtype::from_args(dt);
     if (dtype.has_fields())
         throw std::invalid_argument("Only support rendering as a flat floating array or integral array!");
-    auto kind = dtype.kind();
-    auto item_size = dtype.itemsize();
-    void *array;
+    auto format = _parseFormat(out_size, filter, layout, channels, background, mean, stddev, encoding, _width, _height);
+    py::array out(dtype, _outputShape(format));
+    renderLayerInto(layer, out, out_size, filter, layout, channels, background, mean, stddev, encoding);
+    return out;
+}
+
+void ScratchPad::renderLayerInto(int layer, py::array &out,
+                                 const py::object &out_size, const std::string &filter,
+                                 const std::string &layout, const std::string &channels,
+                                 const py::object &background, const py::object &mean,
+                                 const py::object &stddev, const std::string &encoding) {
+    auto target = _checkTarget(out, _parseFormat(out_size, filter, layout, channels,
+                                                 background, mean, stddev, encoding, _width, _height));
+    auto kind = out.dtype().kind();
+    auto item_size = out.itemsize();
     {
         py::gil_scoped_release release;
-        array = render(kind, item_size);
+        renderLayer(layer, kind, item_size, target);
+    }
+}
+
+void* ScratchPad::renderLayer(int layer, char kind, int item_size) {
+    void *array = _allocOutput(item_size);
+    try {
+        renderLayer(layer, kind, item_size, _denseTarget(array, item_size));
+    }
+    catch (...) {
+        free(array);
+        throw;
     }
-    auto capsule = py::capsule(array, [](void *v) { free(v); });
+    return array;
+}
 
-    int real_width = ALIGN(_width, MYPAINT_TILE_SIZE);
+void ScratchPad::renderLayer(int layer, char kind, int item_size, const RenderTarget &target) {
+    if (layer >= _layers.size() or layer < 0)
+        throw std::out_of_range(fmt::format("Invalid layer index {}", layer));
+
+    // a single layer is converted as is, its opacity is only used when blending
+    _render({layer}, kind, item_size, target, _allTiles());
+}
+
+py::array ScratchPad::render(const py::object &dt,
+                             const py::object &out_size, const std::string &filter,
+                             const std::string &layout, const std::string &channels,
+                             const py::object &background, const py::object &mean,
+                             const py::object &stddev, const std::string &encoding) {
+    auto dtype = py::dtype::from_args(dt);
+    if (dtype.has_fields())
+        throw std::invalid_argument("Only support rendering as a flat floating array or integral array!");
+    auto format = _parseFormat(out_size, filter, layout, channels, background, mean, stddev, encoding, _width, _height);
+    py::array out(dtype, _outputShape(format));
+    renderInto(out, out_size, filter, layout, channels, background, mean, stddev, encoding);
+    return out;
+}
 
-    return std::move(py::array(dtype,
-                               {_height, _width, 4},
-                               {real_width * 4 * item_size, 4 * item_size, item_size},
-                               array, capsule));
+void ScratchPad::renderInto(py::array &out,
+                            const py::object &out_size, const std::string &filter,
+                            const std::string &layout, const std::string &channels,
+                            const py::object &background, const py::object &mean,
+                            const py::object &stddev, const std::string &encoding) {
+    auto target = _checkTarget(out, _parseFormat(out_size, filter, layout, channels,
+                                                 background, mean, stddev, encoding, _width, _height));
+    auto kind = out.dtype().kind();
+    auto item_size = out.itemsize();
+    {
+        py::gil_scoped_release release;
+        render(kind, item_size, target);
+    }
 }
 
 void* ScratchPad::render(char kind, int item_size) {
+    void *array = _allocOutput(item_size);
+    try {
+        render(kind, item_size, _denseTarget(array, item_size));
+    }
+    catch (...) {
+        free(array);
+        throw;
+    }
+    return array;
+}
+
+void ScratchPad::render(char kind, int item_size, const RenderTarget &target) {
     // must have one or more layers
     if (_layers.empty())
         throw std::out_of_range("Layers are empty!");
 
-    // copy the first layer to ping-pong buffer.
-    MyPaintTileRequest first_request;
+    if (target.width != _width or target.height != _height) {
+        // resampled outputs are not cached
+        std::vector<int> layers;
+        for (int i = 0; i < _layers.size(); i++)
+            layers.push_back(i);
+        _render(layers, kind, item_size, target, _allTiles());
+        return;
+    }
 
-    int real_width = ALIGN(_width, MYPAINT_TILE_SIZE);
-    int real_height = ALIGN(_height, MYPAINT_TILE_SIZE);
+    // only tiles touched since the last render of this dtype are composited again
+    _copyCache(_updateCache(kind, item_size, target), item_size, target);
+}
 
-    auto buffer_1 = new uint16_t[real_width * real_height * 4];
-    auto buffer_2 = new uint16_t[real_width * real_height * 4];
+py::array ScratchPad::layerView(int layer) {
+    // Premultiplied fix15 pixels of a layer in place, shaped (tile rows, tile cols, 64, 64, 4),
+    // the view follows later draws until the pad is forked. It holds a reference of the surface,
+    // so that its memory stays valid after the layer is popped or the pad is destroyed, popped
+    // surfaces with a view are released instead of being recycled for other layers.
+    if (layer >= _layers.size() or layer < 0)
+        throw std::out_of_range(fmt::format("Invalid layer index {}", layer));
+    _holdTiles(layer);
+    MyPaintSurface *surface = mypaint_fixed_tiled_surface_interface(_layers[layer]);
+    mypaint_surface_ref(surface);
+    py::capsule owner(surface, [](void *ptr) { mypaint_surface_unref(static_cast<MyPaintSurface *>(ptr)); });
 
-    // ping-pong buffer, when false, buffer_2 is output, when true, buffer_1 is output
-    bool ping_pong = false;
+    const ptrdiff_t tile_size = MYPAINT_TILE_SIZE;
+    const ptrdiff_t item_size = sizeof(uint16_t);
+    const ptrdiff_t tile_cols = CEIL(_width, tile_size), tile_rows = CEIL(_height, tile_size);
+    py::array view(py::dtype::of<uint16_t>(),
+                   {tile_rows, tile_cols, tile_size, tile_size, (ptrdiff_t) 4},
+                   {tile_cols * tile_size * tile_size * 4 * item_size, tile_size * tile_size * 4 * item_size,
+                    tile_size * 4 * item_size, 4 * item_size, item_size},
+                   surface_buffer(_layers[layer]), owner);
+    // writes would bypass tile states, revisions and snapshots
+    view.attr("flags").attr("writeable") = false;
+    return view;
+}
 
-    mypaint_tile_request_init(&first_request, 0, 0, 0, TRUE);
-    mypaint_tiled_surface_tile_request_start((MyPaintTiledSurface *) _layers[0], &first_request);
-    memcpy(buffer_1, first_request.buffer, real_width * real_height * 4 * sizeof(uint16_t));
-    mypaint_tiled_surface_tile_request_end((MyPaintTiledSurface *) _layers[0], &first_request);
+py::array ScratchPad::tileState(int layer) {
+    // TileState of each tile of a layer as it was last checked, shaped (tile rows, tile cols)
+    if (layer >= _layers.size() or layer < 0)
+        throw std::out_of_range(fmt::format("Invalid layer index {}", layer));
+    const ptrdiff_t tile_cols = CEIL(_width, MYPAINT_TILE_SIZE), tile_rows = CEIL(_height, MYPAINT_TILE_SIZE);
+    py::array_t<uint8_t> state({tile_rows, tile_cols});
+    std::copy(_tile_state[layer].begin(), _tile_state[layer].end(), state.mutable_data());
+    return state;
+}
 
-    for (size_t i = 1; i < _layers.size(); i++) {
-        // Blend current top layer with blended result
-        MyPaintTileRequest request;
-        auto layer_ptr = (MyPaintTiledSurface *) _layers[i];
-        mypaint_tile_request_init(&request, 0, 0, 0, TRUE);
-        mypaint_tiled_surface_tile_request_start(layer_ptr, &request);
+RenderTarget ScratchPad::_checkTarget(py::array &out, const RenderFormat &format, int batch) {
+    // returns the target of the first image if the output is a batch,
+    // images are out.strides(0) apart
+    int dim = batch < 0 ? 0 : 1;
+    if (out.dtype().has_fields())
+        throw std::invalid_argument("Only support rendering as a flat floating array or integral array!");
 
-        if (ping_pong)
-            _blend(request.buffer, buffer_2, buffer_1, _layer_opacity[i], real_width * real_height);
-        else
-            _blend(request.buffer, buffer_1, buffer_2, _layer_opacity[i], real_width * real_height);
+    auto shape = _outputShape(format, batch);
+    bool match = out.ndim() == shape.size();
+    for (int i = 0; match and i < shape.size(); i++)
+        match = out.shape(i) == shape[i];
+    if (not match)
+        throw std::invalid_argument(fmt::format("Output array must be of shape ({})!", fmt::join(shape, ", ")));
+    if (not out.writeable())
+        throw std::invalid_argument("Output array must be writeable!");
 
-        mypaint_tiled_surface_tile_request_end(layer_ptr, &request);
-        ping_pong = !ping_pong;
+    auto item_size = out.itemsize();
+    for (int i = 0; i < out.ndim(); i++) {
+        if (out.strides(i) % item_size != 0)
+            throw std::invalid_argument("Output array must be aligned to its item size!");
     }
+    if (reinterpret_cast<uintptr_t>(out.data()) % item_size != 0)
+        throw std::invalid_argument("Output array must be aligned to its item size!");
+    if (format.encoding == ENCODING_BFLOAT16 and (out.dtype().kind() != 'u' or item_size != 2))
+        throw std::invalid_argument("bfloat16 is rendered as its raw bits, output array must be of uint16!");
+    if (format.encoding == ENCODING_FULL_RANGE and out.dtype().kind() == 'f')
+        throw std::invalid_argument("Full range encoding is only supported when rendering as an integral array!");
+    if (format.transform.normalize and out.dtype().kind() != 'f' and format.encoding != ENCODING_BFLOAT16)
+        throw std::invalid_argument("Mean and std are only supported when rendering as a floating array!");
 
-    // Note: ping_pong is inverted here because of ping_pong = !ping_pong
-    if (ping_pong) {
-        delete [] buffer_1;
-        auto array = _convertFix15(buffer_2, kind, item_size, real_width, real_height);
-        delete [] buffer_2;
-        return array;
+    if (format.layout == LAYOUT_HWC)
+        return RenderTarget{out.mutable_data(), out.strides(dim), out.strides(dim + 1), out.strides(dim + 2),
+                            format.width, format.height, format.filter, format.channels, format.transform,
+                            format.encoding};
+    else
+        return RenderTarget{out.mutable_data(), out.strides(dim + 1), out.strides(dim + 2), out.strides(dim),
+                            format.width, format.height, format.filter, format.channels, format.transform,
+                            format.encoding};
+}
+
+RenderFormat ScratchPad::_parseFormat(const py::object &out_size, const std::string &filter,
+                                      const std::string &layout, const std::string &channels,
+                                      const py::object &background, const py::object &mean,
+                                      const py::object &stddev, const std::string &encoding,
+                                      int width, int height) {
+    // the output is of the pad size if out_size is None, otherwise out_size is (width, height)
+    RenderFormat format{width, height, FILTER_BOX, LAYOUT_HWC, CHANNELS_RGBA, PixelTransform(), ENCODING_DEFAULT};
+    if (not out_size.is_none()) {
+        std::tie(format.width, format.height) = out_size.cast<std::tuple<int, int>>();
+        if (format.width <= 0 or format.height <= 0)
+            throw std::invalid_argument("Output width and height must be larger than 0!");
     }
-    else {
-        delete [] buffer_2;
-        auto array = _convertFix15(buffer_1, kind, item_size, real_width, real_height);
-        delete [] buffer_1;
-        return array;
+
+    if (filter == "bilinear")
+        format.filter = FILTER_BILINEAR;
+    else if (filter != "box")
+        throw std::invalid_argument(fmt::format("Unknown filter {}, must be box or bilinear!", filter));
+
+    if (layout == "CHW")
+        format.layout = LAYOUT_CHW;
+    else if (layout != "HWC")
+        throw std::invalid_argument(fmt::format("Unknown layout {}, must be HWC or CHW!", layout));
+
+    if (channels == "RGB")
+        format.channels = CHANNELS_RGB;
+    else if (channels == "A")
+        format.channels = CHANNELS_A;
+    else if (channels == "L")
+        format.channels = CHANNELS_L;
+    else if (channels != "RGBA")
+        throw std::invalid_argument(fmt::format("Unknown channels {}, must be RGBA, RGB, A or L!", channels));
+
+    if (encoding == "bfloat16")
+        format.encoding = ENCODING_BFLOAT16;
+    else if (encoding == "full_range")
+        format.encoding = ENCODING_FULL_RANGE;
+    else if (encoding != "default")
+        throw std::invalid_argument(fmt::format("Unknown encoding {}, must be default, bfloat16 or full_range!",
+                                                encoding));
+
+    auto &transform = format.transform;
+    if (not background.is_none()) {
+        // (r, g, b) in range [0, 1]
+        auto color = background.cast<std::tuple<float, float, float>>();
+        float rgb[3] = {std::get<0>(color), std::get<1>(color), std::get<2>(color)};
+        for (int c = 0; c < 3; c++) {
+            if (not IN_RANGE(rgb[c], 0.0f, 1.0f))
+                throw std::invalid_argument("Background color must be in range [0, 1]!");
+            transform.background_color[c] = lroundf(rgb[c] * (1u << 15u));
+        }
+        transform.background = true;
+    }
+
+    if (not mean.is_none() or not stddev.is_none()) {
+        // one value for each output channel, or a single value for all of them
+        const int channel_num = ::channel_num(format.channels);
+        auto per_channel = [channel_num](const py::object &obj, float fallback, const char *name) {
+            std::vector<float> values;
+            if (obj.is_none())
+                values.assign(channel_num, fallback);
+            else if (py::isinstance<py::sequence>(obj))
+                values = obj.cast<std::vector<float>>();
+            else
+                values.assign(channel_num, obj.cast<float>());
+            if (values.size() != channel_num)
+                throw std::invalid_argument(fmt::format("Expect {} values of {}, one for each channel, got {}!",
+                                                        channel_num, name, values.size()));
+            return values;
+        };
+        auto mean_v = per_channel(mean, 0.0f, "mean");
+        auto std_v = per_channel(stddev, 1.0f, "std");
+        for (int c = 0; c < channel_num; c++) {
+            if (std_v[c] == 0.0f)
+                throw std::invalid_argument("Std must not be 0!");
+            transform.scale[c] = 1.0f / std_v[c];
+            transform.offset[c] = -mean_v[c] / std_v[c];
+        }
+        transform.normalize = true;
     }
+    return format;
 }
 
-void* ScratchPad::_convertFix15(const uint16_t *in_layer, char kind, int item_size, int r_w, int r_h) {
-    if (kind == 'f') {
-        if (item_size == 4) {
-            CONVERT_AND_RETURN_F(float);
+std::vector<ptrdiff_t> ScratchPad::_outputShape(const RenderFormat &format, int batch) {
+    // (height, width, channels) or (channels, height, width), prefixed by batch size if batch >= 0
+    std::vector<ptrdiff_t> shape;
+    if (batch >= 0)
+        shape.push_back(batch);
+    if (format.layout == LAYOUT_HWC)
+        shape.insert(shape.end(), {format.height, format.width, channel_num(format.channels)});
+    else
+        shape.insert(shape.end(), {channel_num(format.channels), format.height, format.width});
+    return shape;
+}
+
+std::vector<int> ScratchPad::_allTiles() {
+    std::vector<int> tiles;
+    for (int i = 0; i < _tileNum(); i++)
+        tiles.push_back(i);
+    return tiles;
+}
+
+RenderTarget ScratchPad::_denseTarget(void *data, int item_size, OutputChannels channels,
+                                      const PixelTransform &transform, OutputEncoding encoding) {
+    const int channel_size = channel_num(channels) * item_size;
+    return RenderTarget{data, (ptrdiff_t) _width * channel_size, channel_size, item_size,
+                        _width, _height, FILTER_BOX, channels, transform, encoding};
+}
+
+void* ScratchPad::_allocOutput(int item_size) {
+    void* result = malloc((size_t) item_size * _width * _height * 4);
+    if (result == NULL)
+        throw std::bad_alloc();
+    return result;
+}
+
+int ScratchPad::_tileNum() {
+    return CEIL(_width, MYPAINT_TILE_SIZE) * CEIL(_height, MYPAINT_TILE_SIZE);
+}
+
+void ScratchPad::_markDirty(int layer, const MyPaintRectangle &roi) {
+    // roi is the bounding box of all dabs, it may exceed the pad
+    int x0 = std::max(roi.x, 0), x1 = std::min(roi.x + roi.width, _width);
+    int y0 = std::max(roi.y, 0), y1 = std::min(roi.y + roi.height, _height);
+    if (x0 >= x1 or y0 >= y1)
+        return;
+
+    const int tile_size = MYPAINT_TILE_SIZE;
+    const int tile_cols = CEIL(_width, tile_size);
+    auto &revision = _tile_revision[layer];
+    auto &state = _tile_state[layer];
+    _revision++;
+    for (int ty = y0 / tile_size; ty <= (y1 - 1) / tile_size; ty++) {
+        for (int tx = x0 / tile_size; tx <= (x1 - 1) / tile_size; tx++) {
+            revision[ty * tile_cols + tx] = _revision;
+            state[ty * tile_cols + tx] = TILE_UNKNOWN;
         }
-        else if (item_size == 8) {
-            CONVERT_AND_RETURN_F(double);
+    }
+}
+
+void ScratchPad::_invalidateCache() {
+    // keeps the memory, all tiles will be rendered again
+    for (auto &item: _render_cache)
+        std::fill(item.second.tile_revision.begin(), item.second.tile_revision.end(), UINT64_MAX);
+}
+
+MyPaintFixedTiledSurface *ScratchPad::_newSurface() {
+    MyPaintFixedTiledSurface *layer = mypaint_fixed_tiled_surface_new(_width, _height);
+    if (layer == NULL)
+        throw std::bad_alloc();
+    return layer;
+}
+
+std::shared_ptr<const PadTemplate> ScratchPad::_makeTemplate(const std::vector<int> &layers) {
+    // all layers if none is given, only filled tiles are kept
+    std::vector<int> layer_ids = layers;
+    if (layer_ids.empty()) {
+        for (int l = 0; l < _layers.size(); l++)
+            layer_ids.push_back(l);
+    }
+    for (auto l: layer_ids) {
+        if (l >= _layers.size() or l < 0)
+            throw std::out_of_range(fmt::format("Invalid layer index {}", l));
+    }
+
+    auto pad_template = std::make_shared<PadTemplate>();
+    pad_template->width = _width;
+    pad_template->height = _height;
+    const int tile_stride = MYPAINT_TILE_SIZE * MYPAINT_TILE_SIZE * 4;
+    for (auto l: layer_ids) {
+        const uint16_t *buffer = _layers[l] ? surface_buffer(_layers[l]) : nullptr;
+        auto &shared = _shared_tiles[l]->tiles;
+        std::vector<std::shared_ptr<const Fix15Tile>> tiles(_tileNum());
+        for (int t_id = 0; t_id < _tileNum(); t_id++) {
+            const uint16_t *tile = shared[t_id] ? shared[t_id]->data() : buffer + (size_t) t_id * tile_stride;
+            auto &state = _tile_state[l][t_id];
+            if (state == TILE_UNKNOWN)
+                state = _isEmptyTile(tile) ? TILE_EMPTY : TILE_FILLED;
+            if (state == TILE_EMPTY)
+                continue;
+            // shared tiles are never written, they are shared with the template too
+            if (shared[t_id]) {
+                tiles[t_id] = shared[t_id];
+                continue;
+            }
+            auto tile_copy = std::make_shared<Fix15Tile>();
+            std::memcpy(tile_copy->data(), tile, sizeof(Fix15Tile));
+            tiles[t_id] = std::move(tile_copy);
         }
-        else
-            throw std::invalid_argument("Only float32 and float64 are supported in all floating types!");
+        pad_template->opacity.push_back(_layer_opacity[l]);
+        pad_template->tiles.push_back(std::move(tiles));
     }
-    else if (kind == 'B') {
-        CONVERT_AND_RETURN_I(uint8_t);
+    return pad_template;
+}
+
+void ScratchPad::_setTemplate(std::shared_ptr<const PadTemplate> pad_template) {
+    _template = std::move(pad_template);
+    _template_layer_id.clear();
+}
+
+MyPaintFixedTiledSurface *ScratchPad::_takeSpare() {
+    if (_spare_layers.empty())
+        return nullptr;
+    MyPaintFixedTiledSurface *layer = _spare_layers.back();
+    _spare_layers.pop_back();
+    return layer;
+}
+
+void ScratchPad::_detachSurface(int layer) {
+    // snapshots which still share tiles with the layer take all of them before it is changed
+    if (_snapshots->snapshots.empty())
+        return;
+    const uint16_t *buffer = _layers[layer] ? surface_buffer(_layers[layer]) : nullptr;
+    for (int t_id = 0; t_id < _tileNum(); t_id++)
+        _saveTile(layer, t_id, buffer);
+}
+
+void ScratchPad::_releaseSurface(int layer) {
+    _detachSurface(layer);
+    if (_layers[layer])
+        mypaint_surface_unref(mypaint_fixed_tiled_surface_interface(_layers[layer]));
+    _layers[layer] = nullptr;
+}
+
+void ScratchPad::_recycleSurface(int layer) {
+    // surfaces which don't hold all tiles of their layer are not cleared everywhere,
+    // surfaces still referenced by a view must keep their pixels
+    if (not _layers[layer] or _shared_tiles[layer]->num > 0 or
+        mypaint_fixed_tiled_surface_interface(_layers[layer])->refcount > 1) {
+        _releaseSurface(layer);
+        return;
     }
-    else if (kind == 'i') {
-        if (item_size == 2) {
-            CONVERT_AND_RETURN_I(int16_t);
+    _detachSurface(layer);
+    _clearLayer(layer);
+    _spare_layers.push_back(_layers[layer]);
+    _layers[layer] = nullptr;
+}
+
+void ScratchPad::_releaseSpares() {
+    for (auto layer: _spare_layers)
+        mypaint_surface_unref(mypaint_fixed_tiled_surface_interface(layer));
+    _spare_layers.clear();
+}
+
+void ScratchPad::_clearLayer(int layer) {
+    // tiles known to be empty are not touched, all tiles are known to be empty afterwards,
+    // shared tiles are replaced by the empty tile
+    const int tile_stride = MYPAINT_TILE_SIZE * MYPAINT_TILE_SIZE * 4;
+    uint16_t *buffer = _layers[layer] ? surface_buffer(_layers[layer]) : nullptr;
+    auto &shared = _shared_tiles[layer]->tiles;
+    auto &revision = _tile_revision[layer];
+    auto &state = _tile_state[layer];
+    _revision++;
+    for (int t_id = 0; t_id < _tileNum(); t_id++) {
+        if (shared[t_id]) {
+            if (state[t_id] != TILE_EMPTY)
+                revision[t_id] = _revision;
+            shared[t_id] = empty_snapshot_tile();
+        } else {
+            uint16_t *tile = buffer + (size_t) t_id * tile_stride;
+            if (state[t_id] == TILE_FILLED or (state[t_id] == TILE_UNKNOWN and not _isEmptyTile(tile))) {
+                std::memset(tile, 0, sizeof(Fix15Tile));
+                revision[t_id] = _revision;
+            }
+        }
+        state[t_id] = TILE_EMPTY;
+    }
+}
+
+MyPaintSurface *ScratchPad::_drawSurface(int layer) {
+    // the surface brushes draw on, its tile requests go to the surface of the layer
+    if (not _draw_surface) {
+        _draw_surface = new LayerSurface();
+        mypaint_tiled_surface_init(&_draw_surface->parent, layer_tile_request_start, layer_tile_request_end);
+        // requests of different tiles only change their own tile
+        _draw_surface->parent.threadsafe_tile_requests = TRUE;
+    }
+    _draw_surface->layer = _layers[layer];
+    _draw_surface->registry = _snapshots.get();
+    _draw_surface->shared = _shared_tiles[layer].get();
+    _draw_surface->layer_id = _layer_id[layer];
+    _draw_surface->tile_cols = CEIL(_width, MYPAINT_TILE_SIZE);
+    _draw_surface->tile_rows = CEIL(_height, MYPAINT_TILE_SIZE);
+    return (MyPaintSurface *) _draw_surface;
+}
+
+void ScratchPad::_pruneSnapshots() {
+    // draws only look through the snapshots which are still alive
+    auto &snapshots = _snapshots->snapshots;
+    snapshots.erase(std::remove_if(snapshots.begin(), snapshots.end(),
+                                   [](const std::weak_ptr<PadSnapshot> &item) { return item.expired(); }),
+                    snapshots.end());
+}
+
+void ScratchPad::_ownSurface(int layer) {
+    // a layer whose tiles are all shared gets a surface before it is written, its content
+    // doesn't matter as the draw surface copies each tile in when it is first requested
+    if (_layers[layer])
+        return;
+    MyPaintFixedTiledSurface *spare = _takeSpare();
+    _layers[layer] = spare ? spare : _newSurface();
+}
+
+void ScratchPad::_holdTiles(int layer) {
+    // copies the tiles the layer still shares into its surface
+    _ownSurface(layer);
+    auto &shared = *_shared_tiles[layer];
+    if (shared.num == 0)
+        return;
+    const int tile_stride = MYPAINT_TILE_SIZE * MYPAINT_TILE_SIZE * 4;
+    uint16_t *buffer = surface_buffer(_layers[layer]);
+    for (int t_id = 0; t_id < _tileNum(); t_id++) {
+        if (not shared.tiles[t_id])
+            continue;
+        std::memcpy(buffer + (size_t) t_id * tile_stride, shared.tiles[t_id]->data(), sizeof(Fix15Tile));
+        shared.tiles[t_id] = nullptr;
+    }
+    shared.num = 0;
+}
+
+void ScratchPad::_freezeLayers() {
+    // the surfaces are no longer written, their tiles are shared until each layer gets a new
+    // surface when it is written again, snapshots still find the same tiles in the layers
+    const int tile_stride = MYPAINT_TILE_SIZE * MYPAINT_TILE_SIZE * 4;
+    for (int l = 0; l < _layers.size(); l++) {
+        if (not _layers[l])
+            continue;
+        const uint16_t *buffer = surface_buffer(_layers[l]);
+        std::shared_ptr<MyPaintFixedTiledSurface> frozen(_layers[l], [](MyPaintFixedTiledSurface *surface) {
+            mypaint_surface_unref(mypaint_fixed_tiled_surface_interface(surface));
+        });
+        _layers[l] = nullptr;
+        auto &shared = *_shared_tiles[l];
+        for (int t_id = 0; t_id < _tileNum(); t_id++) {
+            if (shared.tiles[t_id])
+                continue;
+            if (_tile_state[l][t_id] == TILE_EMPTY)
+                shared.tiles[t_id] = empty_snapshot_tile();
+            else
+                shared.tiles[t_id] = std::shared_ptr<const Fix15Tile>(
+                        frozen, reinterpret_cast<const Fix15Tile *>(buffer + (size_t) t_id * tile_stride));
         }
-        else if (item_size == 4) {
-            CONVERT_AND_RETURN_I(int32_t);
+        shared.num = _tileNum();
+    }
+}
+
+void ScratchPad::_saveTile(int layer, int t_id, const uint16_t *buffer) {
+    // snapshots which still share the tile take it before it is written over,
+    // a shared tile is given to them as is
+    if (_snapshots->snapshots.empty())
+        return;
+    auto &shared = _shared_tiles[layer]->tiles[t_id];
+    const uint16_t *tile = shared ? shared->data()
+                                  : buffer + (size_t) t_id * MYPAINT_TILE_SIZE * MYPAINT_TILE_SIZE * 4;
+    const uint8_t state = _tile_state[layer][t_id];
+    if (state == TILE_EMPTY or (state == TILE_UNKNOWN and _isEmptyTile(tile)))
+        save_snapshot_tile(*_snapshots, _layer_id[layer], t_id, empty_tile);
+    else
+        save_snapshot_tile(*_snapshots, _layer_id[layer], t_id, tile, shared);
+}
+
+void ScratchPad::_setTile(int layer, int t_id, uint16_t *buffer, const std::shared_ptr<const Fix15Tile> &tile) {
+    // a layer with a surface gets a copy of the tile, a layer without shares it, nullptr is an empty tile
+    auto &shared = *_shared_tiles[layer];
+    if (not buffer) {
+        shared.tiles[t_id] = tile ? tile : empty_snapshot_tile();
+        return;
+    }
+    uint16_t *dst = buffer + (size_t) t_id * MYPAINT_TILE_SIZE * MYPAINT_TILE_SIZE * 4;
+    if (tile)
+        std::memcpy(dst, tile->data(), sizeof(Fix15Tile));
+    else
+        std::memset(dst, 0, sizeof(Fix15Tile));
+    if (shared.tiles[t_id]) {
+        shared.tiles[t_id] = nullptr;
+        shared.num--;
+    }
+}
+
+MyPaintBrush *ScratchPad::_cloneBrush(MyPaintBrush *brush, const std::string &brush_string) {
+    // base values hold the last applied setting, states hold the stroke in progress
+    MyPaintBrush *clone = mypaint_brush_new();
+    if (clone == NULL)
+        throw std::bad_alloc();
+    mypaint_brush_from_string(clone, brush_string.c_str());
+    for (int i = 0; i < MYPAINT_BRUSH_SETTINGS_COUNT; i++)
+        mypaint_brush_set_base_value(clone, (MyPaintBrushSetting) i,
+                                     mypaint_brush_get_base_value(brush, (MyPaintBrushSetting) i));
+    for (int i = 0; i < MYPAINT_BRUSH_STATES_COUNT; i++)
+        mypaint_brush_set_state(clone, (MyPaintBrushState) i, mypaint_brush_get_state(brush, (MyPaintBrushState) i));
+    return clone;
+}
+
+PointArray ScratchPad::_pointView(const std::vector<Point> &points) {
+    static_assert(sizeof(Point) == 6 * sizeof(float), "Point must be 6 packed floats!");
+    static const Point none;
+    PointArray view;
+    const float *base = points.empty() ? &none.x : &points[0].x;
+    for (int f = 0; f < 6; f++) {
+        view.data[f] = base + f;
+        view.stride[f] = 6;
+    }
+    view.size = points.size();
+    return view;
+}
+
+PointArray ScratchPad::_checkPoints(const py::object &points, std::vector<py::array> &buffers) {
+    // points are an (N, 6) array, or a dict of N sized arrays keyed by field names,
+    // where x and y are required and other fields default to the values of Point(),
+    // converted arrays are kept in buffers, the view is valid as long as they are
+    using float_array = py::array_t<float, py::array::c_style | py::array::forcecast>;
+    static const char *const fields[6] = {"x", "y", "xtilt", "ytilt", "pressure", "dtime"};
+    static const Point defaults;
+
+    PointArray view;
+    if (py::isinstance<py::dict>(points)) {
+        auto dict = py::reinterpret_borrow<py::dict>(points);
+        for (auto item: dict) {
+            auto key = py::cast<std::string>(item.first);
+            if (std::find(fields, fields + 6, key) == fields + 6)
+                throw std::invalid_argument(fmt::format("Unknown point field {}, must be one of {}!",
+                                                        key, fmt::join(fields, fields + 6, ", ")));
         }
-        else if (item_size == 8) {
-            CONVERT_AND_RETURN_I(int64_t);
+        if (not dict.contains("x") or not dict.contains("y"))
+            throw std::invalid_argument("Point fields x and y are required!");
+
+        view.size = 0;
+        for (int f = 0; f < 6; f++) {
+            if (not dict.contains(fields[f])) {
+                // the same default value for all points
+                view.data[f] = &defaults.x + f;
+                view.stride[f] = 0;
+                continue;
+            }
+            auto array = float_array::ensure(dict[fields[f]]);
+            if (not array or array.ndim() != 1)
+                throw std::invalid_argument(fmt::format("Point field {} must be a 1 dimensional float array!",
+                                                        fields[f]));
+            if (f > 0 and (size_t) array.shape(0) != view.size)
+                throw std::invalid_argument("All point fields must be of the same size!");
+            view.size = array.shape(0);
+            view.data[f] = array.data();
+            view.stride[f] = 1;
+            buffers.push_back(array);
         }
-        else
-            throw std::invalid_argument("Only int16, int32, int64, uint8, uint16, uint32, uint64 are supported "
-                                        "in all integral types!");
+        return view;
     }
-    else if (kind == 'u') {
-        if (item_size == 1) {
-            CONVERT_AND_RETURN_I(uint8_t);
+
+    auto array = float_array::ensure(points);
+    if (not array or array.ndim() != 2 or array.shape(1) != 6)
+        throw std::invalid_argument("Points must be an (N, 6) float array or a dict of arrays!");
+    for (int f = 0; f < 6; f++) {
+        view.data[f] = array.data() + f;
+        view.stride[f] = 6;
+    }
+    view.size = array.shape(0);
+    buffers.push_back(array);
+    return view;
+}
+
+LayerImage ScratchPad::_checkImage(const py::object &image, py::array &buffer) {
+    // uint8 and uint16 images are kept as they are, floating images are converted to float32,
+    // the converted array is kept in buffer, the view is valid as long as it is
+    auto array = py::array::ensure(image);
+    if (not array or array.ndim() != 3 or (array.shape(2) != 3 and array.shape(2) != 4))
+        throw std::invalid_argument("Image must be an (H, W, 3) or (H, W, 4) array!");
+    const char kind = array.dtype().kind();
+    const int item_size = array.dtype().itemsize();
+    if (kind == 'f')
+        buffer = py::array_t<float, py::array::c_style | py::array::forcecast>::ensure(array);
+    else if (kind == 'u' and item_size == 1)
+        buffer = py::array_t<uint8_t, py::array::c_style | py::array::forcecast>::ensure(array);
+    else if (kind == 'u' and item_size == 2)
+        buffer = py::array_t<uint16_t, py::array::c_style | py::array::forcecast>::ensure(array);
+    else
+        throw std::invalid_argument("Only uint8, uint16 and floating types are supported for images!");
+    return LayerImage{buffer.data(), kind, (int) buffer.itemsize(),
+                      (int) buffer.shape(1), (int) buffer.shape(0), (int) buffer.shape(2)};
+}
+
+bool ScratchPad::_isValidPoints(const PointArray &points) {
+    // checked field by field without early exits, so that the loops are vectorized,
+    // packed (N, 6) points are checked as a single flat array
+    bool packed = true;
+    for (int f = 0; f < 6; f++)
+        packed = packed and points.data[f] == points.data[0] + f and points.stride[f] == 6;
+
+    const int field_num = packed ? 1 : 6;
+    bool valid = true;
+    for (int f = 0; f < field_num; f++) {
+        const float *values = points.data[f];
+        const ptrdiff_t stride = packed ? 1 : points.stride[f];
+        const size_t size = packed ? points.size * 6 : points.size;
+        bool field_valid = true;
+        if (stride == 1) {
+            for (size_t i = 0; i < size; i++)
+                field_valid &= IN_RANGE(values[i], 0.0f, 1.0f);
         }
-        else if (item_size == 2) {
-            CONVERT_AND_RETURN_I(uint16_t);
+        else {
+            for (size_t i = 0; i < size; i++)
+                field_valid &= IN_RANGE(values[i * stride], 0.0f, 1.0f);
         }
-        else if (item_size == 4) {
-            CONVERT_AND_RETURN_I(uint32_t);
+        valid &= field_valid;
+    }
+    return valid;
+}
+
+std::vector<Stroke> ScratchPad::_checkStrokes(const std::vector<int> &layer,
+                                              const std::vector<int> &brush,
+                                              const py::object &setting,
+                                              const py::object &points,
+                                              const py::object &offsets,
+                                              std::vector<py::array> &buffers) {
+    // setting is an (M, 6) array, stroke i is points[offsets[i]:offsets[i + 1]]
+    // of the (N, 6) array, or of the dict of arrays
+    if (layer.size() != brush.size())
+        throw std::invalid_argument("Size of layer ids and brush ids doesn't match!");
+    const size_t stroke_num = layer.size();
+
+    auto setting_arr = py::array_t<float, py::array::c_style | py::array::forcecast>::ensure(setting);
+    if (not setting_arr or setting_arr.ndim() != 2 or setting_arr.shape(1) != 6 or setting_arr.shape(0) != stroke_num)
+        throw std::invalid_argument(fmt::format("Settings must be a ({}, 6) float array!", stroke_num));
+    auto offset_arr = py::array_t<int64_t, py::array::c_style | py::array::forcecast>::ensure(offsets);
+    if (not offset_arr or offset_arr.ndim() != 1 or offset_arr.shape(0) != stroke_num + 1)
+        throw std::invalid_argument(fmt::format("Offsets must be a ({},) integer array!", stroke_num + 1));
+
+    auto view = _checkPoints(points, buffers);
+    std::vector<Stroke> strokes;
+    const float *s = setting_arr.data();
+    const int64_t *o = offset_arr.data();
+    for (size_t i = 0; i < stroke_num; i++) {
+        if (o[i] < 0 or o[i] > o[i + 1] or o[i + 1] > (int64_t) view.size)
+            throw std::invalid_argument(fmt::format("Offsets must be ascending and within [0, {}]!", view.size));
+        strokes.push_back(Stroke{layer[i], brush[i],
+                                 Setting(s[i * 6], s[i * 6 + 1], s[i * 6 + 2], s[i * 6 + 3], s[i * 6 + 4], s[i * 6 + 5]),
+                                 view.slice(o[i], o[i + 1])});
+    }
+    return strokes;
+}
+
+void ScratchPad::_checkStroke(const Stroke &stroke) {
+    if (stroke.layer >= _layers.size() or stroke.layer < 0)
+        throw std::out_of_range(fmt::format("Invalid layer index {}", stroke.layer));
+    if (stroke.brush >= _brushes.size() or stroke.brush < 0)
+        throw std::out_of_range(fmt::format("Invalid brush index {}", stroke.brush));
+    auto &setting = stroke.setting;
+    if (not (IN_RANGE(setting.opacity, 0, 1)
+             and IN_RANGE(setting.radius, 0, 1)
+             and IN_RANGE(setting.hardness, 0, 1)
+             and IN_RANGE(setting.color_h, 0, 1)
+             and IN_RANGE(setting.color_s, 0, 1)
+             and IN_RANGE(setting.color_v, 0, 1)))
+        throw std::invalid_argument("Invalid setting value, all point values must be in range of 0.0 to 1.0!");
+    if (not _isValidPoints(stroke.points))
+        throw std::invalid_argument("Invalid point value, all point values must be in range of 0.0 to 1.0!");
+}
+
+void ScratchPad::_applySetting(MyPaintBrush *brush, const Setting &setting) {
+    // opacity is in [0, 2.0]
+    mypaint_brush_set_base_value(brush, MYPAINT_BRUSH_SETTING_OPAQUE, setting.opacity * 2.0);
+    // radius is in [-2.0, 6.0]
+    mypaint_brush_set_base_value(brush, MYPAINT_BRUSH_SETTING_RADIUS_LOGARITHMIC, setting.radius * 8.0 - 2.0);
+    // hardness is in [0.0, 1.0]
+    mypaint_brush_set_base_value(brush, MYPAINT_BRUSH_SETTING_HARDNESS, setting.hardness);
+    // hue is in [0.0, 1.0]
+    mypaint_brush_set_base_value(brush, MYPAINT_BRUSH_SETTING_COLOR_H, setting.color_h);
+    // saturation is in [-0.5, 1.5]
+    mypaint_brush_set_base_value(brush, MYPAINT_BRUSH_SETTING_COLOR_S, setting.color_s * 2.0 - 0.5);
+    // value is in [-0.5, 1.5]
+    mypaint_brush_set_base_value(brush, MYPAINT_BRUSH_SETTING_COLOR_V, setting.color_v * 2.0 - 0.5);
+}
+
+RenderCache &ScratchPad::_updateCache(char kind, int item_size, const RenderTarget &target) {
+    auto &cache = _findCache(kind, item_size, target);
+    std::vector<uint64_t> revision;
+    auto tiles = _staleTiles(cache, revision);
+    if (tiles.empty())
+        return cache;
+
+    std::vector<int> layers;
+    for (int i = 0; i < _layers.size(); i++)
+        layers.push_back(i);
+    try {
+        _render(layers, kind, item_size,
+                _denseTarget(cache.data.data(), item_size, target.channels, target.transform, target.encoding),
+                tiles);
+    }
+    catch (...) {
+        _render_cache.erase(std::make_tuple(kind, item_size, target.channels, target.encoding));
+        throw;
+    }
+    for (auto t_id: tiles)
+        cache.tile_revision[t_id] = revision[t_id];
+    return cache;
+}
+
+RenderCache &ScratchPad::_findCache(char kind, int item_size, const RenderTarget &target) {
+    const int tile_num = _tileNum();
+    const auto channels = target.channels;
+    const auto &transform = target.transform;
+    auto key = std::make_tuple(kind, item_size, channels, target.encoding);
+    auto it = _render_cache.find(key);
+    if (it == _render_cache.end()) {
+        it = _render_cache.emplace(key, RenderCache()).first;
+        it->second.data.resize((size_t) item_size * _width * _height * channel_num(channels));
+        it->second.tile_revision.assign(tile_num, UINT64_MAX);
+    }
+    auto &cache = it->second;
+    // only the last transform is kept, all tiles are stale if it changes
+    if (not (cache.transform == transform)) {
+        cache.transform = transform;
+        cache.tile_revision.assign(tile_num, UINT64_MAX);
+    }
+    return cache;
+}
+
+std::vector<int> ScratchPad::_staleTiles(const RenderCache &cache, std::vector<uint64_t> &revision) {
+    // a composited tile is as new as its newest layer
+    const int tile_num = _tileNum();
+    std::vector<int> tiles;
+    revision.assign(tile_num, 0);
+    for (int t_id = 0; t_id < tile_num; t_id++) {
+        for (auto &layer_revision: _tile_revision)
+            revision[t_id] = std::max(revision[t_id], layer_revision[t_id]);
+        if (revision[t_id] != cache.tile_revision[t_id])
+            tiles.push_back(t_id);
+    }
+    return tiles;
+}
+
+void ScratchPad::_copyCache(const RenderCache &cache, int item_size, const RenderTarget &target) {
+    #pragma omp parallel for
+    for (int row = 0; row < _height; row++)
+        _copyCacheRect(cache, item_size, target, row, row + 1, 0, _width);
+}
+
+void ScratchPad::_copyCacheRect(const RenderCache &cache, int item_size, const RenderTarget &target,
+                                int row_begin, int row_end, int col_begin, int col_end) {
+    const int channel_num = ::channel_num(target.channels);
+    const size_t row_size = (size_t) _width * channel_num * item_size;
+    const int pixel_size = channel_num * item_size;
+    const bool packed = target.pixel_stride == pixel_size and target.channel_stride == item_size;
+
+    for (int row = row_begin; row < row_end; row++) {
+        const char *in = cache.data.data() + row * row_size + (size_t) col_begin * pixel_size;
+        char *out = static_cast<char *>(target.data) + row * target.row_stride + col_begin * target.pixel_stride;
+        if (packed) {
+            memcpy(out, in, (size_t) (col_end - col_begin) * pixel_size);
         }
-        else if (item_size == 8) {
-            CONVERT_AND_RETURN_I(uint64_t);
+        else {
+            for (int col = 0; col < col_end - col_begin; col++)
+                for (int c = 0; c < channel_num; c++)
+                    memcpy(out + col * target.pixel_stride + c * target.channel_stride,
+                           in + (col * channel_num + c) * item_size, item_size);
         }
+    }
+}
+
+void ScratchPad::_beginPass(RenderPass &pass, int layer, char kind, int item_size, const RenderTarget &target) {
+    // renders all layers if layer < 0, like render, otherwise a single layer like renderLayer
+    if (layer < 0 and _layers.empty())
+        throw std::out_of_range("Layers are empty!");
+    if (layer >= (int) _layers.size())
+        throw std::out_of_range(fmt::format("Invalid layer index {}", layer));
+
+    pass.layer_ids.clear();
+    for (int i = 0; i < _layers.size(); i++)
+        if (layer < 0 or i == layer)
+            pass.layer_ids.push_back(i);
+    pass.kind = kind;
+    pass.item_size = item_size;
+    pass.resample = target.width != _width or target.height != _height;
+    pass.tile_cols = CEIL(_width, MYPAINT_TILE_SIZE);
+    pass.target = pass.output = target;
+    pass.cache = nullptr;
+    pass.tiles = _allTiles();
+
+    // full size renders of all layers are cached
+    if (layer < 0 and not pass.resample) {
+        pass.cache = &_findCache(kind, item_size, target);
+        pass.target = _denseTarget(pass.cache->data.data(), item_size,
+                                   target.channels, target.transform, target.encoding);
+        pass.stale.assign(pass.tiles.size(), 0);
+        for (auto t_id: _staleTiles(*pass.cache, pass.revision))
+            pass.stale[t_id] = 1;
+    }
+    _startRequests(pass.layer_ids, pass.requests, pass.layers, pass.opacity, pass.tile_state);
+    // bands of resampled ranges read tiles of other ranges, which are checked at once
+    if (pass.resample)
+        _checkTiles(pass.layer_ids, pass.layers, pass.tiles.data(), pass.tiles.size());
+}
+
+void ScratchPad::_renderPass(RenderPass &pass, size_t begin, size_t end) {
+    // renders tiles [begin, end) of the pass, ranges must not overlap
+    ScratchBuffer<int> tiles(end - begin);
+    size_t tile_num = 0;
+    for (size_t i = begin; i < end; i++)
+        if (pass.cache == nullptr or pass.stale[pass.tiles[i]])
+            tiles[tile_num++] = pass.tiles[i];
+
+    if (tile_num > 0) {
+        if (not pass.resample)
+            _checkTiles(pass.layer_ids, pass.layers, tiles.data(), tile_num);
+        _convertFix15(pass.layers, pass.opacity, pass.tile_state, pass.kind, pass.item_size, pass.target,
+                      tiles.data(), tile_num);
+    }
+    if (pass.cache == nullptr)
+        return;
+
+    const int tile_size = MYPAINT_TILE_SIZE;
+    const int tile_cols = CEIL(_width, tile_size);
+    for (size_t i = begin; i < end; i++) {
+        const int t_id = pass.tiles[i];
+        int g_row = (t_id / tile_cols) * tile_size;
+        int g_col = (t_id % tile_cols) * tile_size;
+        _copyCacheRect(*pass.cache, pass.item_size, pass.output,
+                       g_row, std::min(g_row + tile_size, _height),
+                       g_col, std::min(g_col + tile_size, _width));
+    }
+}
+
+void ScratchPad::_endPass(RenderPass &pass, bool rendered) {
+    // the cache of a pass which is not fully rendered is dropped
+    _endRequests(pass.layer_ids, pass.requests);
+    if (pass.cache == nullptr)
+        return;
+    if (not rendered) {
+        _render_cache.erase(std::make_tuple(pass.kind, pass.item_size, pass.output.channels, pass.output.encoding));
+    }
+    else {
+        for (auto t_id: pass.tiles)
+            if (pass.stale[t_id])
+                pass.cache->tile_revision[t_id] = pass.revision[t_id];
+    }
+    pass.cache = nullptr;
+}
+
+void ScratchPad::_render(const std::vector<int> &layer_ids, char kind, int item_size,
+                         const RenderTarget &target, const std::vector<int> &tiles) {
+    // Note: we are not initializing the request for each tile in the surface
+    // because in a fixed tiled surface
+    // there is only one chunk of linear memory, with:
+    // width aligned to CEIL_DIV(width, TILE_WIDTH) * TILE_WIDTH
+    // height aligned to CEIL_DIV(height, TILE_HEIGHT) * TILE_HEIGHT
+    // we just need this request to get the pointer to internal linear memory
+
+    // Note: the linear memory is tile by tile, and not row by row! The compositor
+    // walks it tile by tile and writes each tile to its row-major destination.
+    std::vector<MyPaintTileRequest> requests;
+    std::vector<LayerTiles> layers;
+    std::vector<uint32_t> opacity;
+    std::vector<const uint8_t *> tile_state;
+    _startRequests(layer_ids, requests, layers, opacity, tile_state);
+
+    try {
+        _checkTiles(layer_ids, layers, tiles.data(), tiles.size());
+        _convertFix15(layers, opacity, tile_state, kind, item_size, target, tiles.data(), tiles.size());
+    }
+    catch (...) {
+        _endRequests(layer_ids, requests);
+        throw;
+    }
+    _endRequests(layer_ids, requests);
+}
+
+void ScratchPad::_startRequests(const std::vector<int> &layer_ids,
+                                std::vector<MyPaintTileRequest> &requests,
+                                std::vector<LayerTiles> &layers,
+                                std::vector<uint32_t> &opacity,
+                                std::vector<const uint8_t *> &tile_state) {
+    requests.resize(layer_ids.size());
+    layers.clear();
+    opacity.clear();
+    tile_state.clear();
+    for (size_t i = 0; i < layer_ids.size(); i++) {
+        // request to operate on mipmap_level=0, tile with x=0, ty=0,
+        // layers without a surface read all their tiles from the shared ones
+        mypaint_tile_request_init(&requests[i], 0, 0, 0, TRUE);
+        if (_layers[layer_ids[i]])
+            mypaint_tiled_surface_tile_request_start((MyPaintTiledSurface *) _layers[layer_ids[i]], &requests[i]);
+        layers.push_back(LayerTiles{requests[i].buffer, _shared_tiles[layer_ids[i]]->tiles.data()});
+        opacity.push_back(lroundf(_layer_opacity[layer_ids[i]] * (1u << 15u)));
+        tile_state.push_back(_tile_state[layer_ids[i]].data());
+    }
+}
+
+void ScratchPad::_endRequests(const std::vector<int> &layer_ids, std::vector<MyPaintTileRequest> &requests) {
+    for (size_t i = 0; i < layer_ids.size(); i++) {
+        if (_layers[layer_ids[i]])
+            mypaint_tiled_surface_tile_request_end((MyPaintTiledSurface *) _layers[layer_ids[i]], &requests[i]);
+    }
+}
+
+void ScratchPad::_checkTiles(const std::vector<int> &layer_ids,
+                             const std::vector<LayerTiles> &layers,
+                             const int *tiles, size_t tile_num) {
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < tile_num; i++) {
+        const int t_id = tiles[i];
+        for (size_t l = 0; l < layer_ids.size(); l++) {
+            auto &state = _tile_state[layer_ids[l]][t_id];
+            if (state == TILE_UNKNOWN)
+                state = _isEmptyTile(layers[l].tile(t_id)) ? TILE_EMPTY : TILE_FILLED;
+        }
+    }
+}
+
+bool ScratchPad::_isEmptyTile(const uint16_t *tile) {
+    // checked row by row, so that filled tiles usually return early
+    const int row_size = MYPAINT_TILE_SIZE * 4;
+    for (int row = 0; row < MYPAINT_TILE_SIZE; row++) {
+        uint16_t bits = 0;
+        for (int i = 0; i < row_size; i++)
+            bits |= tile[row * row_size + i];
+        if (bits != 0)
+            return false;
+    }
+    return true;
+}
+
+void ScratchPad::_convertFix15(const std::vector<LayerTiles> &layers,
+                              const std::vector<uint32_t> &opacity,
+                              const std::vector<const uint8_t *> &tile_state,
+                              char kind, int item_size,
+                              const RenderTarget &target,
+                              const int *tiles, size_t tile_num) {
+    if (target.encoding == ENCODING_BFLOAT16) {
+        if (kind != 'u' or item_size != 2)
+            throw std::invalid_argument("bfloat16 is rendered as its raw bits, output array must be of uint16!");
+        _convertAs<BFloat16>(layers, opacity, tile_state, target, tiles, tile_num);
+    }
+    else if (target.encoding == ENCODING_FULL_RANGE) {
+        if (kind == 'B' or (kind == 'u' and item_size == 1))
+            _convertAs<FullRange<uint8_t>>(layers, opacity, tile_state, target, tiles, tile_num);
+        else if (kind == 'u' and item_size == 2)
+            _convertAs<FullRange<uint16_t>>(layers, opacity, tile_state, target, tiles, tile_num);
+        else if (kind == 'u' and item_size == 4)
+            _convertAs<FullRange<uint32_t>>(layers, opacity, tile_state, target, tiles, tile_num);
+        else if (kind == 'u' and item_size == 8)
+            _convertAs<FullRange<uint64_t>>(layers, opacity, tile_state, target, tiles, tile_num);
+        else if (kind == 'i' and item_size == 2)
+            _convertAs<FullRange<int16_t>>(layers, opacity, tile_state, target, tiles, tile_num);
+        else if (kind == 'i' and item_size == 4)
+            _convertAs<FullRange<int32_t>>(layers, opacity, tile_state, target, tiles, tile_num);
+        else if (kind == 'i' and item_size == 8)
+            _convertAs<FullRange<int64_t>>(layers, opacity, tile_state, target, tiles, tile_num);
+        else
+            throw std::invalid_argument("Only int16, int32, int64, uint8, uint16, uint32, uint64 are supported "
+                                        "in full range encoding!");
+    }
+    else if (kind == 'f') {
+        if (item_size == 2)
+            _convertAs<Float16>(layers, opacity, tile_state, target, tiles, tile_num);
+        else if (item_size == 4)
+            _convertAs<float>(layers, opacity, tile_state, target, tiles, tile_num);
+        else if (item_size == 8)
+            _convertAs<double>(layers, opacity, tile_state, target, tiles, tile_num);
+        else
+            throw std::invalid_argument("Only float16, float32 and float64 are supported in all floating types!");
+    }
+    else if (kind == 'B') {
+        _convertAs<uint8_t>(layers, opacity, tile_state, target, tiles, tile_num);
+    }
+    else if (kind == 'i') {
+        if (item_size == 2)
+            _convertAs<int16_t>(layers, opacity, tile_state, target, tiles, tile_num);
+        else if (item_size == 4)
+            _convertAs<int32_t>(layers, opacity, tile_state, target, tiles, tile_num);
+        else if (item_size == 8)
+            _convertAs<int64_t>(layers, opacity, tile_state, target, tiles, tile_num);
+        else
+            throw std::invalid_argument("Only int16, int32, int64, uint8, uint16, uint32, uint64 are supported "
+                                        "in all integral types!");
+    }
+    else if (kind == 'u') {
+        if (item_size == 1)
+            _convertAs<uint8_t>(layers, opacity, tile_state, target, tiles, tile_num);
+        else if (item_size == 2)
+            _convertAs<uint16_t>(layers, opacity, tile_state, target, tiles, tile_num);
+        else if (item_size == 4)
+            _convertAs<uint32_t>(layers, opacity, tile_state, target, tiles, tile_num);
+        else if (item_size == 8)
+            _convertAs<uint64_t>(layers, opacity, tile_state, target, tiles, tile_num);
         else
             throw std::invalid_argument("Only int16, int32, int64, uint8, uint16, uint32, uint64 are supported "
                                         "in all integral types!");
@@ -350,110 +1740,388 @@ void* ScratchPad::_convertFix15(const uint16_t *in_layer, char kind, int item_si
 }
 
 template<typename T>
-void ScratchPad::_reformat(T *in_layer, T *out_layer, int r_w, int r_h, int tile_size) {
-    int stride = tile_size * tile_size * 4;
-    int total_size = r_w * r_h * 4;
-    int tile_cols = r_w / tile_size;
+void ScratchPad::_convertAs(const std::vector<LayerTiles> &layers,
+                           const std::vector<uint32_t> &opacity,
+                           const std::vector<const uint8_t *> &tile_state,
+                           const RenderTarget &target,
+                           const int *tiles, size_t tile_num) {
+    // every (dtype, channels) pair gets its own kernels, nothing is decided per pixel
+    switch (target.channels) {
+        case CHANNELS_RGBA:
+            _composite<T, CHANNELS_RGBA>(layers, opacity, tile_state, target, tiles, tile_num);
+            break;
+        case CHANNELS_RGB:
+            _composite<T, CHANNELS_RGB>(layers, opacity, tile_state, target, tiles, tile_num);
+            break;
+        case CHANNELS_A:
+            _composite<T, CHANNELS_A>(layers, opacity, tile_state, target, tiles, tile_num);
+            break;
+        case CHANNELS_L:
+            _composite<T, CHANNELS_L>(layers, opacity, tile_state, target, tiles, tile_num);
+            break;
+    }
+}
+
+const uint16_t *ScratchPad::_compositeTile(const std::vector<LayerTiles> &layers,
+                                           const std::vector<uint32_t> &opacity,
+                                           const std::vector<const uint8_t *> &tile_state,
+                                           int t_id, int row_begin, int row_end,
+                                           uint16_t *blended) {
+    // Blends rows [row_begin, row_end) of tile t_id of all layers, returns the composited
+    // tile, which is either a layer or blended, or nullptr if all layers are empty.
+    // Note: opacity of layer 0 is not used, as it is at the bottom
+    const int tile_size = MYPAINT_TILE_SIZE;
+    const int row_offset = row_begin * tile_size * 4;
+    const int pixel_num = (row_end - row_begin) * tile_size;
+    auto &kernels = fix15_kernels();
+
+    const uint16_t *tile = nullptr;
+    if (tile_state[0][t_id] != TILE_EMPTY)
+        tile = layers[0].tile(t_id);
+
+    // Note: empty layers are skipped since blending them over anything with
+    // alpha <= 1.0 changes nothing
+    for (size_t l = 1; l < layers.size(); l++) {
+        if (tile_state[l][t_id] == TILE_EMPTY)
+            continue;
+        kernels.blend(layers[l].tile(t_id) + row_offset,
+                      (tile == nullptr ? empty_tile : tile) + row_offset,
+                      blended + row_offset, opacity[l], pixel_num);
+        tile = blended;
+    }
+    return tile;
+}
+
+template<typename T, OutputChannels CH>
+void ScratchPad::_composite(const std::vector<LayerTiles> &layers,
+                            const std::vector<uint32_t> &opacity,
+                            const std::vector<const uint8_t *> &tile_state,
+                            const RenderTarget &target,
+                            const int *tiles, size_t tile_num) {
+    if (target.width != _width or target.height != _height) {
+        _resample<T, CH>(layers, opacity, tile_state, target, tiles, tile_num);
+        return;
+    }
+
+    // Blend all layers of one tile while it is still in cache, then un-premultiply,
+    // convert and store it directly to its place in the output.
+    const int tile_size = MYPAINT_TILE_SIZE;
+    const int tile_cols = CEIL(_width, tile_size);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < tile_num; i++) {
+        const int t_id = tiles[i];
+        alignas(64) uint16_t blended[tile_size * tile_size * 4];
 
-    #pragma omp parallel for
-    for(int offset = 0; offset < total_size; offset += stride) {
-        int t_id = offset / stride;
         int g_row = (t_id / tile_cols) * tile_size;
         int g_col = (t_id % tile_cols) * tile_size;
+        int rows = std::min(tile_size, _height - g_row);
+        int cols = std::min(tile_size, _width - g_col);
+
+        // the tile is nullptr if all layers are empty
+        const uint16_t *tile = _compositeTile(layers, opacity, tile_state, t_id, 0, rows, blended);
 
-        for(int t_row=0; t_row < tile_size; t_row++) {
-            int in_offset = offset + t_row * tile_size * 4;
-            int out_offset = (r_w * (g_row + t_row) + g_col) * 4;
-            memcpy(out_layer + out_offset, in_layer + in_offset, tile_size * sizeof(T) * 4);
+        for (int t_row = 0; t_row < rows; t_row++) {
+            char *out = static_cast<char *>(target.data)
+                        + (g_row + t_row) * target.row_stride
+                        + g_col * target.pixel_stride;
+            _storeRow<T, CH>(tile == nullptr ? nullptr : tile + t_row * tile_size * 4, cols, out, target);
         }
     }
 }
 
-template<typename T, std::enable_if_t<std::is_floating_point<T>::value, int>>
+template<typename T, OutputChannels CH>
+void ScratchPad::_resample(const std::vector<LayerTiles> &layers,
+                           const std::vector<uint32_t> &opacity,
+                           const std::vector<const uint8_t *> &tile_state,
+                           const RenderTarget &target,
+                           const int *tiles, size_t tile_num) {
+    // Premultiplied pixels are averaged while walking the composited tiles, the
+    // averages are rounded to fix15 and converted like full size pixels.
+    // Output rows are split to bands by the tile row their footprint begins in,
+    // each band owns its rows and only composites the source rows it needs.
+    // Only the bands which begin in the tile rows of the given tiles are rendered,
+    // their footprint may read tiles of the rows below, which must be checked.
+    const int tile_size = MYPAINT_TILE_SIZE;
+    const int tile_cols = CEIL(_width, tile_size);
+    const int tile_rows = CEIL(_height, tile_size);
+    const int out_w = target.width, out_h = target.height;
+    auto x_axis = resample_axis(_width, out_w, target.filter);
+    auto y_axis = resample_axis(_height, out_h, target.filter);
 
-void ScratchPad::_convertFix15ToFloat(const uint16_t *in_layer, T *out_layer, int pixel_num) {
-    // pixel_num = w * h
-    uint32_t r, g, b, a;
+    // Note: scratch memory comes from the arena of each thread, it is reused by the
+    // following renders instead of being allocated and page faulted again
 
-    int max = pixel_num * 4;
-    #pragma omp parallel for
-    for (int offset = 0; offset < max; offset += 4) {
-        r = in_layer[offset];
-        g = in_layer[offset + 1];
-        b = in_layer[offset + 2];
-        a = in_layer[offset + 3];
-
-        // un-premultiply alpha (with rounding)
-        if (a != 0) {
-            r = ((r << 15u) + a / 2) / a;
-            g = ((g << 15u) + a / 2) / a;
-            b = ((b << 15u) + a / 2) / a;
-        } else {
-            r = g = b = 0;
+    // destination columns covered by each tile column
+    ScratchBuffer<int> col_begin(tile_cols), col_end(tile_cols);
+    std::fill(col_begin.data(), col_begin.data() + tile_cols, out_w);
+    std::fill(col_end.data(), col_end.data() + tile_cols, 0);
+    for (int ox = 0; ox < out_w; ox++) {
+        for (int tx = x_axis.begin[ox] / tile_size;
+             tx <= (x_axis.begin[ox] + x_axis.size[ox] - 1) / tile_size; tx++) {
+            col_begin[tx] = std::min(col_begin[tx], ox);
+            col_end[tx] = std::max(col_end[tx], ox + 1);
+        }
+    }
+
+    ScratchBuffer<uint8_t> selected(tile_rows);
+    std::fill(selected.data(), selected.data() + tile_rows, 0);
+    for (size_t i = 0; i < tile_num; i++)
+        selected[tiles[i] / tile_cols] = 1;
+
+    ScratchBuffer<int> bands(out_h + 1);
+    int band_num = 0;
+    bands[0] = 0;
+    for (int oy = 1; oy < out_h; oy++)
+        if (y_axis.begin[oy] / tile_size != y_axis.begin[oy - 1] / tile_size)
+            bands[++band_num] = oy;
+    bands[++band_num] = out_h;
+
+    // bands whose first row begins in a selected tile row
+    ScratchBuffer<int> kept(band_num);
+    int kept_num = 0;
+    for (int band = 0; band < band_num; band++)
+        if (selected[y_axis.begin[bands[band]] / tile_size])
+            kept[kept_num++] = band;
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int k = 0; k < kept_num; k++) {
+        alignas(64) uint16_t blended[tile_size * tile_size * 4];
+        const int oy_begin = bands[kept[k]], oy_end = bands[kept[k] + 1];
+        int y_begin = y_axis.begin[oy_begin], y_end = 0;
+        for (int oy = oy_begin; oy < oy_end; oy++)
+            y_end = std::max(y_end, y_axis.begin[oy] + y_axis.size[oy]);
+
+        ScratchBuffer<float> acc((size_t) (oy_end - oy_begin) * out_w * 4);
+        std::fill(acc.data(), acc.data() + acc.size(), 0.0f);
+        ScratchBuffer<int> weight_row(oy_end - oy_begin);
+        ScratchBuffer<float> weight(oy_end - oy_begin);
+
+        for (int ty = y_begin / tile_size; ty <= (y_end - 1) / tile_size; ty++) {
+            int row_begin = std::max(y_begin - ty * tile_size, 0);
+            int row_end = std::min(y_end - ty * tile_size, tile_size);
+            for (int tx = 0; tx < tile_cols; tx++) {
+                const int t_id = ty * tile_cols + tx;
+                const uint16_t *tile = _compositeTile(layers, opacity, tile_state, t_id, row_begin, row_end, blended);
+                // transparent tiles add nothing
+                if (tile == nullptr)
+                    continue;
+
+                for (int t_row = row_begin; t_row < row_end; t_row++) {
+                    const int y = ty * tile_size + t_row;
+                    const uint16_t *src = tile + t_row * tile_size * 4;
+                    int weight_num = 0;
+                    for (int oy = oy_begin; oy < oy_end; oy++) {
+                        int k = y - y_axis.begin[oy];
+                        if (k >= 0 and k < y_axis.size[oy]) {
+                            weight_row[weight_num] = oy - oy_begin;
+                            weight[weight_num++] = y_axis.weights[(size_t) oy * y_axis.support + k];
+                        }
+                    }
+                    if (weight_num == 0)
+                        continue;
+
+                    for (int ox = col_begin[tx]; ox < col_end[tx]; ox++) {
+                        int x_begin = std::max(x_axis.begin[ox], tx * tile_size);
+                        int x_end = std::min(x_axis.begin[ox] + x_axis.size[ox], tx * tile_size + tile_size);
+                        const float *w = &x_axis.weights[(size_t) ox * x_axis.support];
+                        float sum[4] = {0, 0, 0, 0};
+                        for (int x = x_begin; x < x_end; x++)
+                            for (int c = 0; c < 4; c++)
+                                sum[c] += w[x - x_axis.begin[ox]] * src[(x - tx * tile_size) * 4 + c];
+                        for (int r = 0; r < weight_num; r++)
+                            for (int c = 0; c < 4; c++)
+                                acc[((size_t) weight_row[r] * out_w + ox) * 4 + c] += weight[r] * sum[c];
+                    }
+                }
+            }
         }
 
-        // convert to destination floating point format, in range [0, 1]
-        out_layer[offset] = r / T(1u << 15u);
-        out_layer[offset + 1] = g / T(1u << 15u);
-        out_layer[offset + 2] = b / T(1u << 15u);
+        ScratchBuffer<uint16_t> pixels((size_t) out_w * 4);
+        for (int oy = oy_begin; oy < oy_end; oy++) {
+            const float *in = &acc[(size_t) (oy - oy_begin) * out_w * 4];
+            for (int i = 0; i < out_w * 4; i += 4) {
+                // colors can't exceed alpha in premultiplied pixels
+                long a = std::min(std::max(lroundf(in[i + 3]), 0l), 65535l);
+                for (int c = 0; c < 3; c++)
+                    pixels[i + c] = std::min(std::max(lroundf(in[i + c]), 0l), a);
+                pixels[i + 3] = a;
+            }
 
-        // alpha needs to be divided by 2
-        out_layer[offset + 3] = a / T(1u << 16u);
+            _storeRow<T, CH>(pixels.data(), out_w, static_cast<char *>(target.data) + oy * target.row_stride, target);
+        }
     }
 }
 
-template<typename T, std::enable_if_t<std::is_integral<T>::value, int>>
+template<typename T, OutputChannels CH>
+void ScratchPad::_storeRow(const uint16_t *in, int pixel_num, char *out, const RenderTarget &target) {
+    // Converts a row of composited pixels, or a transparent row if in is nullptr,
+    // and stores the selected channels with the strides of the target.
+    // The background and normalization are applied on the way, by chunks in cache.
+    using C = typename ComputeType<T>::type;
+    constexpr int channel_num = ::channel_num(CH);
+    const bool interleaved = target.pixel_stride == channel_num * sizeof(T) and target.channel_stride == sizeof(T);
+    const bool planar = target.pixel_stride == sizeof(T);
+    const auto &transform = target.transform;
 
-void ScratchPad::_convertFix15ToInt(const uint16_t *in_layer, T *out_layer, int pixel_num) {
-    // pixel_num = w * h
-    uint32_t r, g, b, a;
+    if (CH == CHANNELS_RGBA and interleaved and not transform.background and not transform.normalize) {
+        // transparent pixels are zeros in all dtypes
+        if (in == nullptr)
+            memset(out, 0, pixel_num * 4 * sizeof(T));
+        else
+            _convertFix15ToPacked<T>(in, reinterpret_cast<T *>(out), pixel_num);
+        return;
+    }
 
-    int max = pixel_num * 4;
-    #pragma omp parallel for private(r, g, b, a)
-    for (int offset = 0; offset < max; offset += 4) {
-        r = in_layer[offset];
-        g = in_layer[offset + 1];
-        b = in_layer[offset + 2];
-        a = in_layer[offset + 3];
+    // value * scale + offset of each output channel, identity if not normalized
+    C scale[channel_num], offset[channel_num];
+    for (int c = 0; c < channel_num; c++) {
+        scale[c] = transform.normalize ? C(transform.scale[c]) : C(1);
+        offset[c] = transform.normalize ? C(transform.offset[c]) : C(0);
+    }
 
-        // un-premultiply alpha (with rounding)
-        if (a != 0) {
-            r = ((r << 15u) + a / 2) / a;
-            g = ((g << 15u) + a / 2) / a;
-            b = ((b << 15u) + a / 2) / a;
-        } else {
-            r = g = b = 0;
+    alignas(64) uint16_t composited[MYPAINT_TILE_SIZE * 4];
+    alignas(64) C pixels[MYPAINT_TILE_SIZE * 4];
+    for (int begin = 0; begin < pixel_num; begin += MYPAINT_TILE_SIZE) {
+        const int num = std::min(MYPAINT_TILE_SIZE, pixel_num - begin);
+        const uint16_t *chunk = in == nullptr ? nullptr : in + begin * 4;
+        if (transform.background) {
+            _compositeOver(chunk, composited, num, transform.background_color);
+            chunk = composited;
         }
 
-        // convert to destination integer format, in range [0, 255], with rounding
-        out_layer[offset] = (r * 255 + (1u << 14u)) / (1u << 15u);
-        out_layer[offset + 1] = (g * 255 + (1u << 14u)) / (1u << 15u);
-        out_layer[offset + 2] = (b * 255 + (1u << 14u)) / (1u << 15u);
+        // luminance is the only value of a pixel, others keep the RGBA order
+        const int in_channels = CH == CHANNELS_L ? 1 : 4;
+        if (chunk == nullptr)
+            std::fill(pixels, pixels + num * in_channels, C(0));
+        else if (CH == CHANNELS_L)
+            _convertFix15ToLuminance<T>(chunk, pixels, num);
+        else
+            _convertFix15To<T>(chunk, pixels, num);
 
-        // alpha needs to be divided by 2
-        out_layer[offset + 3] = (a * 255 + (1u << 14u)) / (1u << 16u);
+        for (int c = 0; c < channel_num; c++) {
+            const int source = CH == CHANNELS_A ? 3 : c;
+            const C s = scale[c], o = offset[c];
+            char *dst = out + begin * target.pixel_stride + c * target.channel_stride;
+            if (interleaved) {
+                T *dst_t = reinterpret_cast<T *>(dst);
+                for (int i = 0; i < num; i++)
+                    dst_t[i * channel_num] = Fix15Output<T>::store(pixels[i * in_channels + source] * s + o);
+            }
+            else if (planar) {
+                T *dst_t = reinterpret_cast<T *>(dst);
+                for (int i = 0; i < num; i++)
+                    dst_t[i] = Fix15Output<T>::store(pixels[i * in_channels + source] * s + o);
+            }
+            else {
+                for (int i = 0; i < num; i++)
+                    *reinterpret_cast<T *>(dst + i * target.pixel_stride) =
+                            Fix15Output<T>::store(pixels[i * in_channels + source] * s + o);
+            }
+        }
     }
 }
 
-void ScratchPad::_blend(uint16_t *layer_a, uint16_t *layer_b, uint16_t *out_layer,
-                        float layer_a_opacity, int pixel_num) {
-    // layer a is over layer b
-    // see https://en.wikipedia.org/wiki/Alpha_compositing
+void ScratchPad::_compositeOver(const uint16_t *in, uint16_t *out, int pixel_num, const uint16_t *color) {
+    // Blends premultiplied pixels over an opaque color, the result is opaque,
+    // in is nullptr for transparent pixels.
+    const uint32_t one = 1u << 15u;
+    for (int i = 0; i < pixel_num * 4; i += 4) {
+        uint32_t alpha = in == nullptr ? 0 : in[i + 3];
+        for (int c = 0; c < 3; c++)
+            out[i + c] = (in == nullptr ? 0 : in[i + c]) + ((color[c] * (one - alpha) + (one >> 1u)) >> 15u);
+        out[i + 3] = one;
+    }
+}
 
-    int max = pixel_num * 4;
-    fix15_t a_opac = lroundf(layer_a_opacity * (1u << 15u));
+template<typename T>
+void ScratchPad::_convertToFix15(const T *in, int channels, uint16_t *out, int pixel_num) {
+    // straight RGB pixels are widened to opaque RGBA by chunks, then premultiplied
+    auto &kernels = fix15_kernels();
+    const T opaque = std::is_floating_point<T>::value ? T(1) : std::numeric_limits<T>::max();
+    T rgba[MYPAINT_TILE_SIZE * 4];
+    for (int begin = 0; begin < pixel_num; begin += MYPAINT_TILE_SIZE) {
+        int num = std::min(MYPAINT_TILE_SIZE, pixel_num - begin);
+        const T *src = in + begin * channels;
+        if (channels == 3) {
+            for (int i = 0; i < num; i++) {
+                rgba[i * 4] = src[i * 3];
+                rgba[i * 4 + 1] = src[i * 3 + 1];
+                rgba[i * 4 + 2] = src[i * 3 + 2];
+                rgba[i * 4 + 3] = opaque;
+            }
+            src = rgba;
+        }
+        if (std::is_same<T, float>::value)
+            kernels.fromFloat32(reinterpret_cast<const float *>(src), out + begin * 4, num);
+        else if (std::is_same<T, uint16_t>::value)
+            kernels.fromUint16(reinterpret_cast<const uint16_t *>(src), out + begin * 4, num);
+        else
+            kernels.fromUint8(reinterpret_cast<const uint8_t *>(src), out + begin * 4, num);
+    }
+}
 
-    #pragma omp parallel for
-    for (int i = 0; i < max; i += 4) {
-        const fix15_t a_pix_opac = fix15_mul(layer_a[i + 3], a_opac);
-        const fix15_t minus_opac = fix15_one - a_pix_opac;
+template<typename T>
+void ScratchPad::_convertFix15To(const uint16_t *in_layer, typename ComputeType<T>::type *out_layer, int pixel_num) {
+    using C = typename ComputeType<T>::type;
+    auto &kernels = fix15_kernels();
+    if (std::is_same<C, float>::value) {
+        kernels.toFloat32(in_layer, reinterpret_cast<float *>(out_layer), pixel_num);
+        return;
+    }
+    if (std::is_same<T, uint8_t>::value) {
+        kernels.toUint8(in_layer, reinterpret_cast<uint8_t *>(out_layer), pixel_num);
+        return;
+    }
+    if (std::is_same<T, FullRange<uint16_t>>::value) {
+        kernels.toUint16(in_layer, reinterpret_cast<uint16_t *>(out_layer), pixel_num);
+        return;
+    }
+
+    // un-premultiply alpha (with rounding) by chunks
+    uint32_t straight[MYPAINT_TILE_SIZE * 4];
+    for (int begin = 0; begin < pixel_num; begin += MYPAINT_TILE_SIZE) {
+        int num = std::min(MYPAINT_TILE_SIZE, pixel_num - begin);
+        kernels.unpremultiply(in_layer + begin * 4, straight, num);
 
-        // Note: color channels are pre-multiplied with alpha!
-        // Note: the value of all channels are within range [0, 1], in fixed point
-        out_layer[i + 0] = fix15_sumprods(layer_a[i], a_opac, layer_b[i], minus_opac);
-        out_layer[i + 1] = fix15_sumprods(layer_a[i + 1], a_opac, layer_b[i + 1], minus_opac);
-        out_layer[i + 2] = fix15_sumprods(layer_a[i + 2], a_opac, layer_b[i + 2], minus_opac);
-        out_layer[i + 3] = fix15_short_clamp(a_pix_opac + fix15_mul(layer_b[i + 3], minus_opac));
+        C *out = out_layer + begin * 4;
+        for (int offset = 0; offset < num * 4; offset += 4) {
+            out[offset] = Fix15Output<T>::color(straight[offset]);
+            out[offset + 1] = Fix15Output<T>::color(straight[offset + 1]);
+            out[offset + 2] = Fix15Output<T>::color(straight[offset + 2]);
+            out[offset + 3] = Fix15Output<T>::alpha(straight[offset + 3]);
+        }
     }
 }
 
+template<typename T>
+void ScratchPad::_convertFix15ToPacked(const uint16_t *in_layer, T *out_layer, int pixel_num) {
+    // half precision floats are converted from fix15 directly, others are stored as computed
+    auto &kernels = fix15_kernels();
+    if (std::is_same<T, Float16>::value)
+        kernels.toFloat16(in_layer, reinterpret_cast<uint16_t *>(out_layer), pixel_num);
+    else if (std::is_same<T, BFloat16>::value)
+        kernels.toBFloat16(in_layer, reinterpret_cast<uint16_t *>(out_layer), pixel_num);
+    else
+        _convertFix15To<T>(in_layer, reinterpret_cast<typename ComputeType<T>::type *>(out_layer), pixel_num);
+}
+
+template<typename T>
+void ScratchPad::_convertFix15ToLuminance(const uint16_t *in_layer, typename ComputeType<T>::type *out_layer,
+                                          int pixel_num) {
+    // Rec. 601 luma of the un-premultiplied colors, in 16 bit fixed point,
+    // scaled to the destination format like any color channel
+    using C = typename ComputeType<T>::type;
+    auto &kernels = fix15_kernels();
+    uint32_t straight[MYPAINT_TILE_SIZE * 4];
+    for (int begin = 0; begin < pixel_num; begin += MYPAINT_TILE_SIZE) {
+        int num = std::min(MYPAINT_TILE_SIZE, pixel_num - begin);
+        kernels.unpremultiply(in_layer + begin * 4, straight, num);
+
+        C *out = out_layer + begin;
+        for (int i = 0; i < num; i++) {
+            const uint32_t *px = straight + i * 4;
+            out[i] = Fix15Output<T>::color((19595u * px[0] + 38470u * px[1] + 7471u * px[2] + (1u << 15u)) >> 16u);
+        }
+    }
+}
@@ -2,8 +2,14 @@
 #define SCRATCHPAD_H
 
 #include <tuple>
+#include <array>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+#include <map>
 #include <vector>
 #include <mutex>
+#include <atomic>
 #include <type_traits>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
@@ -46,6 +52,264 @@ struct Point {
             pressure(pressure), dtime(dtime) {}
 };
 
+struct PointArray {
+    // a read only view of points, field f of point i is data[f][i * stride[f]],
+    // fields are in the order of x, y, xtilt, ytilt, pressure, dtime
+    const float *data[6];
+    ptrdiff_t stride[6];
+    size_t size;
+
+    PointArray slice(size_t begin, size_t end) const {
+        PointArray result = *this;
+        for (int f = 0; f < 6; f++)
+            result.data[f] += begin * stride[f];
+        result.size = end - begin;
+        return result;
+    }
+};
+
+bool operator==(const Setting &a, const Setting &b);
+
+struct Stroke {
+    // points drawn with a brush of a setting on a layer
+    int layer;
+    int brush;
+    Setting setting;
+    PointArray points;
+};
+
+enum ResampleFilter : uint8_t {
+    // average of the covered area
+    FILTER_BOX = 0,
+    // triangle filter, widened to the covered area when downsampling
+    FILTER_BILINEAR
+};
+
+enum OutputLayout : uint8_t {
+    LAYOUT_HWC = 0,
+    LAYOUT_CHW
+};
+
+enum OutputChannels : uint8_t {
+    CHANNELS_RGBA = 0,
+    CHANNELS_RGB,
+    CHANNELS_A,
+    // luminance of the un-premultiplied colors
+    CHANNELS_L
+};
+
+enum OutputEncoding : uint8_t {
+    // floats in range [0, 1], integers in range [0, 255]
+    ENCODING_DEFAULT = 0,
+    // raw bfloat16 bits in uint16 outputs
+    ENCODING_BFLOAT16,
+    // integers in range [0, max of the type]
+    ENCODING_FULL_RANGE
+};
+
+constexpr int channel_num(OutputChannels channels) {
+    return channels == CHANNELS_RGBA ? 4 : channels == CHANNELS_RGB ? 3 : 1;
+}
+
+struct PixelTransform {
+    // applied to each pixel while converting it, before channels are selected
+    // composite over an opaque background color, in fix15
+    bool background;
+    uint16_t background_color[3];
+    // applied to each output channel after conversion, value * scale + offset
+    bool normalize;
+    float scale[4];
+    float offset[4];
+};
+
+bool operator==(const PixelTransform &a, const PixelTransform &b);
+
+struct RenderFormat {
+    // output options of a render, as passed from python
+    int width;
+    int height;
+    ResampleFilter filter;
+    OutputLayout layout;
+    OutputChannels channels;
+    PixelTransform transform;
+    OutputEncoding encoding;
+};
+
+struct RenderTarget {
+    // destination of a render, strides are in bytes and
+    // correspond to the (height, width, channel) axes
+    void *data;
+    ptrdiff_t row_stride;
+    ptrdiff_t pixel_stride;
+    ptrdiff_t channel_stride;
+    // size of the destination, the pad is resampled with filter if it differs
+    int width;
+    int height;
+    ResampleFilter filter;
+    OutputChannels channels;
+    PixelTransform transform;
+    OutputEncoding encoding;
+};
+
+struct Float16 {
+    // IEEE half, as in numpy float16 arrays
+    uint16_t bits;
+};
+
+struct BFloat16 {
+    // upper half of a float32
+    uint16_t bits;
+};
+
+template<typename I>
+struct FullRange {
+    // integer scaled to its full range
+    I value;
+};
+
+template<typename T>
+struct ComputeType {
+    // type the values of an output type are computed in
+    using type = T;
+};
+
+template<>
+struct ComputeType<Float16> {
+    using type = float;
+};
+
+template<>
+struct ComputeType<BFloat16> {
+    using type = float;
+};
+
+template<typename I>
+struct ComputeType<FullRange<I>> {
+    using type = I;
+};
+
+struct LayerImage {
+    // a read only c-contiguous (height, width, channels) image of straight colors,
+    // channels are RGB or RGBA, of uint8 (kind 'u', item size 1), uint16 or float32
+    const void *data;
+    char kind;
+    int item_size;
+    int width;
+    int height;
+    int channels;
+};
+
+enum TileState : uint8_t {
+    // tile has been touched since it was last checked
+    TILE_UNKNOWN = 0,
+    // all channels of all pixels are zero
+    TILE_EMPTY,
+    TILE_FILLED
+};
+
+struct RenderCache {
+    // converted output of all layers, row-major (height, width, channels)
+    std::vector<char> data;
+    // transform the output was rendered with
+    PixelTransform transform;
+    // revision of each tile when it was last rendered into data
+    std::vector<uint64_t> tile_revision;
+};
+
+using Fix15Tile = std::array<uint16_t, MYPAINT_TILE_SIZE * MYPAINT_TILE_SIZE * 4>;
+
+struct LayerTiles {
+    // tiles of a layer in a render, a tile is read from the shared tiles
+    // of the layer unless it is nullptr there, then from the surface buffer
+    const uint16_t *buffer;
+    const std::shared_ptr<const Fix15Tile> *shared;
+
+    const uint16_t *tile(int t_id) const {
+        return shared[t_id] ? shared[t_id]->data()
+                            : buffer + (size_t) t_id * MYPAINT_TILE_SIZE * MYPAINT_TILE_SIZE * 4;
+    }
+};
+
+struct RenderPass {
+    // A render split to ranges of its tiles, which may be rendered by different
+    // threads in any order. Resampled passes are split to whole tile rows, each range
+    // renders the output rows whose footprint begins in its tile rows.
+    std::vector<int> layer_ids;
+    std::vector<MyPaintTileRequest> requests;
+    std::vector<LayerTiles> layers;
+    std::vector<uint32_t> opacity;
+    std::vector<const uint8_t *> tile_state;
+    char kind = 0;
+    int item_size = 0;
+    bool resample = false;
+    int tile_cols = 0;
+    // tiles are converted into target, cached passes then copy them to output
+    RenderTarget target, output;
+    RenderCache *cache = nullptr;
+    std::vector<int> tiles;
+    // cached passes only, revision of each tile and whether it must be rendered again
+    std::vector<uint64_t> revision;
+    std::vector<uint8_t> stale;
+};
+
+struct SharedTiles {
+    // tiles a layer shares with forks, snapshots or templates instead of holding them
+    // in its surface, nullptr where the surface holds the tile. A layer whose
+    // tiles are all shared has no surface until it is written, then each tile is copied
+    // into the surface the first time it is requested.
+    std::vector<std::shared_ptr<const Fix15Tile>> tiles;
+    // number of tiles which are not nullptr
+    std::atomic<int> num{0};
+};
+
+struct LayerSnapshot {
+    // a tile is nullptr while the layer still holds it, it is copied
+    // here before a draw or restore first writes over it
+    uint64_t layer_id;
+    float opacity;
+    std::vector<std::shared_ptr<const Fix15Tile>> tiles;
+    std::vector<uint8_t> tile_state;
+};
+
+struct SnapshotRegistry;
+
+struct PadSnapshot {
+    // state of a pad which shares its tiles with the pad copy-on-write
+    std::shared_ptr<SnapshotRegistry> registry;
+    int width;
+    int height;
+    std::vector<LayerSnapshot> layers;
+    std::vector<std::vector<float>> brush_states;
+};
+
+struct PadTemplate {
+    // canvas pads are reset to, tiles are nullptr where empty,
+    // it is never changed and shared by all pads it is set on
+    int width;
+    int height;
+    std::vector<float> opacity;
+    std::vector<std::vector<std::shared_ptr<const Fix15Tile>>> tiles;
+};
+
+struct SnapshotRegistry {
+    // snapshots of a pad, which must be given the tiles it is about to write
+    std::vector<std::weak_ptr<PadSnapshot>> snapshots;
+};
+
+struct LayerSurface {
+    // Tiled surface which the brushes of a pad draw on, its tile requests go to the
+    // surface of the layer being drawn. Shared tiles are copied into that surface the
+    // first time they are requested, and tiles are saved to the snapshots before a
+    // draw writes over them, so that the surfaces of the layers are never patched.
+    MyPaintTiledSurface parent;
+    MyPaintFixedTiledSurface *layer;
+    SnapshotRegistry *registry;
+    SharedTiles *shared;
+    uint64_t layer_id;
+    int tile_cols;
+    int tile_rows;
+};
+
 class BatchedScratchPad;
 
 class ScratchPad {
@@ -65,6 +329,20 @@ public:
 
     void setOpacity(int layer, float opacity);
 
+    void setLayer(int layer, const py::object &image);
+
+    void setLayer(int layer, const LayerImage &image);
+
+    std::shared_ptr<PadSnapshot> snapshot();
+
+    void restore(PadSnapshot &snapshot);
+
+    std::vector<ScratchPad> fork(int n);
+
+    void setTemplate(const std::vector<int> &layers = {});
+
+    void resetFromTemplate();
+
     int getBrushNum();
 
     int getLayerNum();
@@ -74,35 +352,270 @@ public:
     void draw(int layer, int brush, const Setting &setting,
               const std::vector<Point> &points);
 
-    py::array renderLayer(int layer, const py::object &dtype);
+    void drawArray(int layer, int brush, const Setting &setting,
+                   const py::object &points);
+
+    void draw(int layer, int brush, const Setting &setting,
+              const PointArray &points);
+
+    void drawStrokes(const std::vector<std::tuple<int, int, Setting, std::vector<Point>>> &strokes);
+
+    void drawStrokesArray(const std::vector<int> &layer,
+                          const std::vector<int> &brush,
+                          const py::object &setting,
+                          const py::object &points,
+                          const py::object &offsets);
+
+    void draw(const std::vector<Stroke> &strokes);
+
+    py::array renderLayer(int layer, const py::object &dtype,
+                          const py::object &out_size = py::none(),
+                          const std::string &filter = "box",
+                          const std::string &layout = "HWC",
+                          const std::string &channels = "RGBA",
+                          const py::object &background = py::none(),
+                          const py::object &mean = py::none(),
+                          const py::object &stddev = py::none(),
+                          const std::string &encoding = "default");
+
+    void renderLayerInto(int layer, py::array &out,
+                         const py::object &out_size = py::none(),
+                         const std::string &filter = "box",
+                         const std::string &layout = "HWC",
+                         const std::string &channels = "RGBA",
+                         const py::object &background = py::none(),
+                         const py::object &mean = py::none(),
+                         const py::object &stddev = py::none(),
+                         const std::string &encoding = "default");
 
     void* renderLayer(int layer, char kind, int item_size);
 
-    py::array render(const py::object &dtype);
+    void renderLayer(int layer, char kind, int item_size, const RenderTarget &target);
+
+    py::array render(const py::object &dtype,
+                     const py::object &out_size = py::none(),
+                     const std::string &filter = "box",
+                     const std::string &layout = "HWC",
+                     const std::string &channels = "RGBA",
+                     const py::object &background = py::none(),
+                     const py::object &mean = py::none(),
+                     const py::object &stddev = py::none(),
+                     const std::string &encoding = "default");
+
+    void renderInto(py::array &out,
+                    const py::object &out_size = py::none(),
+                    const std::string &filter = "box",
+                    const std::string &layout = "HWC",
+                    const std::string &channels = "RGBA",
+                    const py::object &background = py::none(),
+                    const py::object &mean = py::none(),
+                    const py::object &stddev = py::none(),
+                    const std::string &encoding = "default");
 
     void* render(char kind, int item_size);
 
+    py::array layerView(int layer);
+
+    py::array tileState(int layer);
+
+    void render(char kind, int item_size, const RenderTarget &target);
+
 private:
     friend class BatchedScratchPad;
 
     int _width = 0, _height = 0;
     std::vector<MyPaintBrush *> _brushes;
+    // brushes are cloned from the strings they were loaded from
+    std::vector<std::string> _brush_strings;
+    // surface of each layer, nullptr while all its tiles are shared
     std::vector<MyPaintFixedTiledSurface *> _layers;
+    std::vector<std::unique_ptr<SharedTiles>> _shared_tiles;
     std::vector<float> _layer_opacity;
+    // unique id of each layer, snapshots find the layers they share tiles with by it
+    std::vector<uint64_t> _layer_id;
+    std::shared_ptr<SnapshotRegistry> _snapshots = std::make_shared<SnapshotRegistry>();
+    // surface the brushes draw on, created by the first draw
+    LayerSurface *_draw_surface = nullptr;
+    // canvas of resetFromTemplate, the layers still hold it except for tiles drawn since
+    // _template_revision, as long as the layer ids are still _template_layer_id
+    std::shared_ptr<const PadTemplate> _template;
+    uint64_t _template_revision = 0;
+    std::vector<uint64_t> _template_layer_id;
+    // cleared surfaces of popped layers, of the pad size, reused before new ones are allocated
+    std::vector<MyPaintFixedTiledSurface *> _spare_layers;
+
+    // revision of each tile of each layer, bumped whenever a draw touches the tile
+    uint64_t _revision = 0;
+    std::vector<std::vector<uint64_t>> _tile_revision;
+
+    // occupancy of each tile of each layer, checked lazily when rendering
+    std::vector<std::vector<uint8_t>> _tile_state;
+
+    // composited and converted output of each requested (dtype kind, item size, channels, encoding)
+    std::map<std::tuple<char, int, OutputChannels, OutputEncoding>, RenderCache> _render_cache;
+
+    int _tileNum();
+
+    void _markDirty(int layer, const MyPaintRectangle &roi);
+
+    void _invalidateCache();
+
+    MyPaintFixedTiledSurface *_newSurface();
+
+    std::shared_ptr<const PadTemplate> _makeTemplate(const std::vector<int> &layers);
+
+    void _setTemplate(std::shared_ptr<const PadTemplate> pad_template);
+
+    MyPaintFixedTiledSurface *_takeSpare();
+
+    void _detachSurface(int layer);
+
+    void _releaseSurface(int layer);
+
+    void _recycleSurface(int layer);
+
+    void _releaseSpares();
+
+    void _clearLayer(int layer);
+
+    MyPaintSurface *_drawSurface(int layer);
+
+    void _pruneSnapshots();
+
+    void _ownSurface(int layer);
+
+    void _holdTiles(int layer);
+
+    void _freezeLayers();
+
+    void _saveTile(int layer, int t_id, const uint16_t *buffer);
+
+    void _setTile(int layer, int t_id, uint16_t *buffer, const std::shared_ptr<const Fix15Tile> &tile);
+
+    static MyPaintBrush *_cloneBrush(MyPaintBrush *brush, const std::string &brush_string);
+
+    static PointArray _pointView(const std::vector<Point> &points);
 
-    static void* _convertFix15(const uint16_t *in_layer, char kind, int item_size, int r_w, int r_h);
+    static PointArray _checkPoints(const py::object &points, std::vector<py::array> &buffers);
+
+    static bool _isValidPoints(const PointArray &points);
+
+    static LayerImage _checkImage(const py::object &image, py::array &buffer);
 
     template<typename T>
-    static void _reformat(T *in_layer, T *out_layer, int r_w, int r_h, int tile_size);
+    static void _convertToFix15(const T *in, int channels, uint16_t *out, int pixel_num);
+
+    static std::vector<Stroke> _checkStrokes(const std::vector<int> &layer,
+                                             const std::vector<int> &brush,
+                                             const py::object &setting,
+                                             const py::object &points,
+                                             const py::object &offsets,
+                                             std::vector<py::array> &buffers);
+
+    void _checkStroke(const Stroke &stroke);
+
+    static void _applySetting(MyPaintBrush *brush, const Setting &setting);
+
+    RenderCache &_updateCache(char kind, int item_size, const RenderTarget &target);
+
+    RenderCache &_findCache(char kind, int item_size, const RenderTarget &target);
+
+    std::vector<int> _staleTiles(const RenderCache &cache, std::vector<uint64_t> &revision);
+
+    void _copyCache(const RenderCache &cache, int item_size, const RenderTarget &target);
+
+    void _copyCacheRect(const RenderCache &cache, int item_size, const RenderTarget &target,
+                        int row_begin, int row_end, int col_begin, int col_end);
+
+    void _beginPass(RenderPass &pass, int layer, char kind, int item_size, const RenderTarget &target);
+
+    void _renderPass(RenderPass &pass, size_t begin, size_t end);
+
+    void _endPass(RenderPass &pass, bool rendered);
+
+    static RenderTarget _checkTarget(py::array &out, const RenderFormat &format, int batch = -1);
+
+    static RenderFormat _parseFormat(const py::object &out_size, const std::string &filter,
+                                     const std::string &layout, const std::string &channels,
+                                     const py::object &background, const py::object &mean,
+                                     const py::object &stddev, const std::string &encoding,
+                                     int width, int height);
+
+    static std::vector<ptrdiff_t> _outputShape(const RenderFormat &format, int batch = -1);
+
+    std::vector<int> _allTiles();
+
+    RenderTarget _denseTarget(void *data, int item_size, OutputChannels channels = CHANNELS_RGBA,
+                              const PixelTransform &transform = PixelTransform(),
+                              OutputEncoding encoding = ENCODING_DEFAULT);
 
-    template<typename T, std::enable_if_t<std::is_floating_point<T>::value, int> = 0>
-    static void _convertFix15ToFloat(const uint16_t *in_layer, T *out_layer, int pixel_num);
+    void* _allocOutput(int item_size);
 
-    template<typename T, std::enable_if_t<std::is_integral<T>::value, int> = 0>
-    static void _convertFix15ToInt(const uint16_t *in_layer, T *out_layer, int pixel_num);
+    void _render(const std::vector<int> &layer_ids, char kind, int item_size,
+                 const RenderTarget &target, const std::vector<int> &tiles);
 
-    static void _blend(uint16_t *layer_a, uint16_t *layer_b, uint16_t *out_layer,
-                       float layer_b_opacity, int pixel_num);
+    void _startRequests(const std::vector<int> &layer_ids,
+                        std::vector<MyPaintTileRequest> &requests,
+                        std::vector<LayerTiles> &layers,
+                        std::vector<uint32_t> &opacity,
+                        std::vector<const uint8_t *> &tile_state);
+
+    void _endRequests(const std::vector<int> &layer_ids, std::vector<MyPaintTileRequest> &requests);
+
+    void _checkTiles(const std::vector<int> &layer_ids,
+                     const std::vector<LayerTiles> &layers,
+                     const int *tiles, size_t tile_num);
+
+    static bool _isEmptyTile(const uint16_t *tile);
+
+    void _convertFix15(const std::vector<LayerTiles> &layers,
+                       const std::vector<uint32_t> &opacity,
+                       const std::vector<const uint8_t *> &tile_state,
+                       char kind, int item_size,
+                       const RenderTarget &target,
+                       const int *tiles, size_t tile_num);
+
+    static const uint16_t *_compositeTile(const std::vector<LayerTiles> &layers,
+                                          const std::vector<uint32_t> &opacity,
+                                          const std::vector<const uint8_t *> &tile_state,
+                                          int t_id, int row_begin, int row_end,
+                                          uint16_t *blended);
+
+    template<typename T>
+    void _convertAs(const std::vector<LayerTiles> &layers,
+                    const std::vector<uint32_t> &opacity,
+                    const std::vector<const uint8_t *> &tile_state,
+                    const RenderTarget &target,
+                    const int *tiles, size_t tile_num);
+
+    template<typename T, OutputChannels CH>
+    void _composite(const std::vector<LayerTiles> &layers,
+                    const std::vector<uint32_t> &opacity,
+                    const std::vector<const uint8_t *> &tile_state,
+                    const RenderTarget &target,
+                    const int *tiles, size_t tile_num);
+
+    template<typename T, OutputChannels CH>
+    void _resample(const std::vector<LayerTiles> &layers,
+                   const std::vector<uint32_t> &opacity,
+                   const std::vector<const uint8_t *> &tile_state,
+                   const RenderTarget &target,
+                   const int *tiles, size_t tile_num);
+
+    template<typename T, OutputChannels CH>
+    static void _storeRow(const uint16_t *in, int pixel_num, char *out, const RenderTarget &target);
+
+    static void _compositeOver(const uint16_t *in, uint16_t *out, int pixel_num, const uint16_t *color);
+
+    template<typename T>
+    static void _convertFix15To(const uint16_t *in_layer, typename ComputeType<T>::type *out_layer, int pixel_num);
+
+    template<typename T>
+    static void _convertFix15ToPacked(const uint16_t *in_layer, T *out_layer, int pixel_num);
+
+    template<typename T>
+    static void _convertFix15ToLuminance(const uint16_t *in_layer, typename ComputeType<T>::type *out_layer,
+                                         int pixel_num);
 };
 
 #endif //SCRATCHPAD_H
\ No newline at end of file
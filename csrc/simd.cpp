@@ -0,0 +1,226 @@
+#include "simd.h"
+#include "fix15.h"
+#include <fmt/format.h>
+#include <atomic>
+#include <cmath>
+#include <stdexcept>
+
+// Note: un-premultiplying needs round((c << 15) / a), which is computed as
+// floor(((c << 15) + a / 2 + 0.5) * (1 / a)) with a double precision reciprocal.
+// The numerator is below 2^31, so the relative error of the reciprocal (below 2^-47)
+// never moves the product across an integer, since the exact quotient is always
+// at least 0.5 / a away from one. The result is bit-exact with integer division.
+
+static void scalar_blend(const uint16_t *layer_a, const uint16_t *layer_b, uint16_t *out,
+                         uint32_t a_opac, int n) {
+    // layer a is over layer b
+    // see https://en.wikipedia.org/wiki/Alpha_compositing
+    int max = n * 4;
+    for (int i = 0; i < max; i += 4) {
+        const fix15_t a_pix_opac = fix15_mul(layer_a[i + 3], a_opac);
+        const fix15_t minus_opac = fix15_one - a_pix_opac;
+
+        // Note: color channels are pre-multiplied with alpha!
+        // Note: the value of all channels are within range [0, 1], in fixed point
+        out[i + 0] = fix15_sumprods(layer_a[i], a_opac, layer_b[i], minus_opac);
+        out[i + 1] = fix15_sumprods(layer_a[i + 1], a_opac, layer_b[i + 1], minus_opac);
+        out[i + 2] = fix15_sumprods(layer_a[i + 2], a_opac, layer_b[i + 2], minus_opac);
+        out[i + 3] = fix15_short_clamp(a_pix_opac + fix15_mul(layer_b[i + 3], minus_opac));
+    }
+}
+
+static void scalar_unpremultiply(const uint16_t *in, uint32_t *out, int n) {
+    int max = n * 4;
+    for (int i = 0; i < max; i += 4) {
+        uint32_t a = in[i + 3];
+        if (a != 0) {
+            double inv = 1.0 / a;
+            double half = a / 2 + 0.5;
+            out[i] = (uint32_t) (((uint32_t(in[i]) << 15u) + half) * inv);
+            out[i + 1] = (uint32_t) (((uint32_t(in[i + 1]) << 15u) + half) * inv);
+            out[i + 2] = (uint32_t) (((uint32_t(in[i + 2]) << 15u) + half) * inv);
+        } else {
+            out[i] = out[i + 1] = out[i + 2] = 0;
+        }
+        out[i + 3] = a;
+    }
+}
+
+static void scalar_to_float32(const uint16_t *in, float *out, int n) {
+    uint32_t straight[64 * 4];
+    for (int begin = 0; begin < n; begin += 64) {
+        int num = n - begin < 64 ? n - begin : 64;
+        scalar_unpremultiply(in + begin * 4, straight, num);
+        for (int i = 0; i < num * 4; i += 4) {
+            // convert to destination floating point format, in range [0, 1]
+            out[begin * 4 + i] = straight[i] / float(1u << 15u);
+            out[begin * 4 + i + 1] = straight[i + 1] / float(1u << 15u);
+            out[begin * 4 + i + 2] = straight[i + 2] / float(1u << 15u);
+
+            // alpha needs to be divided by 2
+            out[begin * 4 + i + 3] = straight[i + 3] / float(1u << 16u);
+        }
+    }
+}
+
+static void scalar_to_uint8(const uint16_t *in, uint8_t *out, int n) {
+    uint32_t straight[64 * 4];
+    for (int begin = 0; begin < n; begin += 64) {
+        int num = n - begin < 64 ? n - begin : 64;
+        scalar_unpremultiply(in + begin * 4, straight, num);
+        for (int i = 0; i < num * 4; i += 4) {
+            // convert to destination integer format, in range [0, 255], with rounding
+            out[begin * 4 + i] = (straight[i] * 255 + (1u << 14u)) / (1u << 15u);
+            out[begin * 4 + i + 1] = (straight[i + 1] * 255 + (1u << 14u)) / (1u << 15u);
+            out[begin * 4 + i + 2] = (straight[i + 2] * 255 + (1u << 14u)) / (1u << 15u);
+
+            // alpha needs to be divided by 2
+            out[begin * 4 + i + 3] = (straight[i + 3] * 255 + (1u << 14u)) / (1u << 16u);
+        }
+    }
+}
+
+static void scalar_to_uint16(const uint16_t *in, uint16_t *out, int n) {
+    uint32_t straight[64 * 4];
+    for (int begin = 0; begin < n; begin += 64) {
+        int num = n - begin < 64 ? n - begin : 64;
+        scalar_unpremultiply(in + begin * 4, straight, num);
+        for (int i = 0; i < num * 4; i += 4) {
+            // convert to destination integer format, in range [0, 65535], with rounding,
+            // alpha is scaled like colors so that opaque is 65535
+            out[begin * 4 + i] = (straight[i] * 65535 + (1u << 14u)) >> 15u;
+            out[begin * 4 + i + 1] = (straight[i + 1] * 65535 + (1u << 14u)) >> 15u;
+            out[begin * 4 + i + 2] = (straight[i + 2] * 65535 + (1u << 14u)) >> 15u;
+            out[begin * 4 + i + 3] = (straight[i + 3] * 65535 + (1u << 14u)) >> 15u;
+        }
+    }
+}
+
+static void scalar_to_float16(const uint16_t *in, uint16_t *out, int n) {
+    float values[64 * 4];
+    for (int begin = 0; begin < n; begin += 64) {
+        int num = n - begin < 64 ? n - begin : 64;
+        scalar_to_float32(in + begin * 4, values, num);
+        for (int i = 0; i < num * 4; i++)
+            out[begin * 4 + i] = float_to_float16(values[i]);
+    }
+}
+
+static void scalar_to_bfloat16(const uint16_t *in, uint16_t *out, int n) {
+    float values[64 * 4];
+    for (int begin = 0; begin < n; begin += 64) {
+        int num = n - begin < 64 ? n - begin : 64;
+        scalar_to_float32(in + begin * 4, values, num);
+        for (int i = 0; i < num * 4; i++)
+            out[begin * 4 + i] = float_to_bfloat16(values[i]);
+    }
+}
+
+static void scalar_premultiply(const uint32_t *in, uint16_t *out, int n) {
+    // in is straight fix15
+    int max = n * 4;
+    for (int i = 0; i < max; i += 4) {
+        uint32_t a = in[i + 3];
+        out[i] = (in[i] * a + (1u << 14u)) >> 15u;
+        out[i + 1] = (in[i + 1] * a + (1u << 14u)) >> 15u;
+        out[i + 2] = (in[i + 2] * a + (1u << 14u)) >> 15u;
+        out[i + 3] = a;
+    }
+}
+
+static void scalar_from_uint8(const uint8_t *in, uint16_t *out, int n) {
+    uint32_t straight[64 * 4];
+    for (int begin = 0; begin < n; begin += 64) {
+        int num = n - begin < 64 ? n - begin : 64;
+        for (int i = 0; i < num * 4; i++)
+            straight[i] = (in[begin * 4 + i] * 257u + 1) >> 1u;
+        scalar_premultiply(straight, out + begin * 4, num);
+    }
+}
+
+static void scalar_from_uint16(const uint16_t *in, uint16_t *out, int n) {
+    uint32_t straight[64 * 4];
+    for (int begin = 0; begin < n; begin += 64) {
+        int num = n - begin < 64 ? n - begin : 64;
+        for (int i = 0; i < num * 4; i++)
+            straight[i] = (in[begin * 4 + i] + 1u) >> 1u;
+        scalar_premultiply(straight, out + begin * 4, num);
+    }
+}
+
+static void scalar_from_float32(const float *in, uint16_t *out, int n) {
+    uint32_t straight[64 * 4];
+    for (int begin = 0; begin < n; begin += 64) {
+        int num = n - begin < 64 ? n - begin : 64;
+        for (int i = 0; i < num * 4; i++) {
+            // comparisons are false for nan, as max and min instructions pick the second operand
+            float v = in[begin * 4 + i];
+            v = v > 0.0f ? (v < 1.0f ? v : 1.0f) : 0.0f;
+            straight[i] = (uint32_t) lrintf(v * float(1u << 15u));
+        }
+        scalar_premultiply(straight, out + begin * 4, num);
+    }
+}
+
+const Fix15Kernels fix15_scalar_kernels = {
+        "scalar",
+        scalar_blend,
+        scalar_unpremultiply,
+        scalar_to_float32,
+        scalar_to_uint8,
+        scalar_to_uint16,
+        scalar_to_float16,
+        scalar_to_bfloat16,
+        scalar_from_uint8,
+        scalar_from_uint16,
+        scalar_from_float32
+};
+
+static std::vector<const Fix15Kernels *> supported_kernels() {
+    // ordered from the most preferred
+    std::vector<const Fix15Kernels *> kernels;
+#ifdef USE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        kernels.push_back(&fix15_avx512_kernels);
+    // all avx2 cpus have f16c in practice, but it is a separate feature
+    if (__builtin_cpu_supports("avx2") and __builtin_cpu_supports("f16c"))
+        kernels.push_back(&fix15_avx2_kernels);
+    if (__builtin_cpu_supports("sse4.1"))
+        kernels.push_back(&fix15_sse41_kernels);
+#endif
+    kernels.push_back(&fix15_scalar_kernels);
+    return kernels;
+}
+
+static std::atomic<const Fix15Kernels *> selected_kernels(nullptr);
+
+const Fix15Kernels &fix15_kernels() {
+    auto kernels = selected_kernels.load(std::memory_order_acquire);
+    if (kernels == nullptr) {
+        kernels = supported_kernels()[0];
+        selected_kernels.store(kernels, std::memory_order_release);
+    }
+    return *kernels;
+}
+
+std::vector<std::string> get_simd_isas() {
+    std::vector<std::string> isas;
+    for (auto kernels: supported_kernels())
+        isas.emplace_back(kernels->isa);
+    return isas;
+}
+
+std::string get_simd_isa() {
+    return fix15_kernels().isa;
+}
+
+void set_simd_isa(const std::string &isa) {
+    for (auto kernels: supported_kernels()) {
+        if (isa == kernels->isa) {
+            selected_kernels.store(kernels, std::memory_order_release);
+            return;
+        }
+    }
+    throw std::invalid_argument(fmt::format("Instruction set {} is not supported by this cpu!", isa));
+}
@@ -0,0 +1,98 @@
+#ifndef SCRATCHPAD_SIMD_H
+#define SCRATCHPAD_SIMD_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/**
+ * Row kernels working on premultiplied fix15 RGBA pixels, n is the number of pixels.
+ * All implementations are bit-exact with the scalar ones.
+ * Imported straight channels are first scaled to fix15 in range [0, 2^15], colors are
+ * then multiplied by alpha with rounding, an alpha of the maximum value is opaque.
+ */
+struct Fix15Kernels {
+    const char *isa;
+
+    // layer a (with opacity a_opac in fix15) is over layer b, out may be the same buffer as layer b
+    void (*blend)(const uint16_t *layer_a, const uint16_t *layer_b, uint16_t *out,
+                  uint32_t a_opac, int n);
+
+    // un-premultiply color channels (with rounding), alpha is copied
+    void (*unpremultiply)(const uint16_t *in, uint32_t *out, int n);
+
+    // un-premultiply and convert to float in range [0, 1]
+    void (*toFloat32)(const uint16_t *in, float *out, int n);
+
+    // un-premultiply and convert to integer in range [0, 255]
+    void (*toUint8)(const uint16_t *in, uint8_t *out, int n);
+
+    // un-premultiply and convert to integer in range [0, 65535], with rounding
+    void (*toUint16)(const uint16_t *in, uint16_t *out, int n);
+
+    // un-premultiply and convert to IEEE half in range [0, 1], rounded to nearest even
+    void (*toFloat16)(const uint16_t *in, uint16_t *out, int n);
+
+    // un-premultiply and convert to bfloat16 in range [0, 1], rounded to nearest even
+    void (*toBFloat16)(const uint16_t *in, uint16_t *out, int n);
+
+    // premultiply integers in range [0, 255], scaled by (v * 257 + 1) >> 1
+    void (*fromUint8)(const uint8_t *in, uint16_t *out, int n);
+
+    // premultiply integers in range [0, 65535], scaled by (v + 1) >> 1
+    void (*fromUint16)(const uint16_t *in, uint16_t *out, int n);
+
+    // premultiply floats clamped to range [0, 1] (nan is 0), scaled by 2^15 and rounded to nearest even
+    void (*fromFloat32)(const float *in, uint16_t *out, int n);
+};
+
+inline uint16_t float_to_float16(float value) {
+    // IEEE half of value, rounded to nearest even, as hardware conversions do
+    uint32_t f, sign;
+    memcpy(&f, &value, sizeof(f));
+    sign = (f >> 16u) & 0x8000u;
+    f &= 0x7FFFFFFFu;
+    if (f >= 0x47800000u)
+        // overflows to inf, or nan
+        return sign | (f > 0x7F800000u ? 0x7E00u : 0x7C00u);
+    if (f < 0x38800000u) {
+        // subnormal half, the addition rounds the mantissa to its place
+        float shifted;
+        memcpy(&shifted, &f, sizeof(f));
+        shifted += 0.5f;
+        memcpy(&f, &shifted, sizeof(f));
+        return sign | (f - 0x3F000000u);
+    }
+    // re-bias the exponent and round the mantissa
+    f += 0xC8000FFFu + ((f >> 13u) & 1u);
+    return sign | (f >> 13u);
+}
+
+inline uint16_t float_to_bfloat16(float value) {
+    // upper half of value, rounded to nearest even, value must not be nan
+    uint32_t f;
+    memcpy(&f, &value, sizeof(f));
+    return (f + 0x7FFFu + ((f >> 16u) & 1u)) >> 16u;
+}
+
+extern const Fix15Kernels fix15_scalar_kernels;
+#ifdef USE_X86_SIMD
+extern const Fix15Kernels fix15_sse41_kernels;
+extern const Fix15Kernels fix15_avx2_kernels;
+extern const Fix15Kernels fix15_avx512_kernels;
+#endif
+
+/**
+ * Kernels of the best instruction set supported by the running cpu,
+ * selected by cpuid on first use.
+ */
+const Fix15Kernels &fix15_kernels();
+
+std::vector<std::string> get_simd_isas();
+
+std::string get_simd_isa();
+
+void set_simd_isa(const std::string &isa);
+
+#endif //SCRATCHPAD_SIMD_H
@@ -0,0 +1,225 @@
+#include "simd.h"
+#include <immintrin.h>
+
+// Note: this file is compiled with -mavx2 -mf16c, it must not instantiate any inline
+// functions shared with other translation units (eg: templates from std).
+
+static inline __m256i load_px2(const uint16_t *in) {
+    // two pixels widened to [r0, g0, b0, a0, r1, g1, b1, a1]
+    return _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *) in));
+}
+
+static inline __m128i unpremultiply_half(__m128i num, __m128i a_nz, __m128 inv_f) {
+    const __m256d half = _mm256_set1_pd(0.5);
+    const __m256d two = _mm256_set1_pd(2.0);
+    // float reciprocal of alpha, refined to double precision by one newton step
+    __m256d inv = _mm256_cvtps_pd(inv_f);
+    inv = _mm256_mul_pd(inv, _mm256_sub_pd(two, _mm256_mul_pd(_mm256_cvtepi32_pd(a_nz), inv)));
+    return _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_add_pd(_mm256_cvtepi32_pd(num), half), inv));
+}
+
+static inline __m256i unpremultiply_px2(__m256i v) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi32(1);
+
+    __m256i a = _mm256_shuffle_epi32(v, 0xFF);
+    __m256i a_nz = _mm256_max_epi32(a, one);
+    __m256i num = _mm256_add_epi32(_mm256_slli_epi32(v, 15), _mm256_srli_epi32(a, 1));
+    __m256 inv_f = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_cvtepi32_ps(a_nz));
+
+    __m128i q0 = unpremultiply_half(_mm256_castsi256_si128(num),
+                                    _mm256_castsi256_si128(a_nz),
+                                    _mm256_castps256_ps128(inv_f));
+    __m128i q1 = unpremultiply_half(_mm256_extracti128_si256(num, 1),
+                                    _mm256_extracti128_si256(a_nz, 1),
+                                    _mm256_extractf128_ps(inv_f, 1));
+    __m256i q = _mm256_inserti128_si256(_mm256_castsi128_si256(q0), q1, 1);
+
+    // color of transparent pixels is 0, alpha is kept
+    q = _mm256_andnot_si256(_mm256_cmpeq_epi32(a, zero), q);
+    return _mm256_blend_epi32(q, v, 0x88);
+}
+
+static inline __m256i to_uint8_px2(__m256i q) {
+    // (c * 255 + 2^14) >> 15 for colors, (a * 255 + 2^14) >> 16 for alpha, truncated to 8 bits
+    __m256i t = _mm256_add_epi32(_mm256_mullo_epi32(q, _mm256_set1_epi32(255)), _mm256_set1_epi32(1 << 14));
+    t = _mm256_srli_epi32(t, 15);
+    t = _mm256_blend_epi32(t, _mm256_srli_epi32(t, 1), 0x88);
+    return _mm256_and_si256(t, _mm256_set1_epi32(0xFF));
+}
+
+static inline __m256i to_uint16_px2(__m256i q) {
+    // (v * 65535 + 2^14) >> 15 for colors and alpha
+    __m256i t = _mm256_add_epi32(_mm256_mullo_epi32(q, _mm256_set1_epi32(65535)), _mm256_set1_epi32(1 << 14));
+    return _mm256_srli_epi32(t, 15);
+}
+
+static inline __m256 to_float32_px2(__m256i q) {
+    // colors are divided by 2^15, alpha by 2^16
+    const __m256 scale = _mm256_setr_ps(1.0f / (1u << 15u), 1.0f / (1u << 15u),
+                                        1.0f / (1u << 15u), 1.0f / (1u << 16u),
+                                        1.0f / (1u << 15u), 1.0f / (1u << 15u),
+                                        1.0f / (1u << 15u), 1.0f / (1u << 16u));
+    return _mm256_mul_ps(_mm256_cvtepi32_ps(q), scale);
+}
+
+static inline __m256i to_bfloat16_px2(__m256 f) {
+    // rounds the upper half of the floats to nearest even
+    __m256i bits = _mm256_castps_si256(f);
+    __m256i lsb = _mm256_and_si256(_mm256_srli_epi32(bits, 16), _mm256_set1_epi32(1));
+    return _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(bits, _mm256_set1_epi32(0x7FFF)), lsb), 16);
+}
+
+static inline __m256i blend_px2(__m256i a, __m256i b, __m256i opac) {
+    const __m256i one = _mm256_set1_epi32(1 << 15);
+    __m256i a_pix_opac = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_shuffle_epi32(a, 0xFF), opac), 15);
+    __m256i minus_opac = _mm256_sub_epi32(one, a_pix_opac);
+    __m256i b_prod = _mm256_mullo_epi32(b, minus_opac);
+    __m256i color = _mm256_srli_epi32(_mm256_add_epi32(_mm256_mullo_epi32(a, opac), b_prod), 15);
+    __m256i alpha = _mm256_min_epu32(_mm256_add_epi32(a_pix_opac, _mm256_srli_epi32(b_prod, 15)), one);
+    return _mm256_and_si256(_mm256_blend_epi32(color, alpha, 0x88), _mm256_set1_epi32(0xFFFF));
+}
+
+static inline __m256i premultiply_px2(__m256i v) {
+    // v is straight fix15, (c * a + 2^14) >> 15 for colors, alpha is kept
+    __m256i a = _mm256_shuffle_epi32(v, 0xFF);
+    __m256i c = _mm256_srli_epi32(_mm256_add_epi32(_mm256_mullo_epi32(v, a), _mm256_set1_epi32(1 << 14)), 15);
+    return _mm256_blend_epi32(c, v, 0x88);
+}
+
+static inline __m256i from_float32_px2(__m256 f) {
+    // max and min pick the second operand for nan
+    f = _mm256_min_ps(_mm256_max_ps(f, _mm256_setzero_ps()), _mm256_set1_ps(1.0f));
+    return _mm256_cvtps_epi32(_mm256_mul_ps(f, _mm256_set1_ps(float(1u << 15u))));
+}
+
+static inline __m256i pack_px4(__m256i px01, __m256i px23) {
+    // packs 32 bit channels of four pixels to 16 bit, in pixel order
+    return _mm256_permute4x64_epi64(_mm256_packus_epi32(px01, px23), 0xD8);
+}
+
+static void avx2_blend(const uint16_t *layer_a, const uint16_t *layer_b, uint16_t *out,
+                       uint32_t a_opac, int n) {
+    const __m256i opac = _mm256_set1_epi32(a_opac);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i px01 = blend_px2(load_px2(layer_a + i * 4), load_px2(layer_b + i * 4), opac);
+        __m256i px23 = blend_px2(load_px2(layer_a + i * 4 + 8), load_px2(layer_b + i * 4 + 8), opac);
+        _mm256_storeu_si256((__m256i *) (out + i * 4), pack_px4(px01, px23));
+    }
+    if (i < n)
+        fix15_scalar_kernels.blend(layer_a + i * 4, layer_b + i * 4, out + i * 4, a_opac, n - i);
+}
+
+static void avx2_unpremultiply(const uint16_t *in, uint32_t *out, int n) {
+    int i = 0;
+    for (; i + 2 <= n; i += 2)
+        _mm256_storeu_si256((__m256i *) (out + i * 4), unpremultiply_px2(load_px2(in + i * 4)));
+    if (i < n)
+        fix15_scalar_kernels.unpremultiply(in + i * 4, out + i * 4, n - i);
+}
+
+static void avx2_to_float32(const uint16_t *in, float *out, int n) {
+    int i = 0;
+    for (; i + 2 <= n; i += 2)
+        _mm256_storeu_ps(out + i * 4, to_float32_px2(unpremultiply_px2(load_px2(in + i * 4))));
+    if (i < n)
+        fix15_scalar_kernels.toFloat32(in + i * 4, out + i * 4, n - i);
+}
+
+static void avx2_to_uint8(const uint16_t *in, uint8_t *out, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i px01 = to_uint8_px2(unpremultiply_px2(load_px2(in + i * 4)));
+        __m256i px23 = to_uint8_px2(unpremultiply_px2(load_px2(in + i * 4 + 8)));
+        __m256i words = pack_px4(px01, px23);
+        _mm_storeu_si128((__m128i *) (out + i * 4),
+                         _mm_packus_epi16(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1)));
+    }
+    if (i < n)
+        fix15_scalar_kernels.toUint8(in + i * 4, out + i * 4, n - i);
+}
+
+static void avx2_to_uint16(const uint16_t *in, uint16_t *out, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i px01 = to_uint16_px2(unpremultiply_px2(load_px2(in + i * 4)));
+        __m256i px23 = to_uint16_px2(unpremultiply_px2(load_px2(in + i * 4 + 8)));
+        _mm256_storeu_si256((__m256i *) (out + i * 4), pack_px4(px01, px23));
+    }
+    if (i < n)
+        fix15_scalar_kernels.toUint16(in + i * 4, out + i * 4, n - i);
+}
+
+static void avx2_to_float16(const uint16_t *in, uint16_t *out, int n) {
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m256 f = to_float32_px2(unpremultiply_px2(load_px2(in + i * 4)));
+        _mm_storeu_si128((__m128i *) (out + i * 4), _mm256_cvtps_ph(f, _MM_FROUND_TO_NEAREST_INT));
+    }
+    if (i < n)
+        fix15_scalar_kernels.toFloat16(in + i * 4, out + i * 4, n - i);
+}
+
+static void avx2_to_bfloat16(const uint16_t *in, uint16_t *out, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i px01 = to_bfloat16_px2(to_float32_px2(unpremultiply_px2(load_px2(in + i * 4))));
+        __m256i px23 = to_bfloat16_px2(to_float32_px2(unpremultiply_px2(load_px2(in + i * 4 + 8))));
+        _mm256_storeu_si256((__m256i *) (out + i * 4), pack_px4(px01, px23));
+    }
+    if (i < n)
+        fix15_scalar_kernels.toBFloat16(in + i * 4, out + i * 4, n - i);
+}
+
+static void avx2_from_uint8(const uint8_t *in, uint16_t *out, int n) {
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i scale = _mm256_set1_epi32(257);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v01 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (in + i * 4)));
+        __m256i v23 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (in + i * 4 + 8)));
+        v01 = _mm256_srli_epi32(_mm256_add_epi32(_mm256_mullo_epi32(v01, scale), one), 1);
+        v23 = _mm256_srli_epi32(_mm256_add_epi32(_mm256_mullo_epi32(v23, scale), one), 1);
+        _mm256_storeu_si256((__m256i *) (out + i * 4), pack_px4(premultiply_px2(v01), premultiply_px2(v23)));
+    }
+    if (i < n)
+        fix15_scalar_kernels.fromUint8(in + i * 4, out + i * 4, n - i);
+}
+
+static void avx2_from_uint16(const uint16_t *in, uint16_t *out, int n) {
+    const __m256i one = _mm256_set1_epi32(1);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v01 = _mm256_srli_epi32(_mm256_add_epi32(load_px2(in + i * 4), one), 1);
+        __m256i v23 = _mm256_srli_epi32(_mm256_add_epi32(load_px2(in + i * 4 + 8), one), 1);
+        _mm256_storeu_si256((__m256i *) (out + i * 4), pack_px4(premultiply_px2(v01), premultiply_px2(v23)));
+    }
+    if (i < n)
+        fix15_scalar_kernels.fromUint16(in + i * 4, out + i * 4, n - i);
+}
+
+static void avx2_from_float32(const float *in, uint16_t *out, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v01 = from_float32_px2(_mm256_loadu_ps(in + i * 4));
+        __m256i v23 = from_float32_px2(_mm256_loadu_ps(in + i * 4 + 8));
+        _mm256_storeu_si256((__m256i *) (out + i * 4), pack_px4(premultiply_px2(v01), premultiply_px2(v23)));
+    }
+    if (i < n)
+        fix15_scalar_kernels.fromFloat32(in + i * 4, out + i * 4, n - i);
+}
+
+const Fix15Kernels fix15_avx2_kernels = {
+        "avx2",
+        avx2_blend,
+        avx2_unpremultiply,
+        avx2_to_float32,
+        avx2_to_uint8,
+        avx2_to_uint16,
+        avx2_to_float16,
+        avx2_to_bfloat16,
+        avx2_from_uint8,
+        avx2_from_uint16,
+        avx2_from_float32
+};
@@ -0,0 +1,213 @@
+#include "simd.h"
+#include <immintrin.h>
+
+// Note: this file is compiled with -mavx512f, it must not instantiate any inline
+// functions shared with other translation units (eg: templates from std).
+
+static inline __m512i load_px4(const uint16_t *in) {
+    // four pixels widened to 32 bit channels
+    return _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *) in));
+}
+
+static inline __m256i unpremultiply_half(__m256i num, __m256i a_nz, __m256 inv_f) {
+    const __m512d half = _mm512_set1_pd(0.5);
+    const __m512d two = _mm512_set1_pd(2.0);
+    // float reciprocal of alpha, refined to double precision by one newton step
+    __m512d inv = _mm512_cvtps_pd(inv_f);
+    inv = _mm512_mul_pd(inv, _mm512_sub_pd(two, _mm512_mul_pd(_mm512_cvtepi32_pd(a_nz), inv)));
+    return _mm512_cvttpd_epi32(_mm512_mul_pd(_mm512_add_pd(_mm512_cvtepi32_pd(num), half), inv));
+}
+
+static inline __m512i unpremultiply_px4(__m512i v) {
+    const __m512i one = _mm512_set1_epi32(1);
+
+    __m512i a = _mm512_shuffle_epi32(v, _MM_PERM_DDDD);
+    __m512i a_nz = _mm512_max_epi32(a, one);
+    __m512i num = _mm512_add_epi32(_mm512_slli_epi32(v, 15), _mm512_srli_epi32(a, 1));
+    __m512 inv_f = _mm512_div_ps(_mm512_set1_ps(1.0f), _mm512_cvtepi32_ps(a_nz));
+
+    __m256i q0 = unpremultiply_half(_mm512_castsi512_si256(num),
+                                    _mm512_castsi512_si256(a_nz),
+                                    _mm512_castps512_ps256(inv_f));
+    __m256i q1 = unpremultiply_half(_mm512_extracti64x4_epi64(num, 1),
+                                    _mm512_extracti64x4_epi64(a_nz, 1),
+                                    _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(inv_f), 1)));
+    __m512i q = _mm512_inserti64x4(_mm512_castsi256_si512(q0), q1, 1);
+
+    // color of transparent pixels is 0, alpha is kept
+    q = _mm512_maskz_mov_epi32(_mm512_cmpneq_epi32_mask(a, _mm512_setzero_si512()), q);
+    return _mm512_mask_blend_epi32(0x8888, q, v);
+}
+
+static inline __m512i to_uint8_px4(__m512i q) {
+    // (c * 255 + 2^14) >> 15 for colors, (a * 255 + 2^14) >> 16 for alpha
+    __m512i t = _mm512_add_epi32(_mm512_mullo_epi32(q, _mm512_set1_epi32(255)), _mm512_set1_epi32(1 << 14));
+    t = _mm512_srli_epi32(t, 15);
+    return _mm512_mask_blend_epi32(0x8888, t, _mm512_srli_epi32(t, 1));
+}
+
+static inline __m512i to_uint16_px4(__m512i q) {
+    // (v * 65535 + 2^14) >> 15 for colors and alpha
+    __m512i t = _mm512_add_epi32(_mm512_mullo_epi32(q, _mm512_set1_epi32(65535)), _mm512_set1_epi32(1 << 14));
+    return _mm512_srli_epi32(t, 15);
+}
+
+static inline __m512 to_float32_px4(__m512i q) {
+    // colors are divided by 2^15, alpha by 2^16
+    const __m512 scale = _mm512_castpd_ps(_mm512_broadcast_f64x4(_mm256_castps_pd(
+            _mm256_setr_ps(1.0f / (1u << 15u), 1.0f / (1u << 15u),
+                           1.0f / (1u << 15u), 1.0f / (1u << 16u),
+                           1.0f / (1u << 15u), 1.0f / (1u << 15u),
+                           1.0f / (1u << 15u), 1.0f / (1u << 16u)))));
+    return _mm512_mul_ps(_mm512_cvtepi32_ps(q), scale);
+}
+
+static inline __m512i to_bfloat16_px4(__m512 f) {
+    // rounds the upper half of the floats to nearest even
+    __m512i bits = _mm512_castps_si512(f);
+    __m512i lsb = _mm512_and_si512(_mm512_srli_epi32(bits, 16), _mm512_set1_epi32(1));
+    return _mm512_srli_epi32(_mm512_add_epi32(_mm512_add_epi32(bits, _mm512_set1_epi32(0x7FFF)), lsb), 16);
+}
+
+static inline __m512i blend_px4(__m512i a, __m512i b, __m512i opac) {
+    const __m512i one = _mm512_set1_epi32(1 << 15);
+    __m512i a_pix_opac = _mm512_srli_epi32(_mm512_mullo_epi32(_mm512_shuffle_epi32(a, _MM_PERM_DDDD), opac), 15);
+    __m512i minus_opac = _mm512_sub_epi32(one, a_pix_opac);
+    __m512i b_prod = _mm512_mullo_epi32(b, minus_opac);
+    __m512i color = _mm512_srli_epi32(_mm512_add_epi32(_mm512_mullo_epi32(a, opac), b_prod), 15);
+    __m512i alpha = _mm512_min_epu32(_mm512_add_epi32(a_pix_opac, _mm512_srli_epi32(b_prod, 15)), one);
+    return _mm512_mask_blend_epi32(0x8888, color, alpha);
+}
+
+static inline __m512i premultiply_px4(__m512i v) {
+    // v is straight fix15, (c * a + 2^14) >> 15 for colors, alpha is kept
+    __m512i a = _mm512_shuffle_epi32(v, _MM_PERM_DDDD);
+    __m512i c = _mm512_srli_epi32(_mm512_add_epi32(_mm512_mullo_epi32(v, a), _mm512_set1_epi32(1 << 14)), 15);
+    return _mm512_mask_blend_epi32(0x8888, c, v);
+}
+
+static void avx512_blend(const uint16_t *layer_a, const uint16_t *layer_b, uint16_t *out,
+                         uint32_t a_opac, int n) {
+    const __m512i opac = _mm512_set1_epi32(a_opac);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m512i px = blend_px4(load_px4(layer_a + i * 4), load_px4(layer_b + i * 4), opac);
+        // truncating conversion
+        _mm256_storeu_si256((__m256i *) (out + i * 4), _mm512_cvtepi32_epi16(px));
+    }
+    if (i < n)
+        fix15_scalar_kernels.blend(layer_a + i * 4, layer_b + i * 4, out + i * 4, a_opac, n - i);
+}
+
+static void avx512_unpremultiply(const uint16_t *in, uint32_t *out, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm512_storeu_si512(out + i * 4, unpremultiply_px4(load_px4(in + i * 4)));
+    if (i < n)
+        fix15_scalar_kernels.unpremultiply(in + i * 4, out + i * 4, n - i);
+}
+
+static void avx512_to_float32(const uint16_t *in, float *out, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm512_storeu_ps(out + i * 4, to_float32_px4(unpremultiply_px4(load_px4(in + i * 4))));
+    if (i < n)
+        fix15_scalar_kernels.toFloat32(in + i * 4, out + i * 4, n - i);
+}
+
+static void avx512_to_uint8(const uint16_t *in, uint8_t *out, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m512i px = to_uint8_px4(unpremultiply_px4(load_px4(in + i * 4)));
+        // truncating conversion
+        _mm_storeu_si128((__m128i *) (out + i * 4), _mm512_cvtepi32_epi8(px));
+    }
+    if (i < n)
+        fix15_scalar_kernels.toUint8(in + i * 4, out + i * 4, n - i);
+}
+
+static void avx512_to_uint16(const uint16_t *in, uint16_t *out, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m512i px = to_uint16_px4(unpremultiply_px4(load_px4(in + i * 4)));
+        // truncating conversion
+        _mm256_storeu_si256((__m256i *) (out + i * 4), _mm512_cvtepi32_epi16(px));
+    }
+    if (i < n)
+        fix15_scalar_kernels.toUint16(in + i * 4, out + i * 4, n - i);
+}
+
+static void avx512_to_float16(const uint16_t *in, uint16_t *out, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m512 f = to_float32_px4(unpremultiply_px4(load_px4(in + i * 4)));
+        _mm256_storeu_si256((__m256i *) (out + i * 4), _mm512_cvtps_ph(f, _MM_FROUND_TO_NEAREST_INT));
+    }
+    if (i < n)
+        fix15_scalar_kernels.toFloat16(in + i * 4, out + i * 4, n - i);
+}
+
+static void avx512_to_bfloat16(const uint16_t *in, uint16_t *out, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m512i bf = to_bfloat16_px4(to_float32_px4(unpremultiply_px4(load_px4(in + i * 4))));
+        // truncating conversion
+        _mm256_storeu_si256((__m256i *) (out + i * 4), _mm512_cvtepi32_epi16(bf));
+    }
+    if (i < n)
+        fix15_scalar_kernels.toBFloat16(in + i * 4, out + i * 4, n - i);
+}
+
+static void avx512_from_uint8(const uint8_t *in, uint16_t *out, int n) {
+    const __m512i one = _mm512_set1_epi32(1);
+    const __m512i scale = _mm512_set1_epi32(257);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m512i v = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *) (in + i * 4)));
+        v = _mm512_srli_epi32(_mm512_add_epi32(_mm512_mullo_epi32(v, scale), one), 1);
+        // truncating conversion
+        _mm256_storeu_si256((__m256i *) (out + i * 4), _mm512_cvtepi32_epi16(premultiply_px4(v)));
+    }
+    if (i < n)
+        fix15_scalar_kernels.fromUint8(in + i * 4, out + i * 4, n - i);
+}
+
+static void avx512_from_uint16(const uint16_t *in, uint16_t *out, int n) {
+    const __m512i one = _mm512_set1_epi32(1);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m512i v = _mm512_srli_epi32(_mm512_add_epi32(load_px4(in + i * 4), one), 1);
+        // truncating conversion
+        _mm256_storeu_si256((__m256i *) (out + i * 4), _mm512_cvtepi32_epi16(premultiply_px4(v)));
+    }
+    if (i < n)
+        fix15_scalar_kernels.fromUint16(in + i * 4, out + i * 4, n - i);
+}
+
+static void avx512_from_float32(const float *in, uint16_t *out, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        // max and min pick the second operand for nan
+        __m512 f = _mm512_min_ps(_mm512_max_ps(_mm512_loadu_ps(in + i * 4), _mm512_setzero_ps()),
+                                 _mm512_set1_ps(1.0f));
+        __m512i v = _mm512_cvtps_epi32(_mm512_mul_ps(f, _mm512_set1_ps(float(1u << 15u))));
+        // truncating conversion
+        _mm256_storeu_si256((__m256i *) (out + i * 4), _mm512_cvtepi32_epi16(premultiply_px4(v)));
+    }
+    if (i < n)
+        fix15_scalar_kernels.fromFloat32(in + i * 4, out + i * 4, n - i);
+}
+
+const Fix15Kernels fix15_avx512_kernels = {
+        "avx512",
+        avx512_blend,
+        avx512_unpremultiply,
+        avx512_to_float32,
+        avx512_to_uint8,
+        avx512_to_uint16,
+        avx512_to_float16,
+        avx512_to_bfloat16,
+        avx512_from_uint8,
+        avx512_from_uint16,
+        avx512_from_float32
+};
@@ -0,0 +1,217 @@
+#include "simd.h"
+#include <immintrin.h>
+
+// Note: this file is compiled with -msse4.1, it must not instantiate any inline
+// functions shared with other translation units (eg: templates from std).
+
+static inline __m128i unpremultiply_px(__m128i v) {
+    // v = [r, g, b, a] of one pixel
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128d half = _mm_set1_pd(0.5);
+    const __m128d two = _mm_set1_pd(2.0);
+
+    __m128i a = _mm_shuffle_epi32(v, 0xFF);
+    __m128i a_nz = _mm_max_epi32(a, one);
+    __m128i num = _mm_add_epi32(_mm_slli_epi32(v, 15), _mm_srli_epi32(a, 1));
+
+    // float reciprocal of alpha, refined to double precision by one newton step
+    __m128 inv_f = _mm_div_ps(_mm_set1_ps(1.0f), _mm_cvtepi32_ps(a_nz));
+    __m128d inv = _mm_cvtps_pd(inv_f);
+    inv = _mm_mul_pd(inv, _mm_sub_pd(two, _mm_mul_pd(_mm_cvtepi32_pd(a_nz), inv)));
+
+    __m128d rg = _mm_mul_pd(_mm_add_pd(_mm_cvtepi32_pd(num), half), inv);
+    __m128d ba = _mm_mul_pd(_mm_add_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(num, 0xEE)), half), inv);
+    __m128i q = _mm_unpacklo_epi64(_mm_cvttpd_epi32(rg), _mm_cvttpd_epi32(ba));
+
+    // color of transparent pixels is 0, alpha is kept
+    q = _mm_andnot_si128(_mm_cmpeq_epi32(a, zero), q);
+    return _mm_blend_epi16(q, v, 0xC0);
+}
+
+static inline __m128i to_uint8_px(__m128i q) {
+    // (c * 255 + 2^14) >> 15 for colors, (a * 255 + 2^14) >> 16 for alpha, truncated to 8 bits
+    __m128i t = _mm_add_epi32(_mm_mullo_epi32(q, _mm_set1_epi32(255)), _mm_set1_epi32(1 << 14));
+    t = _mm_srli_epi32(t, 15);
+    t = _mm_blend_epi16(t, _mm_srli_epi32(t, 1), 0xC0);
+    return _mm_and_si128(t, _mm_set1_epi32(0xFF));
+}
+
+static inline __m128i to_uint16_px(__m128i q) {
+    // (v * 65535 + 2^14) >> 15 for colors and alpha
+    __m128i t = _mm_add_epi32(_mm_mullo_epi32(q, _mm_set1_epi32(65535)), _mm_set1_epi32(1 << 14));
+    return _mm_srli_epi32(t, 15);
+}
+
+static inline __m128i to_bfloat16_px(__m128 f) {
+    // rounds the upper half of the floats to nearest even
+    __m128i bits = _mm_castps_si128(f);
+    __m128i lsb = _mm_and_si128(_mm_srli_epi32(bits, 16), _mm_set1_epi32(1));
+    return _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(bits, _mm_set1_epi32(0x7FFF)), lsb), 16);
+}
+
+static inline __m128i blend_px(__m128i a, __m128i b, __m128i opac) {
+    const __m128i one = _mm_set1_epi32(1 << 15);
+    __m128i a_pix_opac = _mm_srli_epi32(_mm_mullo_epi32(_mm_shuffle_epi32(a, 0xFF), opac), 15);
+    __m128i minus_opac = _mm_sub_epi32(one, a_pix_opac);
+    __m128i b_prod = _mm_mullo_epi32(b, minus_opac);
+    __m128i color = _mm_srli_epi32(_mm_add_epi32(_mm_mullo_epi32(a, opac), b_prod), 15);
+    __m128i alpha = _mm_min_epu32(_mm_add_epi32(a_pix_opac, _mm_srli_epi32(b_prod, 15)), one);
+    return _mm_and_si128(_mm_blend_epi16(color, alpha, 0xC0), _mm_set1_epi32(0xFFFF));
+}
+
+static inline __m128i premultiply_px(__m128i v) {
+    // v = [r, g, b, a] straight fix15, (c * a + 2^14) >> 15 for colors, alpha is kept
+    __m128i a = _mm_shuffle_epi32(v, 0xFF);
+    __m128i c = _mm_srli_epi32(_mm_add_epi32(_mm_mullo_epi32(v, a), _mm_set1_epi32(1 << 14)), 15);
+    return _mm_blend_epi16(c, v, 0xC0);
+}
+
+static inline __m128i from_float32_px(__m128 f) {
+    // max and min pick the second operand for nan
+    f = _mm_min_ps(_mm_max_ps(f, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+    return _mm_cvtps_epi32(_mm_mul_ps(f, _mm_set1_ps(float(1u << 15u))));
+}
+
+static void sse41_blend(const uint16_t *layer_a, const uint16_t *layer_b, uint16_t *out,
+                        uint32_t a_opac, int n) {
+    const __m128i opac = _mm_set1_epi32(a_opac);
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (layer_a + i * 4));
+        __m128i b = _mm_loadu_si128((const __m128i *) (layer_b + i * 4));
+        __m128i px0 = blend_px(_mm_cvtepu16_epi32(a), _mm_cvtepu16_epi32(b), opac);
+        __m128i px1 = blend_px(_mm_cvtepu16_epi32(_mm_srli_si128(a, 8)),
+                               _mm_cvtepu16_epi32(_mm_srli_si128(b, 8)), opac);
+        _mm_storeu_si128((__m128i *) (out + i * 4), _mm_packus_epi32(px0, px1));
+    }
+    if (i < n)
+        fix15_scalar_kernels.blend(layer_a + i * 4, layer_b + i * 4, out + i * 4, a_opac, n - i);
+}
+
+static void sse41_unpremultiply(const uint16_t *in, uint32_t *out, int n) {
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (in + i * 4));
+        _mm_storeu_si128((__m128i *) (out + i * 4), unpremultiply_px(_mm_cvtepu16_epi32(v)));
+        _mm_storeu_si128((__m128i *) (out + i * 4 + 4),
+                         unpremultiply_px(_mm_cvtepu16_epi32(_mm_srli_si128(v, 8))));
+    }
+    if (i < n)
+        fix15_scalar_kernels.unpremultiply(in + i * 4, out + i * 4, n - i);
+}
+
+static void sse41_to_float32(const uint16_t *in, float *out, int n) {
+    const __m128 scale = _mm_setr_ps(1.0f / (1u << 15u), 1.0f / (1u << 15u),
+                                     1.0f / (1u << 15u), 1.0f / (1u << 16u));
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (in + i * 4));
+        __m128i px0 = unpremultiply_px(_mm_cvtepu16_epi32(v));
+        __m128i px1 = unpremultiply_px(_mm_cvtepu16_epi32(_mm_srli_si128(v, 8)));
+        _mm_storeu_ps(out + i * 4, _mm_mul_ps(_mm_cvtepi32_ps(px0), scale));
+        _mm_storeu_ps(out + i * 4 + 4, _mm_mul_ps(_mm_cvtepi32_ps(px1), scale));
+    }
+    if (i < n)
+        fix15_scalar_kernels.toFloat32(in + i * 4, out + i * 4, n - i);
+}
+
+static void sse41_to_uint8(const uint16_t *in, uint8_t *out, int n) {
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (in + i * 4));
+        __m128i px0 = to_uint8_px(unpremultiply_px(_mm_cvtepu16_epi32(v)));
+        __m128i px1 = to_uint8_px(unpremultiply_px(_mm_cvtepu16_epi32(_mm_srli_si128(v, 8))));
+        __m128i words = _mm_packus_epi32(px0, px1);
+        _mm_storel_epi64((__m128i *) (out + i * 4), _mm_packus_epi16(words, words));
+    }
+    if (i < n)
+        fix15_scalar_kernels.toUint8(in + i * 4, out + i * 4, n - i);
+}
+
+static void sse41_to_uint16(const uint16_t *in, uint16_t *out, int n) {
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (in + i * 4));
+        __m128i px0 = to_uint16_px(unpremultiply_px(_mm_cvtepu16_epi32(v)));
+        __m128i px1 = to_uint16_px(unpremultiply_px(_mm_cvtepu16_epi32(_mm_srli_si128(v, 8))));
+        _mm_storeu_si128((__m128i *) (out + i * 4), _mm_packus_epi32(px0, px1));
+    }
+    if (i < n)
+        fix15_scalar_kernels.toUint16(in + i * 4, out + i * 4, n - i);
+}
+
+static void sse41_to_float16(const uint16_t *in, uint16_t *out, int n) {
+    // Note: sse4.1 has no half conversion instructions (f16c)
+    fix15_scalar_kernels.toFloat16(in, out, n);
+}
+
+static void sse41_to_bfloat16(const uint16_t *in, uint16_t *out, int n) {
+    const __m128 scale = _mm_setr_ps(1.0f / (1u << 15u), 1.0f / (1u << 15u),
+                                     1.0f / (1u << 15u), 1.0f / (1u << 16u));
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (in + i * 4));
+        __m128i px0 = unpremultiply_px(_mm_cvtepu16_epi32(v));
+        __m128i px1 = unpremultiply_px(_mm_cvtepu16_epi32(_mm_srli_si128(v, 8)));
+        __m128i bf0 = to_bfloat16_px(_mm_mul_ps(_mm_cvtepi32_ps(px0), scale));
+        __m128i bf1 = to_bfloat16_px(_mm_mul_ps(_mm_cvtepi32_ps(px1), scale));
+        _mm_storeu_si128((__m128i *) (out + i * 4), _mm_packus_epi32(bf0, bf1));
+    }
+    if (i < n)
+        fix15_scalar_kernels.toBFloat16(in + i * 4, out + i * 4, n - i);
+}
+
+static void sse41_from_uint8(const uint8_t *in, uint16_t *out, int n) {
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i scale = _mm_set1_epi32(257);
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i v = _mm_loadl_epi64((const __m128i *) (in + i * 4));
+        __m128i v0 = _mm_cvtepu8_epi32(v);
+        __m128i v1 = _mm_cvtepu8_epi32(_mm_srli_si128(v, 4));
+        v0 = _mm_srli_epi32(_mm_add_epi32(_mm_mullo_epi32(v0, scale), one), 1);
+        v1 = _mm_srli_epi32(_mm_add_epi32(_mm_mullo_epi32(v1, scale), one), 1);
+        _mm_storeu_si128((__m128i *) (out + i * 4), _mm_packus_epi32(premultiply_px(v0), premultiply_px(v1)));
+    }
+    if (i < n)
+        fix15_scalar_kernels.fromUint8(in + i * 4, out + i * 4, n - i);
+}
+
+static void sse41_from_uint16(const uint16_t *in, uint16_t *out, int n) {
+    const __m128i one = _mm_set1_epi32(1);
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (in + i * 4));
+        __m128i v0 = _mm_srli_epi32(_mm_add_epi32(_mm_cvtepu16_epi32(v), one), 1);
+        __m128i v1 = _mm_srli_epi32(_mm_add_epi32(_mm_cvtepu16_epi32(_mm_srli_si128(v, 8)), one), 1);
+        _mm_storeu_si128((__m128i *) (out + i * 4), _mm_packus_epi32(premultiply_px(v0), premultiply_px(v1)));
+    }
+    if (i < n)
+        fix15_scalar_kernels.fromUint16(in + i * 4, out + i * 4, n - i);
+}
+
+static void sse41_from_float32(const float *in, uint16_t *out, int n) {
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i v0 = from_float32_px(_mm_loadu_ps(in + i * 4));
+        __m128i v1 = from_float32_px(_mm_loadu_ps(in + i * 4 + 4));
+        _mm_storeu_si128((__m128i *) (out + i * 4), _mm_packus_epi32(premultiply_px(v0), premultiply_px(v1)));
+    }
+    if (i < n)
+        fix15_scalar_kernels.fromFloat32(in + i * 4, out + i * 4, n - i);
+}
+
+const Fix15Kernels fix15_sse41_kernels = {
+        "sse4.1",
+        sse41_blend,
+        sse41_unpremultiply,
+        sse41_to_float32,
+        sse41_to_uint8,
+        sse41_to_uint16,
+        sse41_to_float16,
+        sse41_to_bfloat16,
+        sse41_from_uint8,
+        sse41_from_uint16,
+        sse41_from_float32
+};
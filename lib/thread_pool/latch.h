@@ -0,0 +1,104 @@
+#ifndef LATCH_H
+#define LATCH_H
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define THREAD_POOL_PAUSE() _mm_pause()
+#else
+#define THREAD_POOL_PAUSE() ((void) 0)
+#endif
+
+#define THREAD_POOL_SPIN_COUNT  4096
+
+/**
+ * @class Latch
+ * @brief Single use counting latch, waited for once by the thread which submitted
+ *        the counted tasks, in place of a future per task.
+ * @note The waiter spins for a short while before it sleeps, so that short
+ *       batches are waited for without a wake-up. The first error reported by a
+ *       task is rethrown by wait().
+ */
+class Latch {
+public:
+    explicit Latch(size_t count);
+
+    Latch(const Latch &) = delete;
+    Latch &operator=(const Latch &) = delete;
+
+    /**
+     * Count down once, when a task is finished.
+     */
+    void countDown();
+
+    /**
+     * Report the error of a task, which must still count down.
+     * @param error Error of the task.
+     */
+    void setError(std::exception_ptr error);
+
+    /**
+     * Wait until the count reaches zero, then rethrow the first error if any.
+     */
+    void wait();
+
+    /**
+     * Check without blocking whether the count has reached zero, wait() then returns at once.
+     * @return Whether all tasks are finished.
+     */
+    bool ready();
+
+private:
+    std::atomic<size_t> _count;
+    /// set after the last count down has stopped touching the latch
+    std::atomic<bool> _released;
+    std::mutex _mutex;
+    std::condition_variable _condition;
+    std::exception_ptr _error;
+};
+
+inline Latch::Latch(size_t count)
+        : _count(count), _released(count == 0) {}
+
+inline void Latch::countDown() {
+    if (_count.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _condition.notify_all();
+    }
+    _released.store(true, std::memory_order_release);
+}
+
+inline void Latch::setError(std::exception_ptr error) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (not _error)
+        _error = error;
+}
+
+inline void Latch::wait() {
+    for (int i = 0; i < THREAD_POOL_SPIN_COUNT and not _released.load(std::memory_order_acquire); i++)
+        THREAD_POOL_PAUSE();
+    if (not _released.load(std::memory_order_acquire)) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _condition.wait(lock, [this] { return _count.load(std::memory_order_acquire) == 0; });
+    }
+    /// the last count down may still hold the mutex, the latch can't be destroyed before it is released
+    while (not _released.load(std::memory_order_acquire))
+        std::this_thread::yield();
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_error)
+        std::rethrow_exception(_error);
+}
+
+inline bool Latch::ready() {
+    return _released.load(std::memory_order_acquire);
+}
+
+#endif //LATCH_H
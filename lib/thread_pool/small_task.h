@@ -0,0 +1,171 @@
+#ifndef SMALL_TASK_H
+#define SMALL_TASK_H
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <type_traits>
+
+#define SMALL_TASK_SIZE 48
+
+/**
+ * @class SmallTask
+ * @brief Move only callable of signature void(Args...), which stores callables of
+ *        up to SMALL_TASK_SIZE bytes inline, without any allocation.
+ * @note Larger callables, or callables which may throw when moved, are stored on
+ *       the heap like std::function does.
+ */
+template<typename... Args>
+class SmallTask {
+public:
+    SmallTask() noexcept = default;
+
+    SmallTask(std::nullptr_t) noexcept {}
+
+    template<typename F,
+            typename std::enable_if<not std::is_same<typename std::decay<F>::type, SmallTask>::value, int>::type = 0>
+    SmallTask(F &&f);
+
+    SmallTask(SmallTask &&other) noexcept;
+
+    SmallTask &operator=(SmallTask &&other) noexcept;
+
+    SmallTask &operator=(std::nullptr_t) noexcept;
+
+    SmallTask(const SmallTask &) = delete;
+    SmallTask &operator=(const SmallTask &) = delete;
+
+    ~SmallTask();
+
+    void operator()(Args... args);
+
+    explicit operator bool() const noexcept;
+
+private:
+    struct Ops {
+        void (*invoke)(void *, Args...);
+        /// move constructs the callable at dst from src, and destroys src
+        void (*move)(void *dst, void *src);
+        void (*destroy)(void *);
+    };
+
+    template<typename F>
+    struct Inline {
+        static void invoke(void *p, Args... args) { (*static_cast<F *>(p))(std::forward<Args>(args)...); }
+        static void move(void *dst, void *src) {
+            new(dst) F(std::move(*static_cast<F *>(src)));
+            static_cast<F *>(src)->~F();
+        }
+        static void destroy(void *p) { static_cast<F *>(p)->~F(); }
+        static constexpr Ops ops = {invoke, move, destroy};
+    };
+
+    template<typename F>
+    struct Heap {
+        static void invoke(void *p, Args... args) { (**static_cast<F **>(p))(std::forward<Args>(args)...); }
+        static void move(void *dst, void *src) { *static_cast<F **>(dst) = *static_cast<F **>(src); }
+        static void destroy(void *p) { delete *static_cast<F **>(p); }
+        static constexpr Ops ops = {invoke, move, destroy};
+    };
+
+    template<typename F>
+    using IsInline = std::integral_constant<bool, sizeof(F) <= SMALL_TASK_SIZE and
+                                                  alignof(F) <= alignof(std::max_align_t) and
+                                                  std::is_nothrow_move_constructible<F>::value>;
+
+    template<typename F>
+    void _store(F &&f, std::true_type);
+
+    template<typename F>
+    void _store(F &&f, std::false_type);
+
+    void _reset() noexcept;
+
+    alignas(std::max_align_t) unsigned char _storage[SMALL_TASK_SIZE];
+    const Ops *_ops = nullptr;
+};
+
+template<typename... Args>
+template<typename F>
+constexpr typename SmallTask<Args...>::Ops SmallTask<Args...>::Inline<F>::ops;
+
+template<typename... Args>
+template<typename F>
+constexpr typename SmallTask<Args...>::Ops SmallTask<Args...>::Heap<F>::ops;
+
+template<typename... Args>
+template<typename F,
+        typename std::enable_if<not std::is_same<typename std::decay<F>::type, SmallTask<Args...>>::value, int>::type>
+SmallTask<Args...>::SmallTask(F &&f) {
+    using Fn = typename std::decay<F>::type;
+    _store(std::forward<F>(f), IsInline<Fn>());
+}
+
+template<typename... Args>
+template<typename F>
+void SmallTask<Args...>::_store(F &&f, std::true_type) {
+    using Fn = typename std::decay<F>::type;
+    new(_storage) Fn(std::forward<F>(f));
+    _ops = &Inline<Fn>::ops;
+}
+
+template<typename... Args>
+template<typename F>
+void SmallTask<Args...>::_store(F &&f, std::false_type) {
+    using Fn = typename std::decay<F>::type;
+    *reinterpret_cast<Fn **>(_storage) = new Fn(std::forward<F>(f));
+    _ops = &Heap<Fn>::ops;
+}
+
+template<typename... Args>
+SmallTask<Args...>::SmallTask(SmallTask &&other) noexcept {
+    if (other._ops != nullptr) {
+        other._ops->move(_storage, other._storage);
+        _ops = other._ops;
+        other._ops = nullptr;
+    }
+}
+
+template<typename... Args>
+SmallTask<Args...> &SmallTask<Args...>::operator=(SmallTask &&other) noexcept {
+    if (this != &other) {
+        _reset();
+        if (other._ops != nullptr) {
+            other._ops->move(_storage, other._storage);
+            _ops = other._ops;
+            other._ops = nullptr;
+        }
+    }
+    return *this;
+}
+
+template<typename... Args>
+SmallTask<Args...> &SmallTask<Args...>::operator=(std::nullptr_t) noexcept {
+    _reset();
+    return *this;
+}
+
+template<typename... Args>
+SmallTask<Args...>::~SmallTask() {
+    _reset();
+}
+
+template<typename... Args>
+inline void SmallTask<Args...>::operator()(Args... args) {
+    _ops->invoke(_storage, std::forward<Args>(args)...);
+}
+
+template<typename... Args>
+inline SmallTask<Args...>::operator bool() const noexcept {
+    return _ops != nullptr;
+}
+
+template<typename... Args>
+inline void SmallTask<Args...>::_reset() noexcept {
+    if (_ops != nullptr) {
+        _ops->destroy(_storage);
+        _ops = nullptr;
+    }
+}
+
+#endif //SMALL_TASK_H
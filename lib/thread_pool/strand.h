@@ -0,0 +1,149 @@
+#ifndef STRAND_H
+#define STRAND_H
+
+#include <concurrentqueue/concurrentqueue.h>
+#include "small_task.h"
+#include "latch.h"
+
+#include <atomic>
+#include <memory>
+#include <future>
+#include <functional>
+#include <type_traits>
+
+/**
+ * @class Strand
+ * @brief Serial executor on top of a thread pool, tasks of one strand run one at
+ *        a time in submission order, tasks of different strands run in parallel.
+ * @note Lock free, the task which makes an idle strand busy schedules a drain
+ *       on the pool, the drain runs tasks until the strand becomes idle again.
+ *       Order is kept for tasks submitted by the same thread.
+ */
+template<typename Pool>
+class Strand {
+public:
+    explicit Strand(Pool &pool);
+
+    Strand(const Strand &) = delete;
+    Strand &operator=(const Strand &) = delete;
+
+    /**
+     * @tparam F
+     * @tparam Args
+     * @param f     Function to be called.
+     * @param args  Function arguments.
+     * @return      Function result.
+     */
+    template<class F, class... Args>
+    auto enqueue(F &&f, Args &&... args)
+    -> std::future<typename std::result_of<F(Args...)>::type>;
+
+    /**
+     * Submit a task without a future, nothing is allocated if f is small enough
+     * to be stored inline, errors must be handled by f.
+     * @tparam F
+     * @param f     Function to be called.
+     */
+    template<class F>
+    void post(F &&f);
+
+    /**
+     * Wait until the tasks submitted before have run, then keep later tasks from
+     * running until release(), so that the caller may work on the data of the
+     * strand from any thread. An idle strand is held without waiting.
+     * @note Callers holding several strands must hold them in the same order.
+     */
+    void hold();
+
+    /**
+     * Let the tasks submitted during a hold run.
+     */
+    void release();
+
+    /**
+     * Get number of tasks submitted and not finished yet.
+     * @return Task number.
+     */
+    size_t pending();
+
+private:
+    Pool &_pool;
+    /// tasks set their argument when they are a hold, after which the drain stops
+    moodycamel::ConcurrentQueue<SmallTask<bool &>> _tasks;
+    std::atomic<size_t> _pending;
+
+    void _drain();
+};
+
+template<typename Pool>
+Strand<Pool>::Strand(Pool &pool)
+        : _pool(pool), _pending(0) {}
+
+template<typename Pool>
+template<class F, class... Args>
+auto Strand<Pool>::enqueue(F &&f, Args &&... args)
+-> std::future<typename std::result_of<F(Args...)>::type> {
+    using return_type = typename std::result_of<F(Args...)>::type;
+
+    auto task = std::make_shared<std::packaged_task<return_type()> >(
+            std::bind(std::forward<F>(f), std::forward<Args>(args)...)
+    );
+
+    std::future<return_type> res = task->get_future();
+    post([task]() { (*task)(); });
+    return res;
+}
+
+template<typename Pool>
+template<class F>
+void Strand<Pool>::post(F &&f) {
+    _tasks.enqueue(SmallTask<bool &>([f = std::forward<F>(f)](bool &) mutable { f(); }));
+    /// the task is queued before it is counted, a drain which sees the count will find it
+    if (_pending.fetch_add(1, std::memory_order_acq_rel) == 0)
+        _pool.post([this] { _drain(); });
+}
+
+template<typename Pool>
+void Strand<Pool>::hold() {
+    size_t idle = 0;
+    if (_pending.compare_exchange_strong(idle, 1, std::memory_order_acq_rel))
+        return;
+    Latch held(1);
+    /// the task carries its own latch, holds queued by other threads may be dequeued first
+    _tasks.enqueue(SmallTask<bool &>([&held](bool &hold) {
+        hold = true;
+        held.countDown();
+    }));
+    if (_pending.fetch_add(1, std::memory_order_acq_rel) == 0)
+        _pool.post([this] { _drain(); });
+    held.wait();
+}
+
+template<typename Pool>
+void Strand<Pool>::release() {
+    /// the hold is counted like a finished task, tasks submitted meanwhile need a new drain
+    if (_pending.fetch_sub(1, std::memory_order_acq_rel) > 1)
+        _pool.post([this] { _drain(); });
+}
+
+template<typename Pool>
+inline size_t Strand<Pool>::pending() {
+    return _pending.load(std::memory_order_acquire);
+}
+
+template<typename Pool>
+void Strand<Pool>::_drain() {
+    SmallTask<bool &> task;
+    do {
+        while (not _tasks.try_dequeue(task))
+            continue;
+        bool hold = false;
+        task(hold);
+        task = nullptr;
+        /// a hold, the strand stays busy without a drain until it is released
+        if (hold)
+            return;
+    } while (_pending.fetch_sub(1, std::memory_order_acq_rel) > 1);
+}
+
+#endif //STRAND_H
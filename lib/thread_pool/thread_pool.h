@@ -7,7 +7,11 @@
 
 
 #include <concurrentqueue/blockingconcurrentqueue.h>
+#include "small_task.h"
+#include "latch.h"
 
+#include <atomic>
+#include <iterator>
 #include <vector>
 #include <queue>
 #include <memory>
@@ -24,6 +28,16 @@
 struct void_ctx {
 };
 
+/// how idle workers of ThreadPoolConcurrent wait for tasks
+enum WaitPolicy {
+    /// busy wait, lowest latency, keeps one core per worker busy
+    WAIT_SPIN,
+    /// busy wait for THREAD_POOL_SPIN_COUNT tries, then yield the core between tries
+    WAIT_SPIN_YIELD,
+    /// sleep on the queue semaphore, every wake-up goes through the kernel
+    WAIT_PARK
+};
+
 /**
  * @class ThreadPoolConcurrent
  * @brief A thread pool implemenatation using lockless concurrent queue
@@ -32,7 +46,14 @@ struct void_ctx {
 template<typename Context = void_ctx>
 class ThreadPoolConcurrent {
 public:
-    explicit ThreadPoolConcurrent(size_t size);
+    /**
+     * @param size      Worker number.
+     * @param policy    How idle workers wait for tasks.
+     * @param on_start  Called by each worker with its index when it starts, before any task,
+     *                  to set up thread local state such as thread budgets.
+     */
+    explicit ThreadPoolConcurrent(size_t size, WaitPolicy policy = WAIT_PARK,
+                                  std::function<void(size_t)> on_start = nullptr);
 
     /**
      * @tparam F
@@ -53,12 +74,55 @@ public:
     auto enqueue(F &&f, Args &&... args)
     -> std::future<typename std::result_of<F(Args...)>::type>;
 
+    /**
+     * Submit a task without a future, the task calls f(context), or f() for pools
+     * without context. Nothing is allocated if f is small enough to be stored inline,
+     * errors must be handled by f.
+     * @tparam F
+     * @param f     Function to be called.
+     */
+    template<typename CTX=Context,
+            typename std::enable_if<not std::is_same<CTX, void_ctx>::value, int>::type = 0,
+            class F>
+    void post(F &&f);
+
+    template<typename CTX=Context,
+            typename std::enable_if<std::is_same<CTX, void_ctx>::value, int>::type = 0,
+            class F>
+    void post(F &&f);
+
+    /**
+     * Submit n tasks at once without futures, task i calls f(context, i),
+     * or f(i) for pools without context. f is copied into every task.
+     * @tparam F
+     * @param n     Task number.
+     * @param f     Function to be called.
+     * @param latch Latch counting n, counted down once by each task.
+     */
+    template<typename CTX=Context,
+            typename std::enable_if<not std::is_same<CTX, void_ctx>::value, int>::type = 0,
+            class F>
+    void enqueueBulk(size_t n, const F &f, Latch &latch);
+
+    template<typename CTX=Context,
+            typename std::enable_if<std::is_same<CTX, void_ctx>::value, int>::type = 0,
+            class F>
+    void enqueueBulk(size_t n, const F &f, Latch &latch);
+
     /**
      * Resize the thread pool.
      * @param size New thread pool size.
      */
     void resize(size_t size);
 
+    /**
+     * Set how idle workers wait for tasks.
+     * @param policy Wait policy.
+     */
+    void setWaitPolicy(WaitPolicy policy);
+
+    WaitPolicy getWaitPolicy();
+
     template<typename CTX = Context,
             typename std::enable_if<not std::is_same<CTX, void_ctx>::value, int>::type = 0>
     Context &getContext(size_t idx);
@@ -85,16 +149,21 @@ public:
 private:
     std::vector<Context> _worker_ctx;
     std::vector<std::thread> _workers;
-    // the task queue
-    moodycamel::BlockingConcurrentQueue<std::function<void(Context &)>> _tasks;
-    bool _stop;
+    // the task queue, tasks are stored inline if small enough
+    moodycamel::BlockingConcurrentQueue<SmallTask<Context &>> _tasks;
+    std::atomic<bool> _stop;
+    std::atomic<WaitPolicy> _policy;
+    std::function<void(size_t)> _on_start;
     size_t _size;
     std::mutex _resize_lock;
+
+    void _bulk(std::vector<SmallTask<Context &>> &tasks);
 };
 
 template<typename Context>
-ThreadPoolConcurrent<Context>::ThreadPoolConcurrent(size_t size)
-        : _stop(false), _size(0) {
+ThreadPoolConcurrent<Context>::ThreadPoolConcurrent(size_t size, WaitPolicy policy,
+                                                    std::function<void(size_t)> on_start)
+        : _stop(false), _policy(policy), _on_start(std::move(on_start)), _size(0) {
     resize(size);
 }
 
@@ -133,10 +202,82 @@ auto ThreadPoolConcurrent<Context>::enqueue(F &&f, Args &&... args)
     std::future<return_type> res = task->get_future();
     if (_stop)
         throw std::runtime_error("Enqueue on stopped ThreadPool");
-    this->_tasks.enqueue([task](Context &c) { (*task)(); });
+    this->_tasks.enqueue([task](Context &) { (*task)(); });
     return res;
 }
 
+template<typename Context>
+template<typename CTX,
+        typename std::enable_if<not std::is_same<CTX, void_ctx>::value, int>::type,
+        class F>
+void ThreadPoolConcurrent<Context>::post(F &&f) {
+    if (_stop)
+        throw std::runtime_error("Enqueue on stopped ThreadPool");
+    this->_tasks.enqueue(SmallTask<Context &>(std::forward<F>(f)));
+}
+
+template<typename Context>
+template<typename CTX,
+        typename std::enable_if<std::is_same<CTX, void_ctx>::value, int>::type,
+        class F>
+void ThreadPoolConcurrent<Context>::post(F &&f) {
+    if (_stop)
+        throw std::runtime_error("Enqueue on stopped ThreadPool");
+    this->_tasks.enqueue(SmallTask<Context &>([fn = typename std::decay<F>::type(std::forward<F>(f))](Context &) mutable {
+        fn();
+    }));
+}
+
+template<typename Context>
+template<typename CTX,
+        typename std::enable_if<not std::is_same<CTX, void_ctx>::value, int>::type,
+        class F>
+void ThreadPoolConcurrent<Context>::enqueueBulk(size_t n, const F &f, Latch &latch) {
+    std::vector<SmallTask<Context &>> tasks;
+    tasks.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        tasks.emplace_back([f, i, &latch](Context &c) {
+            try {
+                f(c, i);
+            }
+            catch (...) {
+                latch.setError(std::current_exception());
+            }
+            latch.countDown();
+        });
+    }
+    _bulk(tasks);
+}
+
+template<typename Context>
+template<typename CTX,
+        typename std::enable_if<std::is_same<CTX, void_ctx>::value, int>::type,
+        class F>
+void ThreadPoolConcurrent<Context>::enqueueBulk(size_t n, const F &f, Latch &latch) {
+    std::vector<SmallTask<Context &>> tasks;
+    tasks.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        tasks.emplace_back([f, i, &latch](Context &) {
+            try {
+                f(i);
+            }
+            catch (...) {
+                latch.setError(std::current_exception());
+            }
+            latch.countDown();
+        });
+    }
+    _bulk(tasks);
+}
+
+template<typename Context>
+void ThreadPoolConcurrent<Context>::_bulk(std::vector<SmallTask<Context &>> &tasks) {
+    /// all tasks are published and signalled with a single queue operation
+    if (_stop)
+        throw std::runtime_error("Enqueue on stopped ThreadPool");
+    this->_tasks.enqueue_bulk(std::make_move_iterator(tasks.begin()), tasks.size());
+}
+
 template<typename Context>
 void ThreadPoolConcurrent<Context>::resize(size_t size) {
     _resize_lock.lock();
@@ -158,12 +299,30 @@ void ThreadPoolConcurrent<Context>::resize(size_t size) {
         for (size_t i = from; i < size; ++i) {
             _workers.emplace_back(
                     [this, i] {
-                        std::function<void(Context &)> task;
+                        if (this->_on_start)
+                            this->_on_start(i);
+                        SmallTask<Context &> task;
+                        size_t idle = 0;
                         while (not this->_stop and i < this->_size) {
-                            if (this->_tasks.wait_dequeue_timed(
-                                    task, std::chrono::milliseconds(THREAD_POOL_SLEEP_USEC))) {
+                            /// parked workers sleep on the semaphore, others poll it
+                            bool got;
+                            auto policy = this->_policy.load(std::memory_order_relaxed);
+                            if (policy == WAIT_PARK)
+                                got = this->_tasks.wait_dequeue_timed(
+                                        task, std::chrono::milliseconds(THREAD_POOL_SLEEP_USEC));
+                            else
+                                got = this->_tasks.try_dequeue(task);
+
+                            if (got) {
                                 task(_worker_ctx[i]);
+                                task = nullptr;
+                                idle = 0;
                             }
+                            else if (policy == WAIT_SPIN or
+                                     (policy == WAIT_SPIN_YIELD and ++idle < THREAD_POOL_SPIN_COUNT))
+                                THREAD_POOL_PAUSE();
+                            else if (policy == WAIT_SPIN_YIELD)
+                                std::this_thread::yield();
                         }
                     }
             );
@@ -191,6 +350,16 @@ void ThreadPoolConcurrent<Context>::setContext(size_t idx, Ctx &&context) {
     _worker_ctx[idx] = context;
 }
 
+template<typename Context>
+inline void ThreadPoolConcurrent<Context>::setWaitPolicy(WaitPolicy policy) {
+    _policy.store(policy, std::memory_order_relaxed);
+}
+
+template<typename Context>
+inline WaitPolicy ThreadPoolConcurrent<Context>::getWaitPolicy() {
+    return _policy.load(std::memory_order_relaxed);
+}
+
 template<typename Context>
 inline size_t ThreadPoolConcurrent<Context>::size() {
     return _size;
@@ -328,7 +497,7 @@ auto ThreadPoolUsingLock<Context>::enqueue(F &&f, Args &&... args)
         if (_stop)
             throw std::runtime_error("Enqueue on stopped ThreadPool");
 
-        _tasks.emplace([task](Context &c) { (*task)(); });
+        _tasks.emplace([task](Context &) { (*task)(); });
     }
     _condition.notify_one();
     return res;
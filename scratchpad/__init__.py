@@ -5,8 +5,14 @@ __all__ = [
     "Point",
     "Setting",
     "ScratchPad",
+    "Snapshot",
     "BatchedScratchPad",
-    "set_omp_max_threads"
+    "AsyncHandle",
+    "set_omp_max_threads",
+    "get_simd_isas",
+    "get_simd_isa",
+    "set_simd_isa",
+    "get_scratch_reserved"
 ]
 
 set_omp_max_threads(4)
@@ -3,7 +3,10 @@ from scratchpad import (
     Point,
     ScratchPad,
     get_brushes,
-    set_omp_max_threads
+    set_omp_max_threads,
+    get_simd_isas,
+    set_simd_isa,
+    get_scratch_reserved
 )
 import numpy as np
 import matplotlib.pyplot as plt
@@ -33,6 +36,36 @@ def show_image(array, title="image"):
 pad_size = (1023, 1001)
 
 
+def layer_pixels(pad, layer):
+    # premultiplied fix15 pixels of a layer, row-major and cropped to the pad
+    view = pad.layer_view(layer)
+    rows, cols = view.shape[:2]
+    width, height = pad.get_pad_size()
+    flat = view.transpose(0, 2, 1, 3, 4).reshape(rows * 64, cols * 64, 4)
+    return flat[:height, :width].astype(np.int64)
+
+
+def fix15_to_float32(pixels):
+    # unpremultiplied with rounding, alpha halved, as render does
+    a = pixels[:, :, 3:]
+    straight = np.where(a > 0, ((pixels[:, :, :3] << 15) + a // 2) // np.maximum(a, 1), 0)
+    return np.dstack([straight / (1 << 15), a / (1 << 16)]).astype(np.float32)
+
+
+def composite_reference(pad, layers, opacity):
+    # the fix15 blend of the layer views over all pixels, converted as render does to float32
+    dst = layer_pixels(pad, 0)
+    op = int(opacity * (1 << 15))
+    for layer in range(1, layers):
+        src = layer_pixels(pad, layer)
+        a_pix = (src[:, :, 3] * op) >> 15
+        minus = (1 << 15) - a_pix
+        color = (src[:, :, :3] * op + dst[:, :, :3] * minus[:, :, None]) >> 15
+        alpha = np.minimum(a_pix + ((dst[:, :, 3] * minus) >> 15), 1 << 15)
+        dst = np.dstack([color, alpha])
+    return fix15_to_float32(dst)
+
+
 if __name__ == "__main__":
     set_omp_max_threads(4)
     p = ScratchPad()
@@ -54,6 +87,186 @@ if __name__ == "__main__":
     arr1 = p.render(np.float32)
     arr2 = p.render_layer(0, np.float32)
     assert np.allclose(arr1, arr2)
+
+    # strokes given as arrays draw the same as lists of points
+    stroke = np.array([[pt.x, pt.y, pt.xtilt, pt.ytilt, pt.pressure, pt.dtime] for pt in points], dtype=np.float32)
+    for array_points in (stroke, {"x": stroke[:, 0], "y": stroke[:, 1]}):
+        q = ScratchPad()
+        q.load_brush(get_brushes()[0])
+        q.reset_pad(*pad_size, 1)
+        q.draw(0, 0, Setting(1.0, 0.1, 0.5, 0.5, 0.5, 0.5), array_points)
+        assert np.array_equal(q.render(np.float32), arr1)
+
+    # several strokes in one call share the atomic section of their layer, and draw as separate calls do
+    q = ScratchPad()
+    q.load_brush(get_brushes()[0])
+    q.reset_pad(*pad_size, 2)
+    strokes = [(0, 0, Setting(1.0, 0.1, 0.5, 0.5, 0.5, 0.5), points[:3]),
+               (0, 0, Setting(1.0, 0.1, 0.5, 0.5, 0.5, 0.5), points[2:]),
+               (1, 0, Setting(1.0, 0.3, 0.5, 0.1, 0.5, 0.5), [Point(0.1, 0.1), Point(0.2, 0.15)])]
+    q.draw_strokes(strokes)
+    separate = ScratchPad()
+    separate.load_brush(get_brushes()[0])
+    separate.reset_pad(*pad_size, 2)
+    for stroke_args in strokes:
+        separate.draw(*stroke_args)
+    for layer in range(2):
+        assert q.render_layer(layer, np.float32).any()
+        assert np.array_equal(q.render_layer(layer, np.float32), separate.render_layer(layer, np.float32))
+
+    # render into caller provided buffers, including a strided view
+    out = np.empty((pad_size[1], pad_size[0], 4), dtype=np.float32)
+    p.render_into(out)
+    assert np.array_equal(arr1, out)
+    out = np.zeros((pad_size[1], pad_size[0], 8), dtype=np.float32)
+    p.render_layer_into(0, out[:, :, 4:])
+    assert np.array_equal(arr2, out[:, :, 4:])
+
+    # all instruction sets must produce identical results
+    for isa in get_simd_isas():
+        set_simd_isa(isa)
+        assert np.array_equal(arr1, p.render(np.float32))
+    set_simd_isa(get_simd_isas()[0])
+
+    # only tiles touched by a stroke are rendered again
+    p.draw(0, 0, Setting(1.0, 0.2, 0.5, 0.1, 0.5, 0.5), [Point(0.1, 0.1), Point(0.2, 0.15)])
+    assert np.array_equal(p.render(np.float32), p.render_layer(0, np.float32))
+    assert not np.array_equal(arr1, p.render(np.float32))
+
+    # downsampled rendering keeps the average alpha
+    full = p.render(np.float32)
+    small = p.render(np.float32, out_size=(128, 96))
+    assert small.shape == (96, 128, 4)
+    assert abs(small[:, :, 3].mean() - full[:, :, 3].mean()) < 1e-4
+    assert p.render(np.uint8, out_size=(64, 64), filter="bilinear").shape == (64, 64, 4)
+    # box filtering by a whole factor averages blocks of pixels, rounded to fix15 before the conversion
+    q = ScratchPad()
+    q.load_brush(get_brushes()[0])
+    q.reset_pad(512, 256, 1)
+    q.draw(0, 0, Setting(1.0, 0.3, 0.5, 0.5, 0.5, 0.5), [Point(0.1, 0.2), Point(0.5, 0.7), Point(0.9, 0.3)])
+    blocks = layer_pixels(q, 0).reshape(64, 4, 128, 4, 4).sum(axis=(1, 3))
+    averaged = (blocks + 8) // 16
+    averaged[:, :, :3] = np.minimum(averaged[:, :, :3], averaged[:, :, 3:])
+    assert np.array_equal(q.render(np.float32, out_size=(128, 64)), fix15_to_float32(averaged))
+
+    # scratch memory of resampled renders is reused, it stops growing once warmed up
+    set_omp_max_threads(1)
+    q = ScratchPad()
+    q.load_brush(get_brushes()[0])
+    q.reset_pad(*pad_size, 1)
+    q.draw(0, 0, Setting(1.0, 0.1, 0.5, 0.5, 0.5, 0.5), points)
+    q.render(np.float32, out_size=(128, 96))
+    reserved = get_scratch_reserved()
+    assert reserved > 0
+    for i in range(5):
+        q.draw(0, 0, Setting(1.0, 0.2, 0.5, 0.1, 0.5, 0.5), [Point(0.1 * i, 0.1), Point(0.1 * i + 0.2, 0.9)])
+        q.render(np.float32, out_size=(128, 96))
+        assert get_scratch_reserved() == reserved
+    set_omp_max_threads(4)
+
+    # other layouts and channels select from the same pixels
+    assert np.array_equal(p.render(np.float32, layout="CHW"), full.transpose(2, 0, 1))
+    assert np.array_equal(p.render(np.float32, channels="RGB"), full[:, :, :3])
+    assert np.array_equal(p.render(np.float32, layout="CHW", channels="A"), full[None, :, :, 3])
+    assert p.render(np.uint8, channels="L").shape == (pad_size[1], pad_size[0], 1)
+
+    # compositing over a background and normalization are fused into the conversion
+    mean, std = np.array([0.5, 0.4, 0.3]), np.array([0.2, 0.3, 0.4])
+    alpha = full[:, :, 3:] * 2
+    expected = (full[:, :, :3] * alpha + (1 - alpha) - mean) / std
+    obs = p.render(np.float32, channels="RGB", background=(1, 1, 1), mean=mean, std=std)
+    assert np.allclose(obs, expected, atol=1e-3)
+
+    # half precision outputs are rounded from the same values
+    assert np.array_equal(p.render(np.float16), full.astype(np.float16))
+    bf16 = p.render(np.uint16, encoding="bfloat16")
+    assert np.allclose((bf16.astype(np.uint32) << 16).view(np.float32), full, atol=1 / 128)
+
+    # full range integers keep the precision of fix15, alpha is not halved
+    u16 = p.render(np.uint16, encoding="full_range")
+    assert np.allclose(u16[:, :, :3] / 65535, full[:, :, :3], atol=1 / 65535)
+    assert np.allclose(u16[:, :, 3] / 65535, full[:, :, 3] * 2, atol=1 / 65535)
+    for isa in get_simd_isas():
+        set_simd_isa(isa)
+        assert np.array_equal(u16, p.render_layer(0, np.uint16, encoding="full_range"))
+    set_simd_isa(get_simd_isas()[0])
+
+    # restoring a snapshot writes back the tiles drawn since, forks are independent pads
+    snapshot = p.snapshot()
+    forks = p.fork(2)
+    p.draw(0, 0, Setting(1.0, 0.3, 0.5, 0.7, 0.5, 0.5), [Point(0.5, 0.5), Point(0.9, 0.6)])
+    assert not np.array_equal(full, p.render(np.float32))
+    assert np.array_equal(full, forks[0].render(np.float32))
+    p.restore(snapshot)
+    assert np.array_equal(full, p.render(np.float32))
+    # tiles left empty by the fork or the restore are blank when drawn into again
+    for pad in [p, forks[1]]:
+        pad.draw(0, 0, Setting(1.0, 0.3, 0.5, 0.7, 0.5, 0.5), [Point(0.05, 0.9), Point(0.1, 0.95)])
+    assert np.array_equal(p.render(np.float32), forks[1].render(np.float32))
+    # forks of forks share tiles copy-on-write, views of shared layers hold their own copy
+    nested = forks[1].fork(2)
+    nested[0].draw(0, 0, Setting(1.0, 0.3, 0.5, 0.7, 0.5, 0.5), [Point(0.7, 0.1), Point(0.8, 0.2)])
+    assert np.array_equal(nested[1].render(np.float32), forks[1].render(np.float32))
+    assert not np.array_equal(nested[0].render(np.float32), nested[1].render(np.float32))
+    assert np.array_equal(nested[1].layer_view(0), forks[1].layer_view(0))
+
+    # resets of the same size clear the layers in place
+    p.reset_pad(*pad_size, 2)
+    assert not p.render(np.float32).any()
+    p.pop_layer(0)
+    p.add_layer()
+    assert not p.render_layer(1, np.float32).any()
+
+    # images are premultiplied into a layer, renders report alpha halved
+    image = np.random.randint(0, 256, (pad_size[1], pad_size[0], 3), dtype=np.uint8)
+    p.set_layer(0, image)
+    rendered = p.render_layer(0, np.float32)
+    assert np.allclose(rendered[:, :, 0:3], image / 255, atol=1e-3) and np.all(rendered[:, :, 3] == 0.5)
+    for dtype in [np.uint8, np.uint16, np.int32]:
+        opaque = p.render_layer(0, dtype, encoding="full_range")[:, :, 3]
+        assert np.all(opaque == np.iinfo(dtype).max)
+    p.set_layer(0, np.dstack([image / 255, np.ones(image.shape[:2])]))
+    assert np.allclose(p.render_layer(0, np.float32), rendered, atol=1e-3)
+
+    # the view is the tile-major fix15 storage of the layer, without a copy
+    p.set_layer(0, image)
+    view = p.layer_view(0)
+    assert view.shape == ((pad_size[1] + 63) // 64, (pad_size[0] + 63) // 64, 64, 64, 4)
+    assert view.dtype == np.uint16 and not view.flags.writeable
+    pixels = view.transpose(0, 2, 1, 3, 4).reshape(view.shape[0] * 64, view.shape[1] * 64, 4)
+    pixels = pixels[:pad_size[1], :pad_size[0]]
+    assert np.all(pixels[:, :, 3] == 1 << 15)
+    assert np.array_equal(pixels[:, :, 0:3], (image.astype(np.uint32) * 257 + 1) >> 1)
+    # surfaces held by a view are not recycled, the view keeps its pixels after the layer is popped
+    kept = view.copy()
+    p.pop_layer(0)
+    p.add_layer()
+    p.draw(1, 0, Setting(1.0, 0.1, 0.5, 0.5, 0.5, 0.5), points)
+    assert p.render_layer(1, np.float32).any()
+    assert np.array_equal(view, kept)
+
+    # empty tiles are skipped by the blend and cleared by the conversion, a partly drawn pad
+    # renders as the blend of all pixels, tiles drawn into are checked again by the next render
+    q = ScratchPad()
+    q.load_brush(get_brushes()[0])
+    q.reset_pad(*pad_size, 2)
+    for layer in range(2):
+        q.set_layer(layer, np.zeros((pad_size[1], pad_size[0], 4), dtype=np.float32))
+        assert np.all(q.tile_state(layer) == 1)
+    q.set_opacity(1, 0.5)
+    assert not q.render(np.float32).any()
+    q.draw(0, 0, Setting(1.0, 0.1, 0.5, 0.5, 0.5, 0.5), [Point(0.1, 0.1), Point(0.3, 0.2)])
+    assert np.any(q.tile_state(0) == 0) and np.all(q.tile_state(1) == 1)
+    q.draw(1, 0, Setting(1.0, 0.1, 0.5, 0.5, 0.5, 0.5), [Point(0.2, 0.15), Point(0.4, 0.3)])
+    assert np.array_equal(q.render(np.float32), composite_reference(q, 2, 0.5))
+    states = [q.tile_state(layer) for layer in range(2)]
+    assert all(np.all(state != 0) and np.any(state == 2) for state in states)
+    assert np.any((states[0] == 1) & (states[1] == 1))
+    q.draw(1, 0, Setting(1.0, 0.1, 0.5, 0.5, 0.5, 0.5), [Point(0.8, 0.8), Point(0.9, 0.85)])
+    touched = q.tile_state(1) == 0
+    assert touched.any() and np.all(states[1][touched] == 1)
+    assert np.array_equal(q.render(np.float32), composite_reference(q, 2, 0.5))
+    assert np.all(q.tile_state(1)[touched] != 0) and np.any(q.tile_state(1)[touched] == 2)
     show_image(arr1[:, :, 0:3])
 
     plt.show()
@@ -3,8 +3,11 @@ from scratchpad import (
     Point,
     BatchedScratchPad,
     get_brushes,
-    set_omp_max_threads
+    set_omp_max_threads,
+    get_scratch_reserved
 )
+import asyncio
+import threading
 import numpy as np
 import matplotlib.pyplot as plt
 
@@ -33,6 +36,25 @@ def show_image(array, title="image"):
 pad_size = (1023, 1001)
 
 
+async def _await(handle):
+    return await handle
+
+
+async def _await_step(handle):
+    # a pending handle yields a future of the loop, resolved by the work without polling
+    try:
+        step = handle.__await__().__next__()
+    except StopIteration as stop:
+        return stop.value
+    assert isinstance(step, asyncio.Future)
+    await step
+    return handle.wait()
+
+
+async def _gather(*handles):
+    return await asyncio.gather(*handles)
+
+
 if __name__ == "__main__":
     set_omp_max_threads(4)
     p = BatchedScratchPad(2)
@@ -40,6 +62,14 @@ if __name__ == "__main__":
     p.reset_pad(0, *pad_size, 1)
     p.reset_all_pads(*pad_size, 1)
     assert p.get_pad_num() == 2
+    assert p.get_thread_num() >= 1
+    assert BatchedScratchPad(8, thread_num=2).get_thread_num() == 2
+    for pad_num, thread_num in [(0, 1), (-1, 1), (2, -1)]:
+        try:
+            BatchedScratchPad(pad_num, thread_num=thread_num)
+            assert False
+        except ValueError:
+            pass
     assert p.get_brush_num() == 1
     assert p.get_pad_size(0) == pad_size
     assert p.get_layer_num(0) == 1
@@ -56,6 +86,169 @@ if __name__ == "__main__":
     arr1 = p.render([0, 1], np.float32)
     arr2 = p.render_layer([0, 1], [0, 0], np.float32)
     assert np.allclose(arr1[0], arr2[0]) and np.allclose(arr1[1], arr2[1])
+
+    # ragged strokes given as a flat array with offsets
+    stroke = np.array([[pt.x, pt.y, pt.xtilt, pt.ytilt, pt.pressure, pt.dtime] for pt in points], dtype=np.float32)
+    p.add_layer(0)
+    p.add_layer(1)
+    p.draw([0, 1], [1, 1], [0, 0], np.array([[1.0, 0.1, 0.5, 0.5, 0.5, 0.5]] * 2, dtype=np.float32),
+           np.concatenate([stroke, stroke]), np.array([0, len(stroke), 2 * len(stroke)]))
+    layers = p.render_layer([0, 1], [1, 1], np.float32)
+    assert np.array_equal(layers[0], layers[1]) and layers[0].any()
+    p.draw_strokes([0, 1], [[(1, 0, Setting(1.0, 0.1, 0.5, 0.5, 0.5, 0.5), points)]] * 2)
+    layers = p.render_layer([0, 1], [1, 1], np.float32)
+    assert np.array_equal(layers[0], layers[1])
+    p.pop_layer(0, 1)
+    p.pop_layer(1, 1)
+
+    # render into caller provided buffers
+    out = np.empty((2, pad_size[1], pad_size[0], 4), dtype=np.float32)
+    p.render_into([0, 1], [out[0], out[1]])
+    assert np.array_equal(arr1[0], out[0]) and np.array_equal(arr1[1], out[1])
+    p.render_layer_into([1], [0], [out[0]])
+    assert np.array_equal(arr2[1], out[0])
+
+    # work on the same pad runs in order, even if it is listed twice
+    p.render_into([0, 0], [out[0], out[1]])
+    assert np.array_equal(out[0], arr1[0]) and np.array_equal(out[1], arr1[0])
+
+    # render as a single contiguous batch
+    batch = p.render_batch([0, 1], np.float32)
+    assert batch.shape == (2, pad_size[1], pad_size[0], 4)
+    assert np.array_equal(batch, np.stack(arr1))
+    out[...] = 0
+    p.render_into([1, 0], out)
+    assert np.array_equal(out[0], arr1[1]) and np.array_equal(out[1], arr1[0])
+
+    # downsampled rendering
+    small = p.render_batch([0, 1], np.float32, out_size=(64, 32), filter="bilinear")
+    assert small.shape == (2, 32, 64, 4)
+    assert np.array_equal(small[1], p.render([1], np.float32, out_size=(64, 32), filter="bilinear")[0])
+    # resampled passes are split to bands, like a whole render on a single worker
+    for size in [(64, 32), (300, 500)]:
+        banded = p.render_batch([0, 1], np.float32, out_size=size, filter="bilinear")
+        assert np.array_equal(banded, p.render_batch_async([0, 1], np.float32, out_size=size, filter="bilinear").wait())
+    chw = p.render_batch([0, 1], np.float32, layout="CHW", channels="RGB")
+    assert np.array_equal(chw, p.render_batch([0, 1], np.float32)[:, :, :, :3].transpose(0, 3, 1, 2))
+
+    # async work on a pad runs in order, a render after a draw sees the stroke
+    r = BatchedScratchPad(2)
+    r.load_brush(get_brushes()[0])
+    r.reset_all_pads(*pad_size, 1)
+    draw = r.draw_async([0, 1], [0, 0], [0, 0], [Setting(1.0, 0.1, 0.5, 0.5, 0.5, 0.5)] * 2, [points] * 2)
+    rendered = r.render_async([0, 1], np.float32)
+    assert draw.wait() is None
+    arrays = rendered.wait()
+    assert rendered.done() and np.array_equal(arrays[0], arr1[0]) and np.array_equal(arrays[1], arr1[1])
+    assert np.array_equal(asyncio.run(_await(r.render_batch_async([0, 1], np.float32))), np.stack(arr1))
+    big = BatchedScratchPad(1, thread_num=1)
+    big.load_brush(get_brushes()[0])
+    big.reset_all_pads(2048, 2048, 4)
+    big.draw_async([0] * 64, [0] * 64, [0] * 64, [Setting(1.0, 0.1, 0.5, 0.5, 0.5, 0.5)] * 64, [points] * 64)
+    assert asyncio.run(_await_step(big.render_async([0], np.float32, out_size=(64, 64))))[0].shape == (64, 64, 4)
+    # tile lists and resampling buffers of the workers come from their arenas, which stop growing
+    for out_size in [None, (64, 64), None]:
+        big.render([0], np.float32, out_size=out_size)
+    reserved = get_scratch_reserved()
+    for k in range(4):
+        big.draw([0], [k], [0], [Setting(1.0, 0.1, 0.5, 0.5, 0.5, 0.5)], [points])
+        big.render([0], np.float32)
+        big.render([0], np.float32, out_size=(64, 64))
+        assert get_scratch_reserved() == reserved
+    gathered = asyncio.run(_gather(r.render_async([0], np.float32), r.render_async([1], np.float32)))
+    assert np.array_equal(gathered[0][0], arr1[0]) and np.array_equal(gathered[1][0], arr1[1])
+    # each handle wakes the loop which awaits it, loops of other threads included
+    awaited = {}
+    loops = [threading.Thread(target=lambda pad: awaited.update({pad: asyncio.run(_await_step(
+        r.render_async([pad], np.float32)))}), args=(pad,)) for pad in range(2)]
+    for loop in loops:
+        loop.start()
+    for loop in loops:
+        loop.join()
+    assert all(np.array_equal(awaited[pad][0], arr1[pad]) for pad in range(2))
+
+    # a render holds its pads, async draws from another thread run before or after it
+    r.reset_all_pads(*pad_size, 1)
+    drawer = threading.Thread(target=lambda: [r.draw_async([0], [0], [0], [Setting(1.0, 0.1, 0.5, 0.5, 0.5, 0.5)],
+                                                           [points]).wait() for _ in range(20)])
+    drawer.start()
+    while drawer.is_alive():
+        r.render([0, 1], np.float32)
+    drawer.join()
+    assert np.array_equal(r.render([0], np.float32)[0], r.render_async([0], np.float32).wait()[0])
+
+    # threads holding the same pads are each released after the work they submitted before
+    def holders_pads():
+        pads = BatchedScratchPad(2)
+        for _ in range(2):
+            pads.load_brush(get_brushes()[0])
+        pads.reset_all_pads(256, 256, 2)
+        return pads
+
+    def hold_after_draws(pads, layer, frames):
+        for k in range(30):
+            draw = pads.draw_async([0, 1], [layer] * 2, [layer] * 2, [Setting(1.0, 0.1, 0.5, 0.5, 0.5, 0.5)] * 2,
+                                   [[Point(0.1 + 0.02 * k, 0.2 + 0.4 * layer), Point(0.2 + 0.02 * k, 0.3 + 0.4 * layer)]] * 2)
+            frames.append(pads.render_layer([0, 1], [layer] * 2, np.float32))
+            draw.wait()
+
+    expected, frames = [[], []], [[], []]
+    for layer in range(2):
+        hold_after_draws(holders_pads(), layer, expected[layer])
+    s = holders_pads()
+    holders = [threading.Thread(target=hold_after_draws, args=(s, layer, frames[layer])) for layer in range(2)]
+    for holder in holders:
+        holder.start()
+    for holder in holders:
+        holder.join()
+    assert len(frames[0]) == len(frames[1]) == 30
+    assert all(np.array_equal(a, b) for layer in range(2) for frame, ref in zip(frames[layer], expected[layer])
+               for a, b in zip(frame, ref))
+
+    # a step draws and renders each pad in one task
+    r.reset_all_pads(*pad_size, 1)
+    obs = r.step([1, 0], [0, 0], [0, 0], np.array([[1.0, 0.1, 0.5, 0.5, 0.5, 0.5]] * 2, dtype=np.float32),
+                 np.concatenate([stroke, stroke]), np.array([0, len(stroke), 2 * len(stroke)]), np.float32)
+    assert obs.shape == (2, pad_size[1], pad_size[0], 4)
+    assert np.array_equal(obs, np.stack(r.render([1, 0], np.float32)))
+
+    # pads of different sizes are split to tiles and rendered together
+    q = BatchedScratchPad(2, thread_num=3)
+    q.load_brush(get_brushes()[0])
+    q.reset_pad(0, *pad_size, 1)
+    q.reset_pad(1, 200, 100, 1)
+    q.draw([0, 1], [0, 0], [0, 0], [Setting(1.0, 0.1, 0.5, 0.5, 0.5, 0.5)] * 2, [points] * 2)
+    mixed = q.render([0, 1], np.float32)
+    assert mixed[1].shape == (100, 200, 4) and mixed[1].any()
+    assert np.array_equal(mixed[0], arr1[0])
+
+    # every wait policy gives the same results, sync and async
+    for policy in ["spin", "spin_yield", "park"]:
+        q.set_wait_policy(policy)
+        assert q.get_wait_policy() == policy
+        assert all(np.array_equal(a, b) for a, b in zip(q.render([0, 1], np.float32), mixed))
+        assert all(np.array_equal(a, b) for a, b in zip(q.render_async([0, 1], np.float32).wait(), mixed))
+        assert q.get_layer_num(1) == 1 and q.get_pad_size(1) == (200, 100)
+    try:
+        q.set_wait_policy("sleep")
+        assert False
+    except ValueError:
+        pass
+    assert q.get_wait_policy() == "park"
+
+    # pads reset from a template drawn on one of them
+    q.set_template(0)
+    q.reset_from_template()
+    assert np.array_equal(q.render_batch([0, 1], np.float32), np.stack([arr1[0]] * 2))
+    q.draw([1], [0], [0], [Setting(1.0, 0.3, 0.5, 0.1, 0.5, 0.5)], [points])
+    q.reset_from_template([1])
+    assert np.array_equal(q.render([1], np.float32)[0], arr1[0])
+
+    # layers of several pads set from images in parallel
+    images = np.zeros((2, pad_size[1], pad_size[0], 4), dtype=np.uint16)
+    q.set_layer([0, 1], [0, 0], images)
+    assert not q.render_batch([0, 1], np.float32).any()
+    assert not q.layer_view(1, 0).any()
     show_image(arr1[0][:, :, 0:3])
 
     plt.show()